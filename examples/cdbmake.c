@@ -0,0 +1,69 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "qdecoder.h"
+
+/*
+ * Build a constant database from a text file in qentry_t->save() format.
+ *
+ *   $ cat redirects.txt
+ *   /old/path=/new/path
+ *   /about%20us=/about
+ *   $ ./cdbmake redirects.txt redirects.cdb
+ */
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s INPUT_FILE OUTPUT_FILE\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    qentry_t *entry = qEntry();
+    entry->load(entry, argv[1]);
+    if (qcdb_build(entry, argv[2]) == false) {
+        fprintf(stderr, "Can't build %s\n", argv[2]);
+        entry->free(entry);
+        return EXIT_FAILURE;
+    }
+    printf("%d records.\n", entry->size(entry));
+    entry->free(entry);
+
+    // verify
+    qentry_t *cdb = qcdb_open(argv[2]);
+    if (cdb == NULL) {
+        fprintf(stderr, "Can't open %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+    cdb->free(cdb);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <string_view>
+#include "qdecoder.hpp"
+
+using namespace qdecoder::literals;
+
+int main(void)
+{
+#ifdef ENABLE_FASTCGI
+    while(FCGI_Accept() >= 0) {
+#endif
+    // Parse queries.
+    qdecoder::request req;
+    qdecoder::response res(req);
+
+    // Get values, no copies are made. keys are hashed at compile time.
+    std::string_view value = req.str("query"_qk, "(nothing)");
+    int count = req.get<int>("count"_qk).value_or(1);
+
+    // Print out
+    res.setcontenttype("text/html");
+    for (int i = 0; i < count; i++) {
+        printf("You entered: <b>%.*s</b>\n", (int)value.size(), value.data());
+    }
+
+    // List all
+    printf("<p>\n");
+    for (const qdecoder::entry &e : req) {
+        printf("%.*s = %.*s<br>\n", (int)e.name().size(), e.name().data(),
+               (int)e.str().size(), e.str().data());
+    }
+#ifdef ENABLE_FASTCGI
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,58 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include "qdecoder.h"
+
+int main(void)
+{
+#ifdef ENABLE_FASTCGI
+    while(FCGI_Accept() >= 0) {
+#endif
+    // Parse queries.
+    qentry_t *req = qcgireq_parse(NULL, 0);
+
+    // Print out metrics in Prometheus text format.
+    qcgires_setcontenttype(req, "text/plain; version=0.0.4");
+    if (qcgimetrics_export(NULL, stdout) == false) {
+        printf("# metrics segment is not available.\n");
+    }
+
+    // De-allocate memories
+    req->free(req);
+#ifdef ENABLE_FASTCGI
+    }
+#endif
+    return 0;
+}
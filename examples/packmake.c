@@ -0,0 +1,84 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include "qdecoder.h"
+
+/*
+ * Build an asset pack from files. The member names are the paths as given.
+ *
+ *   $ cd htdocs && ../packmake ../assets.pack $(find icons css -type f)
+ */
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s OUTPUT_FILE FILE...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    qentry_t *files = qEntry();
+    int i;
+    for (i = 2; i < argc; i++) {
+        const char *name = argv[i];
+        if (!strncmp(name, "./", 2)) name += 2;
+        files->putstr(files, name, argv[i], false);
+    }
+    if (qcgipack_build(files, argv[1]) == false) {
+        fprintf(stderr, "Can't build %s\n", argv[1]);
+        files->free(files);
+        return EXIT_FAILURE;
+    }
+
+    // verify
+    qcgipack_t *pack = qcgipack_open(argv[1]);
+    if (pack == NULL) {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        files->free(files);
+        return EXIT_FAILURE;
+    }
+    qentobj_t *obj;
+    for (obj = files->first; obj != NULL; obj = obj->next) {
+        off_t length;
+        const char *mimetype, *etag;
+        if (qcgipack_stat(pack, obj->name, &length, NULL, &mimetype, &etag)
+            == false) {
+            fprintf(stderr, "Missing %s\n", obj->name);
+            continue;
+        }
+        printf("%s %jd %s %s\n", obj->name, (intmax_t)length, mimetype, etag);
+    }
+    qcgipack_free(pack);
+    files->free(files);
+
+    return EXIT_SUCCESS;
+}
@@ -43,6 +43,9 @@ int main(void)
 #ifdef ENABLE_FASTCGI
     while(FCGI_Accept() >= 0) {
 #endif
+    // publish upload progress. (see progress.c)
+    qcgiprogress_init(NULL, 0);
+
     // parse queries
     qentry_t *req = qcgireq_setoption(NULL, true, TMPPATH, 60);
     if (req == NULL) qcgires_error(req, "Can't set option.");
@@ -0,0 +1,69 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "qdecoder.h"
+
+#define SOCKPATH    "/tmp/qdecoder-zygote.sock"
+
+int main(void)
+{
+    // Expensive initialization goes here, it's done only once.
+    qentry_t *config = qEntry();
+    config->putstr(config, "greeting", "Hello from zygote", true);
+    pid_t zygote = getpid();
+
+    // Returns in the forked child for each request run by zygote-shim.cgi.
+    if (qcgizygote_accept(SOCKPATH) == false) {
+        fprintf(stderr, "Can't listen on %s\n", SOCKPATH);
+        return 1;
+    }
+
+    // Parse queries.
+    qentry_t *req = qcgireq_parse(NULL, 0);
+
+    // Get query.
+    const char *query = req->getstr(req, "query", false);
+    if (query == NULL) query = "(nothing)";
+
+    // Print out.
+    qcgires_setcontenttype(req, "text/plain");
+    printf("%s (zygote %d, child %d)\n",
+           config->getstr(config, "greeting", false), (int)zygote,
+           (int)getpid());
+    printf("You entered: %s\n", query);
+
+    // De-allocate memories
+    req->free(req);
+    config->free(config);
+    return 0;
+}
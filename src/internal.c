@@ -43,6 +43,8 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <errno.h>
 #include "qdecoder.h"
 #include "internal.h"
@@ -339,3 +341,120 @@ bool _q_countsave(const char *filepath, int number)
     if (updated > 0) return true;
     return false;
 }
+
+// 64-bit FNV-1a. start with FNV64_INIT, or continue with the last hash.
+uint64_t _q_fnv64(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (; size > 0; size--, p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t _q_clock_usec(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) return 0;
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Map a POSIX shared memory segment which begins with a uint32_t magic
+// number and a uint32_t version. created is set to true only for the
+// process which actually created the segment, so it can initialize the
+// rest and publish the magic number at last. A segment left by a creator
+// which died before publishing it, or by another version, is replaced once.
+void *_q_shm_map(const char *name, size_t size, uint32_t magic,
+                 uint32_t version, bool *created)
+{
+    int retry;
+    for (retry = 0; retry < 2; retry++) {
+        *created = false;
+
+        int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, DEF_FILE_MODE);
+        if (fd >= 0) {
+            void *map = MAP_FAILED;
+            if (ftruncate(fd, size) != 0) {
+                WARN("Can't resize shared memory %s. (errno=%d)", name, errno);
+            } else {
+                map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (map == MAP_FAILED) {
+                shm_unlink(name);
+                return NULL;
+            }
+            *created = true;
+            return map;
+        } else if (errno != EEXIST) {
+            WARN("Can't open shared memory %s. (errno=%d)", name, errno);
+            return NULL;
+        }
+
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            if (errno == ENOENT) continue;  // replaced by another process
+            return NULL;
+        }
+
+        // the creator may not have resized it yet.
+        struct stat st;
+        int tries;
+        for (tries = 0; tries < 1000; tries++) {
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                return NULL;
+            }
+            if (st.st_size != 0) break;
+            usleep(1000);
+        }
+
+        // check the header first, another version can have another size.
+        if (st.st_size >= (off_t)(sizeof(uint32_t) * 2)) {
+            void *map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                close(fd);
+                return NULL;
+            }
+            uint32_t *hdr = (uint32_t *)map;
+            if (_q_shm_wait(&hdr[0], magic) == true && hdr[1] == version) {
+                close(fd);
+                if (st.st_size != size) {
+                    WARN("Shared memory %s size mismatch.", name);
+                    munmap(map, st.st_size);
+                    return NULL;
+                }
+                return map;
+            }
+            munmap(map, st.st_size);
+        }
+
+        // stale, unlink it unless another process has replaced it already.
+        int cfd = shm_open(name, O_RDONLY, 0);
+        if (cfd >= 0) {
+            struct stat cst;
+            if (fstat(cfd, &cst) == 0 && cst.st_dev == st.st_dev
+                && cst.st_ino == st.st_ino) {
+                WARN("Replacing stale shared memory %s.", name);
+                shm_unlink(name);
+            }
+            close(cfd);
+        }
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Wait until the segment creator publishes the magic number.
+bool _q_shm_wait(volatile uint32_t *magic, uint32_t value)
+{
+    int tries;
+    for (tries = 0; tries < 1000; tries++) {
+        if (__atomic_load_n(magic, __ATOMIC_ACQUIRE) == value) return true;
+        usleep(1000);
+    }
+    return false;
+}
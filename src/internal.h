@@ -31,14 +31,54 @@
 #ifndef _QINTERNAL_H
 #define _QINTERNAL_H
 
+#include <stdint.h>
+
 /*
  * Internal Macros
  */
-#ifdef BUILD_DEBUG
-#define DEBUG(fmt, args...) fprintf(stderr, "[DEBUG] " fmt " (%s:%d)\n", ##args, __FILE__, __LINE__);
+#define QLOG(level, fmt, args...)                                       \
+    do {                                                                \
+        if ((level) <= _q_loglevel)                                     \
+            _q_log(level, __FILE__, __LINE__, fmt, ##args);             \
+    } while(0)
+
+#define ERROR(fmt, args...) QLOG(Q_LOG_ERROR, fmt, ##args)
+#define WARN(fmt, args...)  QLOG(Q_LOG_WARN, fmt, ##args)
+#define INFO(fmt, args...)  QLOG(Q_LOG_INFO, fmt, ##args)
+#define DEBUG(fmt, args...) QLOG(Q_LOG_DEBUG, fmt, ##args)
+
+/*
+ * USDT static tracepoints (provider "qdecoder")
+ *
+ *   parse__start(int method)
+ *   parse__end(int method, int entries)
+ *   part__begin(char *name)
+ *   part__end(char *name, int size)
+ *   upload__create(char *path)
+ *   upload__close(char *path, int size)
+ *   session__load(char *id, int isnew)
+ *   session__save(char *id)
+ *   session__gc(char *repository, int removed)
+ *   download__start(char *path, off_t size)
+ *   download__end(char *path, int sent)
+ *   ratelimit__reject(char *addr, char *route)
+ *   sched__shed(int class, int waited_usec)
+ *
+ * ex) bpftrace -e 'usdt:/usr/local/lib/libqdecoder.so:qdecoder:part__end
+ *                  { printf("%s %d\n", str(arg0), arg1); }'
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE(name)                     DTRACE_PROBE(qdecoder, name)
+#define PROBE1(name, a1)                DTRACE_PROBE1(qdecoder, name, a1)
+#define PROBE2(name, a1, a2)            DTRACE_PROBE2(qdecoder, name, a1, a2)
+#define PROBE3(name, a1, a2, a3)        DTRACE_PROBE3(qdecoder, name, a1, a2, a3)
 #else
-#define DEBUG(fms, args...)
-#endif  /* BUILD_DEBUG */
+#define PROBE(name)
+#define PROBE1(name, a1)
+#define PROBE2(name, a1, a2)
+#define PROBE3(name, a1, a2, a3)
+#endif  /* ENABLE_USDT */
 
 /*
  * Macro Functions
@@ -70,6 +110,7 @@
 #define MAX_LINEBUF (1023+1)
 #define DEF_DIR_MODE  (S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)
 #define DEF_FILE_MODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
+#define FNV64_INIT    (14695981039346656037ULL)
 
 /*
  * qInternalCommon.c
@@ -89,5 +130,71 @@ extern off_t _q_filesize(const char *filepath);
 extern off_t _q_iosend(FILE *outfp, FILE *infp, off_t nbytes);
 extern int _q_countread(const char *filepath);
 extern bool _q_countsave(const char *filepath, int number);
+extern uint64_t _q_clock_usec(void);
+extern uint64_t _q_fnv64(uint64_t hash, const void *data, size_t size);
+extern void *_q_shm_map(const char *name, size_t size, uint32_t magic,
+                        uint32_t version, bool *created);
+extern bool _q_shm_wait(volatile uint32_t *magic, uint32_t value);
+
+/*
+ * qcgilog.c
+ */
+extern int _q_loglevel;
+extern void _q_log(int level, const char *file, int line,
+                   const char *format, ...)
+                   __attribute__((format(printf, 4, 5)));
+
+/*
+ * qcgireq.c
+ */
+extern bool _q_put_bracket(qentry_t *request, char *name, const void *value,
+                           size_t size);
+
+/*
+ * qcgibody.c
+ */
+extern int _q_body_parse(qentry_t *request, const char *content_type);
+
+/*
+ * qcgiprogress.c
+ */
+extern int _q_progress_begin(off_t expected);
+extern void _q_progress_update(int slot, off_t received);
+extern void _q_progress_end(int slot, bool success);
+
+/*
+ * qcgitrace.c
+ */
+extern int _q_trace_start(const char *name);
+extern void _q_trace_stop(int span);
+extern void _q_trace_response(void);
+
+/*
+ * qcgimetrics.c
+ */
+enum {
+    _Q_M_REQUESTS = 0,      /*!< requests parsed */
+    _Q_M_BYTES_READ,        /*!< request body bytes read */
+    _Q_M_UPLOAD_BYTES,      /*!< uploaded file bytes */
+    _Q_M_PARSE_ERRORS,      /*!< broken or malformed request bodies */
+    _Q_M_LIMIT_REJECTIONS,  /*!< requests rejected by a limit */
+    _Q_M_SESSION_HITS,      /*!< valid session found */
+    _Q_M_SESSION_MISSES,    /*!< new or expired session */
+    _Q_M_SESSION_GC,        /*!< expired sessions removed */
+    _Q_M_DOWNLOAD_BYTES,    /*!< bytes sent by qcgires_download() */
+    _Q_M_MAX
+};
+
+enum {
+    _Q_H_PARSE = 0,         /*!< qcgireq_parse() */
+    _Q_H_SESSION,           /*!< qcgisess_init() */
+    _Q_H_SESSION_SAVE,      /*!< qcgisess_save() */
+    _Q_H_DOWNLOAD,          /*!< qcgires_download() */
+    _Q_H_SCHED_WAIT,        /*!< qcgisched_begin() queueing delay */
+    _Q_H_MAX
+};
+
+extern void _q_metrics_add(int counter, uint64_t value);
+extern void _q_metrics_observe(int histogram, uint64_t usec);
 
 #endif  /* _QINTERNAL_H */
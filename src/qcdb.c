@@ -0,0 +1,616 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcdb.c Constant Database API
+ *
+ * A constant database is an immutable hash table file which is built once
+ * and then mapped into memory by every reader. Lookups go straight to the
+ * mapped pages, so all processes share one page-cache copy and opening it
+ * costs no parsing. It's used through the usual qentry_t interface.
+ *
+ * @code
+ *   [build] (see examples/cdbmake.c)
+ *   qentry_t *entry = qEntry();
+ *   entry->load(entry, "redirects.txt");
+ *   qcdb_build(entry, "redirects.cdb");
+ *   entry->free(entry);
+ *
+ *   [read]
+ *   qentry_t *redirects = qcdb_open("redirects.cdb");
+ *   const char *to = redirects->getstr(redirects, "/old/path", false);
+ *   redirects->free(redirects);
+ * @endcode
+ *
+ * @note
+ * The container is read-only. put(), remove() and the like fail, and the
+ * data pointers returned with newmem false point into the read-only mapping.
+ * Objects are not linked through first/next, use getnext() to walk them.
+ * Code walking first/next sees it empty, qcgimultipart_addentry() rejects
+ * it and the C++ container works only by str(), bytes(), get() and has().
+ * qcdb_build() replaces the file atomically, so running readers keep the old
+ * table until they open it again.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define CDB_MAGIC       "QCDB"
+#define CDB_VERSION     (1)
+#define CDB_ALIGN(n)    (((n) + 7) & ~((uint64_t)7))
+
+/*
+ * file layout : header, records, slots
+ */
+struct _header {
+    char magic[4];
+    uint32_t version;
+    uint64_t num;           /* number of records */
+    uint64_t nslots;        /* power of 2 */
+    uint64_t slotoffset;
+    uint64_t filesize;
+};
+
+struct _record {
+    uint32_t hash;          /* qentry_hash() of the name */
+    uint32_t namelen;       /* without '\0' */
+    uint64_t size;          /* data size */
+    /* name, '\0', data, padded to 8 bytes */
+};
+
+struct _slot {
+    uint32_t hash;
+    uint32_t pad;
+    uint64_t offset;        /* record offset, 0 for an empty slot */
+};
+
+struct _cdb {
+    qentry_t entry;         /* must be the first */
+    char *map;
+    size_t mapsize;
+    const struct _header *header;
+    const struct _slot *slots;
+};
+
+#define RECNAME(r)      ((char *)(r) + sizeof(struct _record))
+#define RECDATA(r)      (RECNAME(r) + (r)->namelen + 1)
+#define RECSIZE(r)      CDB_ALIGN(sizeof(struct _record) + (r)->namelen + 1 \
+                                  + (r)->size)
+
+static const struct _record *_find(struct _cdb *cdb, const char *name,
+                                   uint32_t hash, bool last);
+static const struct _record *_record(struct _cdb *cdb, uint64_t offset);
+static void *_data(const struct _record *rec, size_t *size, bool newmem);
+
+static bool _put(qentry_t *entry, const char *name, const void *data,
+                 size_t size, bool replace);
+static bool _putstr(qentry_t *entry, const char *name, const char *str,
+                    bool replace);
+static bool _putstrf(qentry_t *entry, bool replace, const char *name,
+                     const char *format, ...);
+static bool _putint(qentry_t *entry, const char *name, int num, bool replace);
+static void *_get(qentry_t *entry, const char *name, size_t *size, bool newmem);
+static void *_getlast(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem);
+static char *_getstr(qentry_t *entry, const char *name, bool newmem);
+static char *_getstrf(qentry_t *entry, bool newmem, const char *namefmt, ...);
+static char *_getstrlast(qentry_t *entry, const char *name, bool newmem);
+static int _getint(qentry_t *entry, const char *name);
+static int _getintlast(qentry_t *entry, const char *name);
+static void *_caseget(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem);
+static char *_casegetstr(qentry_t *entry, const char *name, bool newmem);
+static int _casegetint(qentry_t *entry, const char *name);
+static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
+                     bool newmem);
+static int _size(qentry_t *entry);
+static int _remove(qentry_t *entry, const char *name);
+static bool _truncate(qentry_t *entry);
+static bool _reverse(qentry_t *entry);
+static bool _save(qentry_t *entry, const char *filepath);
+static int _load(qentry_t *entry, const char *filepath);
+static bool _print(qentry_t *entry, FILE *out, bool print_data);
+static bool _free(qentry_t *entry);
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem);
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create);
+
+#endif
+
+/**
+ * Open a constant database file as a read-only qentry_t container.
+ *
+ * @param filepath  file built by qcdb_build().
+ *
+ * @return  qentry_t container pointer if successful, otherwise returns NULL.
+ */
+qentry_t *qcdb_open(const char *filepath)
+{
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct _header)) {
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const struct _header *header = (const struct _header *)map;
+    if (memcmp(header->magic, CDB_MAGIC, sizeof(header->magic))
+        || header->version != CDB_VERSION
+        || header->filesize != st.st_size
+        || header->nslots == 0
+        || (header->nslots & (header->nslots - 1)) != 0
+        || header->slotoffset < sizeof(struct _header)
+        || header->slotoffset > st.st_size
+        || (st.st_size - header->slotoffset) / sizeof(struct _slot)
+           < header->nslots) {
+        WARN("Invalid constant database %s.", filepath);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct _cdb *cdb = (struct _cdb *)calloc(1, sizeof(struct _cdb));
+    if (cdb == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    cdb->map = map;
+    cdb->mapsize = st.st_size;
+    cdb->header = header;
+    cdb->slots = (const struct _slot *)(map + header->slotoffset);
+
+    qentry_t *entry = &cdb->entry;
+    entry->put          = _put;
+    entry->putstr       = _putstr;
+    entry->putstrf      = _putstrf;
+    entry->putint       = _putint;
+
+    entry->get          = _get;
+    entry->getlast      = _getlast;
+    entry->getstr       = _getstr;
+    entry->getstrf      = _getstrf;
+    entry->getstrlast   = _getstrlast;
+
+    entry->getint       = _getint;
+    entry->getintlast   = _getintlast;
+
+    entry->caseget      = _caseget;
+    entry->casegetstr   = _casegetstr;
+    entry->casegetint   = _casegetint;
+
+    entry->getnext      = _getnext;
+
+    entry->size         = _size;
+    entry->remove       = _remove;
+    entry->truncate     = _truncate;
+    entry->reverse      = _reverse;
+
+    entry->save         = _save;
+    entry->load         = _load;
+
+    entry->print        = _print;
+    entry->free         = _free;
+
+    entry->gethash      = _gethash;
+    entry->getchild     = _getchild;
+
+    entry->num = header->num;
+
+    return entry;
+}
+
+/**
+ * Build a constant database file from a qentry_t container.
+ *
+ * @param entry     qentry_t container pointer.
+ * @param filepath  file path to create or replace.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * Objects are stored in the order of the container. Same names are kept,
+ * get() finds the first one and getlast() the last one. Nested containers
+ * are not stored.
+ */
+bool qcdb_build(qentry_t *entry, const char *filepath)
+{
+    if (entry == NULL || filepath == NULL) return false;
+
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", filepath);
+    int fd = mkstemp(tmppath);
+    if (fd < 0) return false;
+    fchmod(fd, DEF_FILE_MODE);
+
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmppath);
+        return false;
+    }
+
+    struct _header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CDB_MAGIC, sizeof(header.magic));
+    header.version = CDB_VERSION;
+    for (header.nslots = 2; header.nslots < (uint64_t)entry->num * 2;
+         header.nslots *= 2);
+
+    struct _slot *slots = (struct _slot *)calloc(header.nslots,
+                                                 sizeof(struct _slot));
+    bool ioerror = (slots == NULL
+                    || fwrite(&header, sizeof(header), 1, fp) != 1);
+
+    // records
+    static const char pad[8];
+    uint64_t offset = sizeof(header);
+    qentobj_t *obj;
+    for (obj = entry->first; obj != NULL && ioerror == false; obj = obj->next) {
+        if (obj->child != NULL) continue;
+
+        struct _record rec;
+        rec.hash = obj->hash;
+        rec.namelen = strlen(obj->name);
+        rec.size = obj->size;
+        size_t padlen = RECSIZE(&rec) - (sizeof(rec) + rec.namelen + 1
+                                         + rec.size);
+        if (fwrite(&rec, sizeof(rec), 1, fp) != 1
+            || fwrite(obj->name, rec.namelen + 1, 1, fp) != 1
+            || (rec.size > 0 && fwrite(obj->data, rec.size, 1, fp) != 1)
+            || (padlen > 0 && fwrite(pad, padlen, 1, fp) != 1)) {
+            ioerror = true;
+            break;
+        }
+
+        // open addressing with linear probing
+        uint64_t i = rec.hash & (header.nslots - 1);
+        while (slots[i].offset != 0) i = (i + 1) & (header.nslots - 1);
+        slots[i].hash = rec.hash;
+        slots[i].offset = offset;
+
+        offset += RECSIZE(&rec);
+        header.num++;
+    }
+
+    // slots and header
+    if (ioerror == false) {
+        header.slotoffset = offset;
+        header.filesize = offset + sizeof(struct _slot) * header.nslots;
+        if (fwrite(slots, sizeof(struct _slot), header.nslots, fp)
+            != header.nslots
+            || fseek(fp, 0, SEEK_SET) != 0
+            || fwrite(&header, sizeof(header), 1, fp) != 1
+            || fflush(fp) != 0 || fsync(fd) != 0) {
+            ioerror = true;
+        }
+    }
+    if (slots != NULL) free(slots);
+    if (fclose(fp) != 0) ioerror = true;
+
+    if (ioerror == true || rename(tmppath, filepath) != 0) {
+        ERROR("Can't build constant database %s.", filepath);
+        unlink(tmppath);
+        return false;
+    }
+
+    return true;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static const struct _record *_find(struct _cdb *cdb, const char *name,
+                                   uint32_t hash, bool last)
+{
+    const struct _record *found = NULL;
+    uint64_t mask = cdb->header->nslots - 1;
+    uint64_t i, n;
+    for (i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        const struct _slot *slot = &cdb->slots[i];
+        if (slot->offset == 0) break;
+        if (slot->hash != hash) continue;
+
+        const struct _record *rec = _record(cdb, slot->offset);
+        if (rec == NULL || strcmp(RECNAME(rec), name)) continue;
+
+        found = rec;
+        if (last == false) break;
+    }
+
+    return found;
+}
+
+// record at the offset, NULL if it runs out of the records area.
+static const struct _record *_record(struct _cdb *cdb, uint64_t offset)
+{
+    uint64_t end = cdb->header->slotoffset;
+    if (offset < sizeof(struct _header) || offset > end
+        || end - offset < sizeof(struct _record)) {
+        return NULL;
+    }
+
+    const struct _record *rec = (const struct _record *)(cdb->map + offset);
+    if (end - offset - sizeof(struct _record) < (uint64_t)rec->namelen + 1
+        || end - offset - sizeof(struct _record) - rec->namelen - 1
+           < rec->size
+        || RECNAME(rec)[rec->namelen] != '\0') {
+        return NULL;
+    }
+
+    return rec;
+}
+
+static void *_data(const struct _record *rec, size_t *size, bool newmem)
+{
+    if (rec == NULL) return NULL;
+    if (size != NULL) *size = rec->size;
+
+    if (newmem == false) return RECDATA(rec);
+
+    void *data = malloc((rec->size > 0) ? rec->size : 1);
+    if (data == NULL) return NULL;
+    memcpy(data, RECDATA(rec), rec->size);
+    return data;
+}
+
+static bool _put(qentry_t *entry, const char *name, const void *data,
+                 size_t size, bool replace)
+{
+    return false;
+}
+
+static bool _putstr(qentry_t *entry, const char *name, const char *str,
+                    bool replace)
+{
+    return false;
+}
+
+static bool _putstrf(qentry_t *entry, bool replace, const char *name,
+                     const char *format, ...)
+{
+    return false;
+}
+
+static bool _putint(qentry_t *entry, const char *name, int num, bool replace)
+{
+    return false;
+}
+
+static void *_get(qentry_t *entry, const char *name, size_t *size, bool newmem)
+{
+    if (entry == NULL || name == NULL) return NULL;
+    return _gethash(entry, name, qentry_hash(name, strlen(name)), size,
+                    newmem);
+}
+
+static void *_getlast(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem)
+{
+    if (entry == NULL || name == NULL) return NULL;
+
+    struct _cdb *cdb = (struct _cdb *)entry;
+    uint32_t hash = qentry_hash(name, strlen(name));
+    return _data(_find(cdb, name, hash, true), size, newmem);
+}
+
+static char *_getstr(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_get(entry, name, NULL, newmem);
+}
+
+static char *_getstrf(qentry_t *entry, bool newmem, const char *namefmt, ...)
+{
+    char *name;
+    DYNAMIC_VSPRINTF(name, namefmt);
+    if (name == NULL) return NULL;
+
+    char *data = (char *)_get(entry, name, NULL, newmem);
+    free(name);
+
+    return data;
+}
+
+static char *_getstrlast(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_getlast(entry, name, NULL, newmem);
+}
+
+static int _getint(qentry_t *entry, const char *name)
+{
+    const char *str = _get(entry, name, NULL, false);
+    return (str != NULL) ? atoi(str) : 0;
+}
+
+static int _getintlast(qentry_t *entry, const char *name)
+{
+    const char *str = _getlast(entry, name, NULL, false);
+    return (str != NULL) ? atoi(str) : 0;
+}
+
+// no index for this, scans all the records.
+static void *_caseget(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem)
+{
+    if (entry == NULL || name == NULL) return NULL;
+
+    qentobj_t obj;
+    memset((void *)&obj, 0, sizeof(obj));
+    while (_getnext(entry, &obj, NULL, false) == true) {
+        if (!strcasecmp(name, obj.name)) {
+            if (size != NULL) *size = obj.size;
+            if (newmem == false) return obj.data;
+
+            void *data = malloc((obj.size > 0) ? obj.size : 1);
+            if (data != NULL) memcpy(data, obj.data, obj.size);
+            return data;
+        }
+    }
+
+    return NULL;
+}
+
+static char *_casegetstr(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_caseget(entry, name, NULL, newmem);
+}
+
+static int _casegetint(qentry_t *entry, const char *name)
+{
+    const char *str = _caseget(entry, name, NULL, false);
+    return (str != NULL) ? atoi(str) : 0;
+}
+
+// obj->next holds the position of the next record in the mapping.
+static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
+                     bool newmem)
+{
+    if (entry == NULL || obj == NULL) return false;
+
+    struct _cdb *cdb = (struct _cdb *)entry;
+    uint64_t offset = (obj->name == NULL) ? sizeof(struct _header)
+                      : (uint64_t)((char *)obj->next - cdb->map);
+
+    const struct _record *rec;
+    for (; (rec = _record(cdb, offset)) != NULL; offset += RECSIZE(rec)) {
+        if (name != NULL && strcmp(RECNAME(rec), name)) continue;
+
+        if (newmem == true) {
+            obj->name = strdup(RECNAME(rec));
+            obj->data = _data(rec, NULL, true);
+        } else {
+            obj->name = RECNAME(rec);
+            obj->data = RECDATA(rec);
+        }
+        obj->size = rec->size;
+        obj->next = (qentobj_t *)(cdb->map + offset + RECSIZE(rec));
+        obj->hash = rec->hash;
+        obj->child = NULL;
+
+        return true;
+    }
+
+    return false;
+}
+
+static int _size(qentry_t *entry)
+{
+    if (entry == NULL) return 0;
+    return entry->num;
+}
+
+static int _remove(qentry_t *entry, const char *name)
+{
+    return 0;
+}
+
+static bool _truncate(qentry_t *entry)
+{
+    return false;
+}
+
+static bool _reverse(qentry_t *entry)
+{
+    return false;
+}
+
+static bool _save(qentry_t *entry, const char *filepath)
+{
+    return false;
+}
+
+static int _load(qentry_t *entry, const char *filepath)
+{
+    return 0;
+}
+
+static bool _print(qentry_t *entry, FILE *out, bool print_data)
+{
+    if (entry == NULL || out == NULL) return false;
+
+    qentobj_t obj;
+    memset((void *)&obj, 0, sizeof(obj));
+    while (_getnext(entry, &obj, NULL, false) == true) {
+        fprintf(out, "%s=%s (%lu)\n", obj.name,
+                (print_data?(char *)obj.data:"(data)"),
+                (unsigned long)obj.size);
+    }
+
+    return true;
+}
+
+static bool _free(qentry_t *entry)
+{
+    if (entry == NULL) return false;
+
+    struct _cdb *cdb = (struct _cdb *)entry;
+    munmap(cdb->map, cdb->mapsize);
+    free(cdb);
+
+    return true;
+}
+
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem)
+{
+    if (entry == NULL || name == NULL) return NULL;
+
+    struct _cdb *cdb = (struct _cdb *)entry;
+    return _data(_find(cdb, name, hash, false), size, newmem);
+}
+
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create)
+{
+    return NULL;
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,745 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgibody.c Request Body Parser API
+ *
+ * qcgireq_parse() handles application/x-www-form-urlencoded and
+ * multipart/form-data by itself. Other request bodies are handed to the
+ * parser registered for the Content-Type. MessagePack(application/msgpack,
+ * application/x-msgpack) and CBOR(application/cbor) parsers are built in.
+ *
+ * Decoded documents are flattened the same way as form queries. Map keys
+ * and array indexes become bracket names like "user[name]" or "tags[0]",
+ * which are stored into nested containers if qcgireq_setbracket() is on.
+ * Scalars are stored as strings, numbers in decimal, booleans as "true" or
+ * "false" and null as an empty string. Byte strings are stored as they are.
+ *
+ * @code
+ *   [MessagePack body] {"user": {"name": "Alice"}, "tags": ["a", "b"]}
+ *
+ *   qentry_t *req = qcgibody_setlimit(NULL, 64 * 1024, 8);
+ *   req = qcgireq_parse(req, 0);
+ *   char *name = req->getstr(req, "user[name]", false); // Alice
+ *   char *tag = req->getstr(req, "tags[1]", false);     // b
+ * @endcode
+ *
+ * @code
+ *   // user defined parser, register once per process.
+ *   bool parse_csv(qentry_t *request, const char *body, size_t size) {
+ *     (...)
+ *     qcgibody_put(request, "rows[0][name]", value, valuesize);
+ *     (...)
+ *   }
+ *   qcgibody_register("text/csv", parse_csv);
+ * @endcode
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define BODY_MAX_PARSERS    (16)
+#define BODY_MAX_NAME       (1024)
+#define BODY_DEF_MAXSIZE    (1024 * 1024)
+#define BODY_DEF_MAXDEPTH   (32)
+
+typedef bool (*_parser_t)(qentry_t *request, const char *body, size_t size);
+
+static struct {
+    char *type;
+    _parser_t parser;
+} _parsers[BODY_MAX_PARSERS] = {
+    { "application/msgpack", qcgibody_msgpack },
+    { "application/x-msgpack", qcgibody_msgpack },
+    { "application/cbor", qcgibody_cbor },
+};
+
+enum _kind {
+    _K_NIL, _K_BOOL, _K_INT, _K_UINT, _K_FLOAT, _K_STR, _K_BIN,
+    _K_ARRAY, _K_MAP
+};
+
+struct _item {
+    enum _kind kind;
+    const char *data;   /* _K_STR, _K_BIN */
+    uint64_t len;       /* bytes of _K_STR, _K_BIN. items of _K_ARRAY, _K_MAP */
+    bool indefinite;    /* CBOR indefinite-length _K_ARRAY, _K_MAP */
+    union {
+        bool b;
+        int64_t i;
+        uint64_t u;
+        double f;
+    } v;
+};
+
+struct _decoder {
+    qentry_t *request;
+    const unsigned char *cp, *end;
+    int maxdepth;
+    bool (*next)(struct _decoder *d, struct _item *item);
+    bool (*isbreak)(struct _decoder *d);
+    char name[BODY_MAX_NAME];
+    size_t namelen;
+};
+
+static bool _decode(struct _decoder *d, const char *body, size_t size);
+static bool _walk(struct _decoder *d, int depth);
+static bool _pushname(struct _decoder *d, int depth, const struct _item *key);
+static bool _putscalar(struct _decoder *d, const struct _item *item);
+static bool _msgpack_next(struct _decoder *d, struct _item *item);
+static bool _cbor_next(struct _decoder *d, struct _item *item);
+static bool _cbor_isbreak(struct _decoder *d);
+static bool _need(struct _decoder *d, uint64_t n);
+static uint64_t _be(const unsigned char *cp, int n);
+static double _halffloat(uint16_t half);
+
+#endif
+
+/**
+ * Register a parser for a request body type.
+ *
+ * @param contenttype   media type like "application/msgpack", compared
+ *                      without parameters and case insensitively.
+ * @param parser        parser function, NULL to remove the registered one.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * The registry is per process and not thread-safe, so register parsers
+ * once at startup. The parser gets the whole body in memory, up to the size
+ * limit of qcgibody_setlimit(). It should store values with qcgibody_put()
+ * and return false on a malformed body.
+ */
+bool qcgibody_register(const char *contenttype,
+                       bool (*parser)(qentry_t *request, const char *body,
+                                      size_t size))
+{
+    if (contenttype == NULL || *contenttype == '\0') return false;
+
+    int i, empty = -1;
+    for (i = 0; i < BODY_MAX_PARSERS; i++) {
+        if (_parsers[i].type == NULL) {
+            if (empty < 0) empty = i;
+            continue;
+        }
+        if (strcasecmp(_parsers[i].type, contenttype)) continue;
+
+        // replace or remove, the type string is kept.
+        _parsers[i].parser = parser;
+        return true;
+    }
+
+    if (parser == NULL) return false;
+    if (empty < 0) {
+        WARN("Too many body parsers.");
+        return false;
+    }
+
+    char *type = strdup(contenttype);
+    if (type == NULL) return false;
+    _parsers[empty].type = type;
+    _parsers[empty].parser = parser;
+    return true;
+}
+
+/**
+ * Set limits of request bodies handled by registered parsers.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param maxsize   maximum body size in bytes, 0 for 1MB.
+ * @param maxdepth  maximum nesting of maps and arrays, 0 for 32.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse(). A body
+ * larger than maxsize is not read at all.
+ */
+qentry_t *qcgibody_setlimit(qentry_t *request, size_t maxsize, int maxdepth)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (maxsize > 0) {
+        request->putstrf(request, true, "_Q_BODY_MAXSIZE", "%zu", maxsize);
+    } else {
+        request->remove(request, "_Q_BODY_MAXSIZE");
+    }
+    if (maxdepth > 0) {
+        request->putint(request, "_Q_BODY_MAXDEPTH", maxdepth, true);
+    } else {
+        request->remove(request, "_Q_BODY_MAXDEPTH");
+    }
+
+    return request;
+}
+
+/**
+ * Store a decoded value with a bracket name, same as form queries.
+ *
+ * @param request   qentry_t container pointer.
+ * @param name      name like "a[b][0]".
+ * @param value     value data.
+ * @param size      size of value. a '\0' is appended.
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgibody_put(qentry_t *request, const char *name, const void *value,
+                  size_t size)
+{
+    char *data = (char *)malloc(size + 1);
+    if (data == NULL) return false;
+    memcpy(data, value, size);
+    data[size] = '\0';
+
+    bool ret;
+    if (request->getint(request, "_Q_BRACKET") == 1
+        && strchr(name, '[') != NULL) {
+        char *copy = strdup(name);
+        ret = (copy != NULL) ? _q_put_bracket(request, copy, data, size + 1)
+                             : false;
+        if (copy != NULL) free(copy);
+    } else {
+        ret = request->put(request, name, data, size + 1, false);
+    }
+
+    free(data);
+    return ret;
+}
+
+/**
+ * Built-in MessagePack parser.
+ *
+ * @param request   qentry_t container pointer.
+ * @param body      MessagePack encoded body.
+ * @param size      size of body.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * Ext types are stored as byte strings without the type code.
+ */
+bool qcgibody_msgpack(qentry_t *request, const char *body, size_t size)
+{
+    struct _decoder d;
+    memset(&d, 0, sizeof(d));
+    d.request = request;
+    d.next = _msgpack_next;
+    d.isbreak = NULL;
+    return _decode(&d, body, size);
+}
+
+/**
+ * Built-in CBOR(RFC 7049) parser.
+ *
+ * @param request   qentry_t container pointer.
+ * @param body      CBOR encoded body.
+ * @param size      size of body.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * Tags are skipped and the tagged item is stored. Indefinite-length maps
+ * and arrays are supported, indefinite-length strings are not.
+ */
+bool qcgibody_cbor(qentry_t *request, const char *body, size_t size)
+{
+    struct _decoder d;
+    memset(&d, 0, sizeof(d));
+    d.request = request;
+    d.next = _cbor_next;
+    d.isbreak = _cbor_isbreak;
+    return _decode(&d, body, size);
+}
+
+#ifndef _DOXYGEN_SKIP
+
+/*
+ * Read the request body and call the parser registered for the type.
+ *
+ * @return  number of stored entries, -1 if no parser is registered, -2 if
+ *          the body is rejected or malformed.
+ */
+int _q_body_parse(qentry_t *request, const char *content_type)
+{
+    size_t typelen = strcspn(content_type, "; \t");
+    if (typelen == 0) return -1;
+
+    _parser_t parser = NULL;
+    int i;
+    for (i = 0; i < BODY_MAX_PARSERS; i++) {
+        if (_parsers[i].type == NULL || _parsers[i].parser == NULL) continue;
+        if (strlen(_parsers[i].type) != typelen) continue;
+        if (strncasecmp(_parsers[i].type, content_type, typelen)) continue;
+        parser = _parsers[i].parser;
+        break;
+    }
+    if (parser == NULL) return -1;
+
+    const char *content_length = getenv("CONTENT_LENGTH");
+    if (content_length == NULL) return 0;
+    long long length = atoll(content_length);
+    if (length <= 0) return 0;
+
+    const char *maxsize = request->getstr(request, "_Q_BODY_MAXSIZE", false);
+    long long limit = (maxsize != NULL) ? atoll(maxsize) : BODY_DEF_MAXSIZE;
+    if (length > limit) {
+        WARN("Request body is too large. %lld > %lld", length, limit);
+        _q_metrics_add(_Q_M_LIMIT_REJECTIONS, 1);
+        return -2;
+    }
+
+    char *body = (char *)malloc(length);
+    if (body == NULL) return -2;
+    size_t nread;
+    for (nread = 0; nread < (size_t)length; ) {
+        size_t n = fread(body + nread, 1, length - nread, stdin);
+        if (n == 0) break;
+        nread += n;
+    }
+    _q_metrics_add(_Q_M_BYTES_READ, nread);
+
+    int num = request->num;
+    bool ret = (nread == (size_t)length) ? parser(request, body, nread)
+                                         : false;
+    free(body);
+
+    if (ret == false) {
+        WARN("Malformed %.*s request body.", (int)typelen, content_type);
+        _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
+        return -2;
+    }
+    return request->num - num;
+}
+
+static bool _decode(struct _decoder *d, const char *body, size_t size)
+{
+    int maxdepth = d->request->getint(d->request, "_Q_BODY_MAXDEPTH");
+    d->maxdepth = (maxdepth > 0) ? maxdepth : BODY_DEF_MAXDEPTH;
+    d->cp = (const unsigned char *)body;
+    d->end = d->cp + size;
+    d->namelen = 0;
+    d->name[0] = '\0';
+
+    if (_walk(d, 0) == false) return false;
+    return (d->cp == d->end);
+}
+
+// decode one item and store it under the current name.
+static bool _walk(struct _decoder *d, int depth)
+{
+    struct _item item;
+    if (d->next(d, &item) == false) return false;
+
+    if (item.kind != _K_MAP && item.kind != _K_ARRAY) {
+        if (depth == 0) return false;  // a scalar has no name
+        return _putscalar(d, &item);
+    }
+
+    if (depth >= d->maxdepth) {
+        WARN("Request body is nested too deep.");
+        return false;
+    }
+
+    // every item takes at least one byte, don't trust huge counts.
+    if (item.indefinite == false
+        && item.len > (uint64_t)(d->end - d->cp)) {
+        return false;
+    }
+
+    size_t namelen = d->namelen;
+    uint64_t i;
+    for (i = 0; item.indefinite == true || i < item.len; i++) {
+        if (item.indefinite == true && d->isbreak(d) == true) break;
+
+        struct _item key;
+        if (item.kind == _K_MAP) {
+            if (d->next(d, &key) == false) return false;
+        } else {
+            key.kind = _K_UINT;
+            key.v.u = i;
+        }
+        if (_pushname(d, depth, &key) == false) return false;
+        if (_walk(d, depth + 1) == false) return false;
+
+        d->namelen = namelen;
+        d->name[namelen] = '\0';
+    }
+
+    return true;
+}
+
+// append "key" at the top level, "[key]" below.
+static bool _pushname(struct _decoder *d, int depth, const struct _item *key)
+{
+    char buf[20+1];
+    const char *str;
+    size_t len;
+
+    switch (key->kind) {
+        case _K_STR :
+        case _K_BIN : {
+            str = key->data;
+            len = key->len;
+            if (memchr(str, '\0', len) != NULL) return false;
+            break;
+        }
+        case _K_UINT : {
+            len = snprintf(buf, sizeof(buf), "%" PRIu64, key->v.u);
+            str = buf;
+            break;
+        }
+        case _K_INT : {
+            len = snprintf(buf, sizeof(buf), "%" PRId64, key->v.i);
+            str = buf;
+            break;
+        }
+        default : {
+            return false;
+        }
+    }
+
+    size_t need = len + ((depth > 0) ? 2 : 0);
+    if (d->namelen + need >= sizeof(d->name)) return false;
+
+    char *cp = d->name + d->namelen;
+    if (depth > 0) *cp++ = '[';
+    memcpy(cp, str, len);
+    cp += len;
+    if (depth > 0) *cp++ = ']';
+    *cp = '\0';
+    d->namelen += need;
+    return true;
+}
+
+static bool _putscalar(struct _decoder *d, const struct _item *item)
+{
+    char buf[32];
+    const char *data = buf;
+    size_t size;
+
+    switch (item->kind) {
+        case _K_NIL : {
+            size = 0;
+            break;
+        }
+        case _K_BOOL : {
+            data = (item->v.b == true) ? "true" : "false";
+            size = strlen(data);
+            break;
+        }
+        case _K_INT : {
+            size = snprintf(buf, sizeof(buf), "%" PRId64, item->v.i);
+            break;
+        }
+        case _K_UINT : {
+            size = snprintf(buf, sizeof(buf), "%" PRIu64, item->v.u);
+            break;
+        }
+        case _K_FLOAT : {
+            size = snprintf(buf, sizeof(buf), "%.17g", item->v.f);
+            break;
+        }
+        case _K_STR :
+        case _K_BIN : {
+            data = item->data;
+            size = item->len;
+            break;
+        }
+        default : {
+            return false;
+        }
+    }
+
+    return qcgibody_put(d->request, d->name, data, size);
+}
+
+/*
+ * MessagePack
+ */
+static bool _msgpack_next(struct _decoder *d, struct _item *item)
+{
+    if (_need(d, 1) == false) return false;
+    unsigned char c = *d->cp++;
+    int n = 0;
+
+    memset(item, 0, sizeof(struct _item));
+    if (c <= 0x7f) {
+        item->kind = _K_UINT;
+        item->v.u = c;
+        return true;
+    } else if (c >= 0xe0) {
+        item->kind = _K_INT;
+        item->v.i = (int8_t)c;
+        return true;
+    } else if (c <= 0x8f) {
+        item->kind = _K_MAP;
+        item->len = c & 0x0f;
+        return true;
+    } else if (c <= 0x9f) {
+        item->kind = _K_ARRAY;
+        item->len = c & 0x0f;
+        return true;
+    } else if (c <= 0xbf) {
+        item->kind = _K_STR;
+        item->len = c & 0x1f;
+    } else {
+        switch (c) {
+            case 0xc0 : item->kind = _K_NIL; return true;
+            case 0xc2 : item->kind = _K_BOOL; item->v.b = false; return true;
+            case 0xc3 : item->kind = _K_BOOL; item->v.b = true; return true;
+            case 0xc4 : item->kind = _K_BIN; n = 1; break;
+            case 0xc5 : item->kind = _K_BIN; n = 2; break;
+            case 0xc6 : item->kind = _K_BIN; n = 4; break;
+            case 0xd9 : item->kind = _K_STR; n = 1; break;
+            case 0xda : item->kind = _K_STR; n = 2; break;
+            case 0xdb : item->kind = _K_STR; n = 4; break;
+            case 0xdc : item->kind = _K_ARRAY; n = 2; break;
+            case 0xdd : item->kind = _K_ARRAY; n = 4; break;
+            case 0xde : item->kind = _K_MAP; n = 2; break;
+            case 0xdf : item->kind = _K_MAP; n = 4; break;
+            case 0xcc : case 0xcd : case 0xce : case 0xcf : {
+                n = 1 << (c - 0xcc);
+                if (_need(d, n) == false) return false;
+                item->kind = _K_UINT;
+                item->v.u = _be(d->cp, n);
+                d->cp += n;
+                return true;
+            }
+            case 0xd0 : case 0xd1 : case 0xd2 : case 0xd3 : {
+                n = 1 << (c - 0xd0);
+                if (_need(d, n) == false) return false;
+                uint64_t u = _be(d->cp, n);
+                d->cp += n;
+                int shift = 64 - n * 8;
+                item->kind = _K_INT;
+                item->v.i = (shift > 0) ? ((int64_t)(u << shift) >> shift)
+                                        : (int64_t)u;
+                return true;
+            }
+            case 0xca : {
+                if (_need(d, 4) == false) return false;
+                uint32_t u = _be(d->cp, 4);
+                float f;
+                memcpy(&f, &u, sizeof(f));
+                d->cp += 4;
+                item->kind = _K_FLOAT;
+                item->v.f = f;
+                return true;
+            }
+            case 0xcb : {
+                if (_need(d, 8) == false) return false;
+                uint64_t u = _be(d->cp, 8);
+                memcpy(&item->v.f, &u, sizeof(double));
+                d->cp += 8;
+                item->kind = _K_FLOAT;
+                return true;
+            }
+            case 0xd4 : case 0xd5 : case 0xd6 : case 0xd7 : case 0xd8 : {
+                // fixext, skip the type code
+                if (_need(d, 1) == false) return false;
+                d->cp++;
+                item->kind = _K_BIN;
+                item->len = 1 << (c - 0xd4);
+                break;
+            }
+            case 0xc7 : case 0xc8 : case 0xc9 : {
+                n = 1 << (c - 0xc7);
+                if (_need(d, n + 1) == false) return false;
+                item->kind = _K_BIN;
+                item->len = _be(d->cp, n);
+                d->cp += n + 1;
+                n = 0;
+                break;
+            }
+            default : {
+                return false;
+            }
+        }
+    }
+
+    if (n > 0) {
+        if (_need(d, n) == false) return false;
+        item->len = _be(d->cp, n);
+        d->cp += n;
+        if (item->kind == _K_MAP || item->kind == _K_ARRAY) return true;
+    }
+
+    // _K_STR, _K_BIN
+    if (_need(d, item->len) == false) return false;
+    item->data = (const char *)d->cp;
+    d->cp += item->len;
+    return true;
+}
+
+/*
+ * CBOR
+ */
+static bool _cbor_next(struct _decoder *d, struct _item *item)
+{
+    unsigned char c;
+    uint64_t arg;
+
+    memset(item, 0, sizeof(struct _item));
+    for (;;) {
+        if (_need(d, 1) == false) return false;
+        c = *d->cp++;
+
+        int info = c & 0x1f;
+        if (info < 24) {
+            arg = info;
+        } else if (info <= 27) {
+            int n = 1 << (info - 24);
+            if (_need(d, n) == false) return false;
+            arg = _be(d->cp, n);
+            d->cp += n;
+        } else if (info == 31) {
+            arg = 0;
+            item->indefinite = true;
+        } else {
+            return false;
+        }
+
+        if ((c >> 5) != 6) break;
+        if (item->indefinite == true) return false;  // tag, skip it
+    }
+
+    switch (c >> 5) {
+        case 0 : {
+            if (item->indefinite == true) return false;
+            item->kind = _K_UINT;
+            item->v.u = arg;
+            break;
+        }
+        case 1 : {
+            if (item->indefinite == true || arg > INT64_MAX) return false;
+            item->kind = _K_INT;
+            item->v.i = -1 - (int64_t)arg;
+            break;
+        }
+        case 2 :
+        case 3 : {
+            if (item->indefinite == true) return false;
+            if (_need(d, arg) == false) return false;
+            item->kind = ((c >> 5) == 2) ? _K_BIN : _K_STR;
+            item->data = (const char *)d->cp;
+            item->len = arg;
+            d->cp += arg;
+            break;
+        }
+        case 4 :
+        case 5 : {
+            item->kind = ((c >> 5) == 4) ? _K_ARRAY : _K_MAP;
+            item->len = arg;
+            break;
+        }
+        case 7 : {
+            int info = c & 0x1f;
+            if (info == 20 || info == 21) {
+                item->kind = _K_BOOL;
+                item->v.b = (info == 21);
+            } else if (info == 22 || info == 23) {
+                item->kind = _K_NIL;
+            } else if (info == 25) {
+                item->kind = _K_FLOAT;
+                item->v.f = _halffloat(arg);
+            } else if (info == 26) {
+                uint32_t u = arg;
+                float f;
+                memcpy(&f, &u, sizeof(f));
+                item->kind = _K_FLOAT;
+                item->v.f = f;
+            } else if (info == 27) {
+                item->kind = _K_FLOAT;
+                memcpy(&item->v.f, &arg, sizeof(double));
+            } else {
+                return false;  // simple values, stray break
+            }
+            item->indefinite = false;
+            break;
+        }
+    }
+
+    return true;
+}
+
+static bool _cbor_isbreak(struct _decoder *d)
+{
+    if (d->cp < d->end && *d->cp == 0xff) {
+        d->cp++;
+        return true;
+    }
+    return false;
+}
+
+static bool _need(struct _decoder *d, uint64_t n)
+{
+    return (n <= (uint64_t)(d->end - d->cp));
+}
+
+static uint64_t _be(const unsigned char *cp, int n)
+{
+    uint64_t u = 0;
+    int i;
+    for (i = 0; i < n; i++) u = (u << 8) | cp[i];
+    return u;
+}
+
+static double _halffloat(uint16_t half)
+{
+    int exp = (half >> 10) & 0x1f;
+    int mant = half & 0x3ff;
+    double val;
+
+    if (exp == 0) val = mant * (1.0 / (1 << 24));
+    else if (exp != 31) val = (mant + 1024) * ((double)(1 << exp) / (1 << 25));
+    else val = (mant == 0) ? __builtin_inf() : __builtin_nan("");
+
+    return (half & 0x8000) ? -val : val;
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,568 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgicache.c Parsed Query Cache API
+ *
+ * Tracking pixels and polling endpoints receive the same QUERY_STRING over
+ * and over. This keeps the parsed containers of recent query strings in
+ * the worker process, so a repeated query string costs one hash of the raw
+ * string and a comparison instead of tokenizing and decoding it again.
+ *
+ * The returned container is shared by all the requests having the same
+ * query string and it's frozen, put(), remove() and the like fail. It's
+ * released by free() as usual and the cache keeps it alive until it's
+ * evicted by the least recently used order.
+ *
+ * @code
+ *   qcgicache_init(1000, 1024 * 1024);  // at most 1000 queries and 1MB
+ *   while(FCGI_Accept() >= 0) {
+ *     qentry_t *query = qcgicache_query(NULL);
+ *     const char *id = query->getstr(query, "id", false);
+ *     (...)
+ *     query->free(query);
+ *   }
+ * @endcode
+ *
+ * @note
+ * Only GET variables are cached, cookies and the body are not. The parsing
+ * options given to qcgicache_query() are applied on a miss, so they should
+ * be the same for every call in a process. Queries having nested containers
+ * by qcgireq_setbracket() are not cached, the nested containers couldn't be
+ * shared read-only.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define CACHE_OBJECT_OVERHEAD   (sizeof(qentobj_t) + 16)
+
+struct _frozen {
+    qentry_t entry;         /* must be the first */
+    qentry_t *data;         /* parsed container */
+    int refs;               /* the cache and the callers */
+};
+
+struct _node {
+    struct _node *hnext;    /* hash chain */
+    struct _node *prev;     /* LRU list, newer */
+    struct _node *next;     /* LRU list, older */
+    uint32_t hash;
+    char *query;
+    size_t querylen;
+    size_t size;            /* accounted bytes */
+    struct _frozen *frozen;
+};
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static struct _node **_buckets = NULL;
+static int _nbuckets = 0;
+static struct _node *_head = NULL, *_tail = NULL;
+static int _num = 0, _maxentries = 0;
+static size_t _bytes = 0, _maxsize = 0;
+
+static const char *_rawquery(void);
+static size_t _accounted(qentry_t *entry);
+static void _unlink(struct _node *node);
+static void _evict(struct _node *node);
+static qentry_t *_freeze(qentry_t *data);
+static void _release(struct _frozen *frozen);
+
+static bool _put(qentry_t *entry, const char *name, const void *data,
+                 size_t size, bool replace);
+static bool _putstr(qentry_t *entry, const char *name, const char *str,
+                    bool replace);
+static bool _putstrf(qentry_t *entry, bool replace, const char *name,
+                     const char *format, ...);
+static bool _putint(qentry_t *entry, const char *name, int num, bool replace);
+static void *_get(qentry_t *entry, const char *name, size_t *size, bool newmem);
+static void *_getlast(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem);
+static char *_getstr(qentry_t *entry, const char *name, bool newmem);
+static char *_getstrf(qentry_t *entry, bool newmem, const char *namefmt, ...);
+static char *_getstrlast(qentry_t *entry, const char *name, bool newmem);
+static int _getint(qentry_t *entry, const char *name);
+static int _getintlast(qentry_t *entry, const char *name);
+static void *_caseget(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem);
+static char *_casegetstr(qentry_t *entry, const char *name, bool newmem);
+static int _casegetint(qentry_t *entry, const char *name);
+static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
+                     bool newmem);
+static int _size(qentry_t *entry);
+static int _remove(qentry_t *entry, const char *name);
+static bool _truncate(qentry_t *entry);
+static bool _reverse(qentry_t *entry);
+static bool _save(qentry_t *entry, const char *filepath);
+static int _load(qentry_t *entry, const char *filepath);
+static bool _print(qentry_t *entry, FILE *out, bool print_data);
+static bool _free(qentry_t *entry);
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem);
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create);
+
+#endif
+
+/**
+ * Enable the parsed query cache of this process.
+ *
+ * @param maxentries    maximum number of cached query strings.
+ * @param maxsize       maximum bytes of the cached query strings and their
+ *                      parsed names and values.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * Calling it again empties the cache. 0 for maxentries disables the cache
+ * and qcgicache_query() parses every time.
+ */
+bool qcgicache_init(int maxentries, size_t maxsize)
+{
+    pthread_mutex_lock(&_lock);
+
+    while (_tail != NULL) _evict(_tail);
+    if (_buckets != NULL) free(_buckets);
+    _buckets = NULL;
+    _nbuckets = 0;
+    _maxentries = 0;
+    _maxsize = 0;
+
+    if (maxentries > 0) {
+        // power of 2, twice the entries.
+        int nbuckets;
+        for (nbuckets = 16; nbuckets < maxentries * 2; nbuckets *= 2);
+        _buckets = (struct _node **)calloc(nbuckets, sizeof(struct _node *));
+        if (_buckets == NULL) {
+            pthread_mutex_unlock(&_lock);
+            return false;
+        }
+        _nbuckets = nbuckets;
+        _maxentries = maxentries;
+        _maxsize = maxsize;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    return true;
+}
+
+/**
+ * Get the parsed GET variables of this request from the cache.
+ *
+ * @param request   qentry_t container pointer which has the parsing options
+ *                  like qcgireq_setbracket() and qcgireq_setcharset(). NULL
+ *                  can be used for the default options.
+ *
+ * @return  a frozen qentry_t container shared with the other requests having
+ *          the same query string, otherwise returns NULL.
+ *
+ * @note
+ * The returned container must be released by free(). Options given by the
+ * request container are not included in it. When the cache is not enabled
+ * or the query is too large to cache, a private container is returned. When
+ * the query has nested containers, a private container which is not frozen
+ * is returned.
+ */
+qentry_t *qcgicache_query(qentry_t *request)
+{
+    const char *query = _rawquery();
+    size_t querylen = (query != NULL) ? strlen(query) : 0;
+    uint32_t hash = qentry_hash(query != NULL ? query : "", querylen);
+
+    // hit
+    pthread_mutex_lock(&_lock);
+    if (_nbuckets > 0) {
+        struct _node *node;
+        for (node = _buckets[hash & (_nbuckets - 1)]; node != NULL;
+             node = node->hnext) {
+            if (node->hash == hash && node->querylen == querylen
+                && !memcmp(node->query, query, querylen)) {
+                break;
+            }
+        }
+        if (node != NULL) {
+            if (node != _head) {
+                _unlink(node);
+                node->next = _head;
+                if (_head != NULL) _head->prev = node;
+                _head = node;
+                if (_tail == NULL) _tail = node;
+            }
+            __atomic_add_fetch(&node->frozen->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&_lock);
+            return &node->frozen->entry;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    // miss, parse with the options of the request.
+    qentry_t *data = qEntry();
+    if (data == NULL) return NULL;
+    static const char *options[] = { "_Q_BRACKET", "_Q_CHARSET", NULL };
+    int i;
+    for (i = 0; request != NULL && options[i] != NULL; i++) {
+        size_t size;
+        const void *value = request->get(request, options[i], &size, false);
+        if (value != NULL) data->put(data, options[i], value, size, true);
+    }
+    qcgireq_parse(data, Q_CGI_GET);
+    for (i = 0; options[i] != NULL; i++) data->remove(data, options[i]);
+
+    // nested containers are reachable through first/next and getnext(),
+    // they can't be frozen.
+    qentobj_t *obj;
+    for (obj = data->first; obj != NULL; obj = obj->next) {
+        if (obj->child != NULL) return data;
+    }
+
+    qentry_t *frozen = _freeze(data);
+    if (frozen == NULL) {
+        data->free(data);
+        return NULL;
+    }
+
+    // store
+    size_t size = querylen + _accounted(data);
+    pthread_mutex_lock(&_lock);
+    if (_nbuckets > 0 && size <= _maxsize) {
+        struct _node *node = (struct _node *)calloc(1, sizeof(struct _node));
+        char *copy = (node != NULL) ? (char *)malloc(querylen + 1) : NULL;
+        if (copy != NULL) {
+            memcpy(copy, (query != NULL) ? query : "", querylen + 1);
+            node->hash = hash;
+            node->query = copy;
+            node->querylen = querylen;
+            node->size = size;
+            node->frozen = (struct _frozen *)frozen;
+            node->frozen->refs++;  // for the cache
+
+            int bucket = hash & (_nbuckets - 1);
+            node->hnext = _buckets[bucket];
+            _buckets[bucket] = node;
+            node->next = _head;
+            if (_head != NULL) _head->prev = node;
+            _head = node;
+            if (_tail == NULL) _tail = node;
+            _num++;
+            _bytes += size;
+
+            while (_tail != node
+                   && (_num > _maxentries || _bytes > _maxsize)) {
+                _evict(_tail);
+            }
+        } else if (node != NULL) {
+            free(node);
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return frozen;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+// QUERY_STRING, or the query part of REQUEST_URI like qcgireq_getquery().
+static const char *_rawquery(void)
+{
+    const char *query = getenv("QUERY_STRING");
+    if (query == NULL) return NULL;
+
+    if (*query == '\0') {
+        const char *uri = getenv("REQUEST_URI");
+        if (uri != NULL) {
+            const char *cp = strchr(uri, '?');
+            return (cp != NULL) ? cp + 1 : "";
+        }
+    }
+    return query;
+}
+
+static size_t _accounted(qentry_t *entry)
+{
+    size_t size = sizeof(struct _frozen) + sizeof(struct _node);
+    qentobj_t *obj;
+    for (obj = entry->first; obj != NULL; obj = obj->next) {
+        size += strlen(obj->name) + 1 + obj->size + CACHE_OBJECT_OVERHEAD;
+    }
+    return size;
+}
+
+static void _unlink(struct _node *node)
+{
+    if (node->prev != NULL) node->prev->next = node->next;
+    else _head = node->next;
+    if (node->next != NULL) node->next->prev = node->prev;
+    else _tail = node->prev;
+    node->prev = node->next = NULL;
+}
+
+// remove from the cache, the container lives until the callers free it.
+static void _evict(struct _node *node)
+{
+    struct _node **pp = &_buckets[node->hash & (_nbuckets - 1)];
+    while (*pp != node) pp = &(*pp)->hnext;
+    *pp = node->hnext;
+    _unlink(node);
+
+    _num--;
+    _bytes -= node->size;
+    _release(node->frozen);
+    free(node->query);
+    free(node);
+}
+
+static qentry_t *_freeze(qentry_t *data)
+{
+    struct _frozen *frozen = (struct _frozen *)calloc(1,
+                             sizeof(struct _frozen));
+    if (frozen == NULL) return NULL;
+    frozen->data = data;
+    frozen->refs = 1;
+
+    qentry_t *entry = &frozen->entry;
+    entry->put          = _put;
+    entry->putstr       = _putstr;
+    entry->putstrf      = _putstrf;
+    entry->putint       = _putint;
+
+    entry->get          = _get;
+    entry->getlast      = _getlast;
+    entry->getstr       = _getstr;
+    entry->getstrf      = _getstrf;
+    entry->getstrlast   = _getstrlast;
+
+    entry->getint       = _getint;
+    entry->getintlast   = _getintlast;
+
+    entry->caseget      = _caseget;
+    entry->casegetstr   = _casegetstr;
+    entry->casegetint   = _casegetint;
+
+    entry->getnext      = _getnext;
+
+    entry->size         = _size;
+    entry->remove       = _remove;
+    entry->truncate     = _truncate;
+    entry->reverse      = _reverse;
+
+    entry->save         = _save;
+    entry->load         = _load;
+
+    entry->print        = _print;
+    entry->free         = _free;
+
+    entry->gethash      = _gethash;
+    entry->getchild     = _getchild;
+
+    // for the loops over first/next
+    entry->num = data->num;
+    entry->first = data->first;
+    entry->last = data->last;
+
+    return entry;
+}
+
+static void _release(struct _frozen *frozen)
+{
+    if (__atomic_sub_fetch(&frozen->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    frozen->data->free(frozen->data);
+    free(frozen);
+}
+
+#define DATA(e)     (((struct _frozen *)(e))->data)
+
+static bool _put(qentry_t *entry, const char *name, const void *data,
+                 size_t size, bool replace)
+{
+    return false;
+}
+
+static bool _putstr(qentry_t *entry, const char *name, const char *str,
+                    bool replace)
+{
+    return false;
+}
+
+static bool _putstrf(qentry_t *entry, bool replace, const char *name,
+                     const char *format, ...)
+{
+    return false;
+}
+
+static bool _putint(qentry_t *entry, const char *name, int num, bool replace)
+{
+    return false;
+}
+
+static void *_get(qentry_t *entry, const char *name, size_t *size, bool newmem)
+{
+    if (entry == NULL) return NULL;
+    return DATA(entry)->get(DATA(entry), name, size, newmem);
+}
+
+static void *_getlast(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem)
+{
+    if (entry == NULL) return NULL;
+    return DATA(entry)->getlast(DATA(entry), name, size, newmem);
+}
+
+static char *_getstr(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_get(entry, name, NULL, newmem);
+}
+
+static char *_getstrf(qentry_t *entry, bool newmem, const char *namefmt, ...)
+{
+    char *name;
+    DYNAMIC_VSPRINTF(name, namefmt);
+    if (name == NULL) return NULL;
+
+    char *data = (char *)_get(entry, name, NULL, newmem);
+    free(name);
+
+    return data;
+}
+
+static char *_getstrlast(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_getlast(entry, name, NULL, newmem);
+}
+
+static int _getint(qentry_t *entry, const char *name)
+{
+    if (entry == NULL) return 0;
+    return DATA(entry)->getint(DATA(entry), name);
+}
+
+static int _getintlast(qentry_t *entry, const char *name)
+{
+    if (entry == NULL) return 0;
+    return DATA(entry)->getintlast(DATA(entry), name);
+}
+
+static void *_caseget(qentry_t *entry, const char *name, size_t *size,
+                      bool newmem)
+{
+    if (entry == NULL) return NULL;
+    return DATA(entry)->caseget(DATA(entry), name, size, newmem);
+}
+
+static char *_casegetstr(qentry_t *entry, const char *name, bool newmem)
+{
+    return (char *)_caseget(entry, name, NULL, newmem);
+}
+
+static int _casegetint(qentry_t *entry, const char *name)
+{
+    if (entry == NULL) return 0;
+    return DATA(entry)->casegetint(DATA(entry), name);
+}
+
+static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
+                     bool newmem)
+{
+    if (entry == NULL) return false;
+    return DATA(entry)->getnext(DATA(entry), obj, name, newmem);
+}
+
+static int _size(qentry_t *entry)
+{
+    if (entry == NULL) return 0;
+    return DATA(entry)->size(DATA(entry));
+}
+
+static int _remove(qentry_t *entry, const char *name)
+{
+    return 0;
+}
+
+static bool _truncate(qentry_t *entry)
+{
+    return false;
+}
+
+static bool _reverse(qentry_t *entry)
+{
+    return false;
+}
+
+static bool _save(qentry_t *entry, const char *filepath)
+{
+    if (entry == NULL) return false;
+    return DATA(entry)->save(DATA(entry), filepath);
+}
+
+static int _load(qentry_t *entry, const char *filepath)
+{
+    return 0;
+}
+
+static bool _print(qentry_t *entry, FILE *out, bool print_data)
+{
+    if (entry == NULL) return false;
+    return DATA(entry)->print(DATA(entry), out, print_data);
+}
+
+// release the caller's reference.
+static bool _free(qentry_t *entry)
+{
+    if (entry == NULL) return false;
+    _release((struct _frozen *)entry);
+    return true;
+}
+
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem)
+{
+    if (entry == NULL) return NULL;
+    return DATA(entry)->gethash(DATA(entry), name, hash, size, newmem);
+}
+
+// containers having nested ones are not cached, never created here.
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create)
+{
+    if (entry == NULL) return NULL;
+    return DATA(entry)->getchild(DATA(entry), name, false);
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,460 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgilog.c Diagnostic Log API
+ *
+ * Diagnostic messages of the library are written into a per-thread ring
+ * buffer of fixed-size records instead of stderr. Writing a record doesn't
+ * take any lock nor make any system call, so parser and session diagnostics
+ * can be left switched on in production builds.
+ *
+ * Records stay in memory until they are written out by one of below.
+ *
+ *   @li qcgilog_dump() : on demand.
+ *   @li qcgilog_flusher() : periodically by a background thread.
+ *   @li qcgilog_crashdump() : when the program gets a fatal signal.
+ *
+ * The ring keeps the latest records only, older ones are overwritten when
+ * the consumer doesn't keep up.
+ *
+ * @code
+ *   qcgilog_setlevel(Q_LOG_INFO);
+ *   qcgilog_crashdump(STDERR_FILENO);
+ *   qcgilog_flusher(fd, 1000);
+ * @endcode
+ *
+ * Default level is Q_LOG_WARN. When the library is built with --enable-debug,
+ * it's Q_LOG_DEBUG and pending records are dumped to stderr at exit.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define LOG_RING_SIZE       (256)       /* records per thread, power of 2 */
+#define LOG_RECORD_SIZE     (256)
+#define LOG_MSG_SIZE        (LOG_RECORD_SIZE - (8 * 4) - 8)
+
+struct _logrec {
+    uint64_t seq;           /* sequence + 1 when completed, 0 when writing */
+    uint64_t usec;          /* wall clock time */
+    const char *file;
+    uint32_t line;
+    uint32_t level;
+    uint64_t tid;
+    char msg[LOG_MSG_SIZE];
+};
+
+struct _logring {
+    uint64_t head;          /* next sequence to be written */
+    uint64_t tail;          /* next sequence to be read */
+    uint64_t lost;          /* overwritten before being read */
+    uint64_t tid;
+    int inuse;
+    struct _logring *next;
+    struct _logrec recs[LOG_RING_SIZE];
+};
+
+static struct _logring *_rings = NULL;
+static __thread struct _logring *_myring = NULL;
+static pthread_key_t _ringkey;
+static pthread_once_t _ringonce = PTHREAD_ONCE_INIT;
+static int _dumping = 0;
+static int _flusher_fd = -1;
+static int _flusher_interval = 0;
+static int _crash_fd = -1;
+static const int _crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction _crash_oldsa[sizeof(_crash_signals) / sizeof(int)];
+
+static const char *_levelstr[] = {
+    [Q_LOG_NONE]    = "NONE",
+    [Q_LOG_ERROR]   = "ERROR",
+    [Q_LOG_WARN]    = "WARN",
+    [Q_LOG_INFO]    = "INFO",
+    [Q_LOG_DEBUG]   = "DEBUG",
+};
+
+static struct _logring *_getring(void);
+static void _ringinit(void);
+static void _ringrelease(void *ring);
+static int _dump(int fd, bool wait);
+static size_t _fmtrec(char *buf, size_t size, const struct _logrec *rec);
+static void *_flusher(void *arg);
+static void _crashhandler(int signo);
+#ifdef BUILD_DEBUG
+static void _atexit_dump(void);
+#endif
+
+#ifdef BUILD_DEBUG
+int _q_loglevel = Q_LOG_DEBUG;
+#else
+int _q_loglevel = Q_LOG_WARN;
+#endif
+
+#endif
+
+/**
+ * Set the logging level of the library.
+ *
+ * @param level one of Q_LOG_NONE, Q_LOG_ERROR, Q_LOG_WARN, Q_LOG_INFO and
+ *              Q_LOG_DEBUG. Messages above this level are not recorded.
+ */
+void qcgilog_setlevel(Q_LOG_T level)
+{
+    if (level < Q_LOG_NONE) level = Q_LOG_NONE;
+    if (level > Q_LOG_DEBUG) level = Q_LOG_DEBUG;
+    __atomic_store_n(&_q_loglevel, (int)level, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the logging level of the library.
+ *
+ * @return  current logging level.
+ */
+Q_LOG_T qcgilog_getlevel(void)
+{
+    return (Q_LOG_T)__atomic_load_n(&_q_loglevel, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write out pending log records of all threads as text lines.
+ *
+ * @param fd    file descriptor to write to.
+ *
+ * @return  the number of records written, otherwise returns -1.
+ *
+ * @code
+ *   qcgilog_dump(STDERR_FILENO);
+ * @endcode
+ */
+int qcgilog_dump(int fd)
+{
+    if (fd < 0) return -1;
+    return _dump(fd, true);
+}
+
+/**
+ * Start a background thread which writes out pending log records
+ * periodically.
+ *
+ * @param fd            file descriptor to write to.
+ * @param interval_ms   flushing interval in milliseconds.
+ *
+ * @return  true if successful, otherwise(already started) returns false.
+ */
+bool qcgilog_flusher(int fd, int interval_ms)
+{
+    if (fd < 0 || interval_ms <= 0) return false;
+
+    int expected = -1;
+    if (__atomic_compare_exchange_n(&_flusher_fd, &expected, fd, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+        == false) {
+        return false;
+    }
+    _flusher_interval = interval_ms;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, _flusher, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        __atomic_store_n(&_flusher_fd, -1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Dump pending log records when the program gets a fatal signal.
+ * (SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT)
+ *
+ * @param fd    file descriptor to write to.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * The handlers which were set before are kept and reinstalled before
+ * re-raising the signal, so they still run and core dumps are not affected.
+ */
+bool qcgilog_crashdump(int fd)
+{
+    if (fd < 0) return false;
+    _crash_fd = fd;
+
+    struct sigaction sa;
+    memset((void *)&sa, 0, sizeof(sa));
+    sa.sa_handler = _crashhandler;
+    sigemptyset(&sa.sa_mask);
+
+    int i;
+    for (i = 0; i < sizeof(_crash_signals) / sizeof(int); i++) {
+        struct sigaction old;
+        if (sigaction(_crash_signals[i], &sa, &old) != 0) return false;
+
+        // called again, keep the original one.
+        if (old.sa_handler != _crashhandler) _crash_oldsa[i] = old;
+    }
+
+    return true;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+void _q_log(int level, const char *file, int line, const char *format, ...)
+{
+    struct _logring *ring = _getring();
+    if (ring == NULL) return;
+
+    uint64_t seq = ring->head;
+    struct _logrec *rec = &ring->recs[seq & (LOG_RING_SIZE - 1)];
+
+    // mark as writing
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    rec->usec = ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+    rec->file = file;
+    rec->line = line;
+    rec->level = level;
+    rec->tid = ring->tid;
+
+    va_list arglist;
+    va_start(arglist, format);
+    vsnprintf(rec->msg, sizeof(rec->msg), format, arglist);
+    va_end(arglist);
+
+    // publish
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct _logring *_getring(void)
+{
+    if (_myring != NULL) return _myring;
+
+    pthread_once(&_ringonce, _ringinit);
+
+    // reuse a ring released by a finished thread
+    struct _logring *ring;
+    for (ring = __atomic_load_n(&_rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->inuse, &expected, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = (struct _logring *)calloc(1, sizeof(struct _logring));
+        if (ring == NULL) return NULL;
+        ring->inuse = 1;
+
+        // lock-free push
+        ring->next = __atomic_load_n(&_rings, __ATOMIC_RELAXED);
+        while (__atomic_compare_exchange_n(&_rings, &ring->next, ring, true,
+                                           __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+               == false);
+    }
+
+    ring->tid = (uint64_t)syscall(SYS_gettid);
+    pthread_setspecific(_ringkey, ring);
+    _myring = ring;
+    return ring;
+}
+
+static void _ringinit(void)
+{
+    pthread_key_create(&_ringkey, _ringrelease);
+#ifdef BUILD_DEBUG
+    atexit(_atexit_dump);
+#endif
+}
+
+// called at thread exit. pending records are kept for the next dump.
+static void _ringrelease(void *ring)
+{
+    __atomic_store_n(&((struct _logring *)ring)->inuse, 0, __ATOMIC_RELEASE);
+}
+
+// wait is false in signal handler, it just goes ahead.
+static int _dump(int fd, bool wait)
+{
+    int expected = 0;
+    bool locked;
+    while ((locked = __atomic_compare_exchange_n(&_dumping, &expected, 1,
+                                                 false, __ATOMIC_ACQUIRE,
+                                                 __ATOMIC_RELAXED)) == false) {
+        if (wait == false) break;
+        expected = 0;
+        usleep(1000);
+    }
+
+    int count = 0;
+    struct _logring *ring;
+    for (ring = __atomic_load_n(&_rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t seq = ring->tail;
+
+        // overwritten by the writer
+        if (head - seq > LOG_RING_SIZE) {
+            ring->lost += (head - seq) - LOG_RING_SIZE;
+            seq = head - LOG_RING_SIZE;
+        }
+
+        for (; seq < head; seq++) {
+            struct _logrec *rec = &ring->recs[seq & (LOG_RING_SIZE - 1)];
+            struct _logrec copy;
+
+            uint64_t before = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+            memcpy((void *)&copy, (void *)rec, sizeof(copy));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            uint64_t after = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+            if (before != seq + 1 || after != before) {
+                ring->lost++;
+                continue;
+            }
+            copy.msg[sizeof(copy.msg) - 1] = '\0';
+
+            char line[LOG_RECORD_SIZE * 2];
+            size_t len = _fmtrec(line, sizeof(line), &copy);
+            if (write(fd, line, len) < 0) break;
+            count++;
+        }
+        ring->tail = seq;
+    }
+
+    // the one holding it releases.
+    if (locked == true) __atomic_store_n(&_dumping, 0, __ATOMIC_RELEASE);
+    return count;
+}
+
+static char *_fmtstr(char *p, char *end, const char *str)
+{
+    while (p < end && *str != '\0') *p++ = *str++;
+    return p;
+}
+
+static char *_fmtnum(char *p, char *end, uint64_t num, int width)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0 && n < sizeof(digits));
+    while (n < width && p < end) {
+        *p++ = '0';
+        width--;
+    }
+    while (n > 0 && p < end) *p++ = digits[--n];
+    return p;
+}
+
+// async-signal-safe formatter.
+// ex) [1350000000.123456] [WARN] [1234] Broken stream. (qcgireq.c:641)
+static size_t _fmtrec(char *buf, size_t size, const struct _logrec *rec)
+{
+    char *p = buf, *end = buf + size - 1;
+    p = _fmtstr(p, end, "[");
+    p = _fmtnum(p, end, rec->usec / 1000000, 0);
+    p = _fmtstr(p, end, ".");
+    p = _fmtnum(p, end, rec->usec % 1000000, 6);
+    p = _fmtstr(p, end, "] [");
+    p = _fmtstr(p, end, (rec->level <= Q_LOG_DEBUG)
+                        ? _levelstr[rec->level] : "?");
+    p = _fmtstr(p, end, "] [");
+    p = _fmtnum(p, end, rec->tid, 0);
+    p = _fmtstr(p, end, "] ");
+    p = _fmtstr(p, end, rec->msg);
+    p = _fmtstr(p, end, " (");
+    p = _fmtstr(p, end, rec->file);
+    p = _fmtstr(p, end, ":");
+    p = _fmtnum(p, end, rec->line, 0);
+    p = _fmtstr(p, end, ")");
+    *p++ = '\n';
+    return p - buf;
+}
+
+static void *_flusher(void *arg)
+{
+    while (true) {
+        usleep(_flusher_interval * 1000);
+        _dump(_flusher_fd, true);
+    }
+    return NULL;
+}
+
+static void _crashhandler(int signo)
+{
+    _dump(_crash_fd, false);
+
+    int i;
+    for (i = 0; i < sizeof(_crash_signals) / sizeof(int); i++) {
+        if (_crash_signals[i] == signo) {
+            sigaction(signo, &_crash_oldsa[i], NULL);
+            break;
+        }
+    }
+    raise(signo);
+}
+
+#ifdef BUILD_DEBUG
+static void _atexit_dump(void)
+{
+    _dump(STDERR_FILENO, true);
+}
+#endif
+
+#endif /* _DOXYGEN_SKIP */
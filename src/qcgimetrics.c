@@ -0,0 +1,309 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgimetrics.c Shared-memory Metrics API
+ *
+ * qDecoder can count what it does into a POSIX shared memory segment, so
+ * every CGI process or FastCGI worker on the host adds up to the same numbers.
+ *
+ *   @li requests parsed, request body bytes, uploaded bytes
+ *   @li parse errors, limit rejections
+ *   @li session hits, misses and garbage-collected sessions
+ *   @li downloaded bytes
+ *   @li latency histograms of parse, session and download phases, and
+ *       queueing delay of qcgisched_begin()
+ *
+ * The segment has one block per CPU and every update is a single relaxed
+ * atomic add into the block of the CPU the caller is running on, so nothing
+ * in the request path takes a lock. Histograms are log-linear(HDR-style)
+ * with 4 sub-buckets per power of two in microseconds.
+ *
+ * @code
+ *   // in every worker, before qcgireq_parse()
+ *   qcgimetrics_init(NULL);
+ *   qentry_t *req = qcgireq_parse(NULL, 0);
+ *
+ *   // in the scraping endpoint. (see examples/metrics.c)
+ *   qcgires_setcontenttype(req, "text/plain; version=0.0.4");
+ *   qcgimetrics_export(NULL, stdout);
+ * @endcode
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define METRICS_DEFAULT_SHMNAME "/qdecoder-metrics"
+#define METRICS_MAGIC           (0x514d4554)    /* "QMET" */
+#define METRICS_VERSION         (2)
+#define METRICS_MAX_BLOCKS      (256)
+
+#define HIST_SUB_BITS           (2)
+#define HIST_SUB                (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS            (HIST_SUB + (32 - HIST_SUB_BITS) * HIST_SUB)
+
+struct _hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct _block {
+    uint64_t counters[_Q_M_MAX];
+    struct _hist hist[_Q_H_MAX];
+} __attribute__((aligned(64)));
+
+struct _segment {
+    struct {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t nblocks;
+    } __attribute__((aligned(64))) hdr;
+    struct _block blocks[];
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} _counters[_Q_M_MAX] = {
+    [_Q_M_REQUESTS]         = {"qdecoder_requests_total",
+                               "Requests parsed."},
+    [_Q_M_BYTES_READ]       = {"qdecoder_request_bytes_total",
+                               "Request body bytes read."},
+    [_Q_M_UPLOAD_BYTES]     = {"qdecoder_upload_bytes_total",
+                               "Uploaded file bytes."},
+    [_Q_M_PARSE_ERRORS]     = {"qdecoder_parse_errors_total",
+                               "Malformed or broken request bodies."},
+    [_Q_M_LIMIT_REJECTIONS] = {"qdecoder_limit_rejections_total",
+                               "Requests rejected by a limit."},
+    [_Q_M_SESSION_HITS]     = {"qdecoder_session_hits_total",
+                               "Valid sessions found."},
+    [_Q_M_SESSION_MISSES]   = {"qdecoder_session_misses_total",
+                               "New or expired sessions."},
+    [_Q_M_SESSION_GC]       = {"qdecoder_session_gc_removals_total",
+                               "Expired sessions removed."},
+    [_Q_M_DOWNLOAD_BYTES]   = {"qdecoder_download_bytes_total",
+                               "Bytes sent by qcgires_download()."},
+};
+
+static const char *_phases[_Q_H_MAX] = {
+    [_Q_H_PARSE]        = "parse",
+    [_Q_H_SESSION]      = "session",
+    [_Q_H_SESSION_SAVE] = "session_save",
+    [_Q_H_DOWNLOAD]     = "download",
+    [_Q_H_SCHED_WAIT]   = "sched_wait",
+};
+
+static struct _segment *_segment = NULL;
+
+static struct _block *_getblock(void);
+static int _hist_index(uint64_t usec);
+static uint64_t _hist_upper(int index);
+
+#endif
+
+/**
+ * Attach to the shared metrics segment, creating it if it doesn't exist.
+ *
+ * @param shmname   POSIX shared memory object name like "/myapp-metrics".
+ *                  NULL can be used for "/qdecoder-metrics".
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * Until this is called, metric updates are no-op. Calling it more than once
+ * in a process is harmless.
+ */
+bool qcgimetrics_init(const char *shmname)
+{
+    if (_segment != NULL) return true;
+    if (shmname == NULL) shmname = METRICS_DEFAULT_SHMNAME;
+
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    if (ncpu < 1) ncpu = 1;
+    if (ncpu > METRICS_MAX_BLOCKS) ncpu = METRICS_MAX_BLOCKS;
+    size_t size = sizeof(struct _segment) + (sizeof(struct _block) * ncpu);
+
+    bool created;
+    struct _segment *segment = _q_shm_map(shmname, size, METRICS_MAGIC,
+                                          METRICS_VERSION, &created);
+    if (segment == NULL) return false;
+
+    if (created == true) {
+        segment->hdr.version = METRICS_VERSION;
+        segment->hdr.nblocks = ncpu;
+        __atomic_store_n(&segment->hdr.magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    } else if (segment->hdr.nblocks != ncpu) {
+        WARN("Incompatible metrics segment %s.", shmname);
+        munmap(segment, size);
+        return false;
+    }
+
+    _segment = segment;
+    return true;
+}
+
+/**
+ * Print out aggregated metrics in Prometheus text exposition format.
+ *
+ * @param shmname   shared memory object name given to qcgimetrics_init().
+ *                  NULL can be used for the default name.
+ * @param out       output stream such like stdout.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @code
+ *   qcgires_setcontenttype(req, "text/plain; version=0.0.4");
+ *   qcgimetrics_export(NULL, stdout);
+ * @endcode
+ */
+bool qcgimetrics_export(const char *shmname, FILE *out)
+{
+    if (out == NULL || qcgimetrics_init(shmname) == false) return false;
+
+    uint32_t nblocks = _segment->hdr.nblocks;
+    uint32_t b;
+    int i, j;
+
+    for (i = 0; i < _Q_M_MAX; i++) {
+        uint64_t sum = 0;
+        for (b = 0; b < nblocks; b++) {
+            sum += __atomic_load_n(&_segment->blocks[b].counters[i],
+                                   __ATOMIC_RELAXED);
+        }
+        fprintf(out, "# HELP %s %s\n", _counters[i].name, _counters[i].help);
+        fprintf(out, "# TYPE %s counter\n", _counters[i].name);
+        fprintf(out, "%s %llu\n", _counters[i].name, (unsigned long long)sum);
+    }
+
+    fprintf(out, "# HELP qdecoder_phase_duration_seconds "
+            "Time spent in each library phase.\n");
+    fprintf(out, "# TYPE qdecoder_phase_duration_seconds histogram\n");
+    for (i = 0; i < _Q_H_MAX; i++) {
+        uint64_t buckets[HIST_BUCKETS];
+        uint64_t count = 0, sum = 0;
+        memset((void *)buckets, 0, sizeof(buckets));
+        for (b = 0; b < nblocks; b++) {
+            struct _hist *hist = &_segment->blocks[b].hist[i];
+            count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+            sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+            for (j = 0; j < HIST_BUCKETS; j++) {
+                buckets[j] += __atomic_load_n(&hist->buckets[j],
+                                              __ATOMIC_RELAXED);
+            }
+        }
+
+        // every bucket is printed, the le set must not change over time.
+        uint64_t cumulative = 0;
+        for (j = 0; j < HIST_BUCKETS; j++) {
+            cumulative += buckets[j];
+            fprintf(out, "qdecoder_phase_duration_seconds_bucket"
+                    "{phase=\"%s\",le=\"%.6f\"} %llu\n", _phases[i],
+                    (double)_hist_upper(j) / 1000000,
+                    (unsigned long long)cumulative);
+        }
+        fprintf(out, "qdecoder_phase_duration_seconds_bucket"
+                "{phase=\"%s\",le=\"+Inf\"} %llu\n", _phases[i],
+                (unsigned long long)count);
+        fprintf(out, "qdecoder_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n",
+                _phases[i], (double)sum / 1000000);
+        fprintf(out, "qdecoder_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+                _phases[i], (unsigned long long)count);
+    }
+
+    return true;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+void _q_metrics_add(int counter, uint64_t value)
+{
+    if (_segment == NULL) return;
+    __atomic_fetch_add(&_getblock()->counters[counter], value,
+                       __ATOMIC_RELAXED);
+}
+
+void _q_metrics_observe(int histogram, uint64_t usec)
+{
+    if (_segment == NULL) return;
+    struct _hist *hist = &_getblock()->hist[histogram];
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+
+    int index = _hist_index(usec);
+    if (index >= 0) {
+        __atomic_fetch_add(&hist->buckets[index], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static struct _block *_getblock(void)
+{
+    int cpu = sched_getcpu();
+    if (cpu < 0) cpu = 0;
+    return &_segment->blocks[cpu % _segment->hdr.nblocks];
+}
+
+// -1 if it's beyond the last bucket. it will be counted only in +Inf.
+static int _hist_index(uint64_t usec)
+{
+    if (usec < HIST_SUB) return (int)usec;
+
+    int msb = 63 - __builtin_clzll(usec);
+    int index = HIST_SUB + ((msb - HIST_SUB_BITS) * HIST_SUB)
+                + (int)((usec >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    if (index >= HIST_BUCKETS) return -1;
+    return index;
+}
+
+// inclusive upper bound of the bucket in microseconds.
+static uint64_t _hist_upper(int index)
+{
+    if (index < HIST_SUB) return index;
+
+    int msb = ((index - HIST_SUB) / HIST_SUB) + HIST_SUB_BITS;
+    uint64_t sub = (index - HIST_SUB) % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,586 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgimultipart.c Streaming multipart/form-data Encoder API
+ *
+ * Builds a multipart/form-data body from qentry_t fields, files and file
+ * descriptors, to forward a request to another service without holding
+ * files in memory. The total length is known before anything is written, so
+ * Content-Length can be sent first, then file parts are copied to the
+ * output with sendfile().
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/tmp", 86400);
+ *   req = qcgireq_parse(req, 0);
+ *
+ *   // uploaded files in req are added as file parts.
+ *   qcgimultipart_t *mp = qcgimultipart(NULL);
+ *   qcgimultipart_addentry(mp, req);
+ *   qcgimultipart_addfile(mp, "report", "/data/report.pdf", NULL,
+ *                         "application/pdf");
+ *
+ *   dprintf(sock, "POST /import HTTP/1.0\r\n"
+ *                 "Content-Type: %s\r\n"
+ *                 "Content-Length: %jd\r\n\r\n",
+ *           qcgimultipart_getcontenttype(mp),
+ *           (intmax_t)qcgimultipart_getlength(mp));
+ *   qcgimultipart_write(mp, sock);
+ *   qcgimultipart_free(mp);
+ * @endcode
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <zlib.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define MULTIPART_COPY_SIZE     (64 * 1024)
+
+struct _part {
+    char *header;       /* boundary line and part headers */
+    size_t headerlen;
+    void *data;         /* in-memory value, or NULL for a file part */
+    size_t datasize;
+    bool owndata;
+    int fd;             /* file part */
+    bool ownfd;
+    off_t offset;
+    off_t filesize;     /* bytes to send, the original size if gzip */
+    bool gzip;          /* file is gzip, inflated while it's sent */
+};
+
+struct qcgimultipart_s {
+    char boundary[64];
+    char contenttype[128];
+    struct _part *parts;
+    int num;
+    off_t length;       /* without the closing boundary */
+};
+
+static bool _addpart(qcgimultipart_t *mp, const char *name,
+                     const char *filename, const char *contenttype,
+                     const void *data, size_t size, bool copy,
+                     int fd, bool ownfd);
+static char *_quote(const char *str);
+static bool _writeall(int fd, const void *buf, size_t size);
+static bool _copyfd(int outfd, int infd, off_t offset, off_t size);
+static bool _inflatefd(int outfd, int infd, off_t offset, off_t size);
+
+#endif
+
+/**
+ * Create a new multipart/form-data encoder.
+ *
+ * @param boundary  boundary string. NULL to generate one.
+ *
+ * @return  qcgimultipart_t pointer if successful, otherwise returns NULL.
+ */
+qcgimultipart_t *qcgimultipart(const char *boundary)
+{
+    if (boundary != NULL && (strlen(boundary) == 0 || strlen(boundary) > 40)) {
+        return NULL;
+    }
+
+    qcgimultipart_t *mp;
+    mp = (qcgimultipart_t *)calloc(1, sizeof(qcgimultipart_t));
+    if (mp == NULL) return NULL;
+
+    if (boundary != NULL) {
+        _q_strcpy(mp->boundary, sizeof(mp->boundary), boundary);
+    } else {
+        static unsigned int seq = 0;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        snprintf(mp->boundary, sizeof(mp->boundary),
+                 "----qDecoder%08x%05x%04x%04x", (unsigned int)tv.tv_sec,
+                 (unsigned int)tv.tv_usec, getpid() % 0x10000,
+                 __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED) % 0x10000);
+    }
+    snprintf(mp->contenttype, sizeof(mp->contenttype),
+             "multipart/form-data; boundary=%s", mp->boundary);
+
+    return mp;
+}
+
+/**
+ * Add a field.
+ *
+ * @param mp        qcgimultipart_t pointer.
+ * @param name      field name.
+ * @param data      field value.
+ * @param size      size of the value.
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgimultipart_addfield(qcgimultipart_t *mp, const char *name,
+                            const void *data, size_t size)
+{
+    if (data == NULL) return false;
+    return _addpart(mp, name, NULL, NULL, data, size, true, -1, false);
+}
+
+/**
+ * Add a file part. The file is not read until qcgimultipart_write().
+ *
+ * @param mp            qcgimultipart_t pointer.
+ * @param name          field name.
+ * @param filepath      path of the file to send.
+ * @param filename      file name to send. NULL to use the one of filepath.
+ * @param contenttype   mime type. NULL for "application/octet-stream".
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgimultipart_addfile(qcgimultipart_t *mp, const char *name,
+                           const char *filepath, const char *filename,
+                           const char *contenttype)
+{
+    if (filepath == NULL) return false;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    char *basename = NULL;
+    if (filename == NULL) filename = basename = _q_filename(filepath);
+
+    bool ret = _addpart(mp, name, filename, contenttype, NULL, 0, false,
+                        fd, true);
+    if (basename != NULL) free(basename);
+    if (ret == false) close(fd);
+
+    return ret;
+}
+
+/**
+ * Add a file part from an open file descriptor. It's sent from the current
+ * file offset to the end of the file.
+ *
+ * @param mp            qcgimultipart_t pointer.
+ * @param name          field name.
+ * @param fd            regular file descriptor. It's not closed.
+ * @param filename      file name to send.
+ * @param contenttype   mime type. NULL for "application/octet-stream".
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgimultipart_addfd(qcgimultipart_t *mp, const char *name, int fd,
+                         const char *filename, const char *contenttype)
+{
+    if (fd < 0 || filename == NULL) return false;
+    return _addpart(mp, name, filename, contenttype, NULL, 0, false,
+                    fd, false);
+}
+
+/**
+ * Add all fields of a qentry_t container, such as a parsed request.
+ *
+ * @param mp        qcgimultipart_t pointer.
+ * @param entry     qentry_t container pointer.
+ *
+ * @return  number of parts added, or -1 on failure.
+ *
+ * @note
+ * Uploaded files are added as file parts with their original file names and
+ * mime types. In file mode, they are sent from NAME.savepath. Their
+ * NAME.filename, NAME.length, NAME.contenttype, NAME.savepath, NAME.encoding
+ * and NAME.storedlength entries, internal "_Q_" entries and nested
+ * containers are not added. Files stored with gzip are decompressed while
+ * they're sent, so the original contents are relayed.
+ *
+ * Values are not copied, the container must be kept unchanged until
+ * qcgimultipart_write() is done. Containers whose objects are not linked
+ * through first/next, like the ones from qcdb_open(), are rejected.
+ */
+int qcgimultipart_addentry(qcgimultipart_t *mp, qentry_t *entry)
+{
+    if (mp == NULL || entry == NULL) return -1;
+    if (entry->first == NULL && entry->num > 0) {
+        WARN("Container can't be walked, use getnext().");
+        return -1;
+    }
+
+    static const char *meta[] = {
+        ".filename", ".length", ".contenttype", ".savepath", ".encoding",
+        ".storedlength", NULL
+    };
+
+    int added = 0;
+    qentobj_t *obj;
+    for (obj = entry->first; obj; obj = obj->next) {
+        if (obj->child != NULL || !strncmp(obj->name, "_Q_", 3)) continue;
+
+        // skip upload meta information.
+        size_t namelen = strlen(obj->name);
+        int i;
+        for (i = 0; meta[i] != NULL; i++) {
+            size_t metalen = strlen(meta[i]);
+            if (namelen <= metalen ||
+                strcmp(obj->name + namelen - metalen, meta[i])) continue;
+
+            char *base = strndup(obj->name, namelen - metalen);
+            bool upload = (base != NULL &&
+                           entry->getstrf(entry, false, "%s.filename", base)
+                           != NULL);
+            free(base);
+            if (upload == true) break;
+        }
+        if (meta[i] != NULL) continue;
+
+        const char *filename = entry->getstrf(entry, false, "%s.filename",
+                                              obj->name);
+        const char *contenttype = entry->getstrf(entry, false,
+                                                 "%s.contenttype", obj->name);
+        const char *savepath = entry->getstrf(entry, false, "%s.savepath",
+                                              obj->name);
+        const char *encoding = entry->getstrf(entry, false, "%s.encoding",
+                                              obj->name);
+        bool ret;
+        if (savepath != NULL && encoding != NULL && !strcmp(encoding, "gzip")) {
+            // the original size, for the Content-Length.
+            const char *length = entry->getstrf(entry, false, "%s.length",
+                                                obj->name);
+            ret = (length != NULL &&
+                   qcgimultipart_addfile(mp, obj->name, savepath, filename,
+                                         contenttype));
+            if (ret == true) {
+                struct _part *part = &mp->parts[mp->num - 1];
+                off_t origsize = (off_t)strtoll(length, NULL, 10);
+                mp->length += origsize - part->filesize;
+                part->filesize = origsize;
+                part->gzip = true;
+            }
+        } else if (savepath != NULL) {
+            ret = qcgimultipart_addfile(mp, obj->name, savepath, filename,
+                                        contenttype);
+        } else {
+            // stored values have the terminating NUL.
+            size_t size = obj->size;
+            if (size > 0 && ((char *)obj->data)[size - 1] == '\0') size--;
+            ret = _addpart(mp, obj->name, filename, contenttype, obj->data,
+                           size, false, -1, false);
+        }
+        if (ret == false) return -1;
+        added++;
+    }
+
+    return added;
+}
+
+/**
+ * Get the Content-Type header value of the body.
+ *
+ * @param mp    qcgimultipart_t pointer.
+ *
+ * @return  "multipart/form-data; boundary=..." string.
+ */
+const char *qcgimultipart_getcontenttype(qcgimultipart_t *mp)
+{
+    if (mp == NULL) return NULL;
+    return mp->contenttype;
+}
+
+/**
+ * Get the length of the whole body, to be sent as Content-Length.
+ *
+ * @param mp    qcgimultipart_t pointer.
+ *
+ * @return  number of bytes qcgimultipart_write() will write.
+ */
+off_t qcgimultipart_getlength(qcgimultipart_t *mp)
+{
+    if (mp == NULL) return 0;
+    return mp->length + CONST_STRLEN("--") + strlen(mp->boundary)
+           + CONST_STRLEN("--" CRLF);
+}
+
+/**
+ * Write the body to a file descriptor.
+ *
+ * @param mp    qcgimultipart_t pointer.
+ * @param fd    output file descriptor like a socket or a pipe.
+ *
+ * @return  number of bytes written if successful, otherwise returns -1.
+ *
+ * @note
+ * File parts are copied with sendfile() when the system supports it.
+ * When writing to stdout, flush it with fflush() beforehand.
+ */
+off_t qcgimultipart_write(qcgimultipart_t *mp, int fd)
+{
+    if (mp == NULL || fd < 0) return -1;
+
+    int i;
+    for (i = 0; i < mp->num; i++) {
+        struct _part *part = &mp->parts[i];
+        if (_writeall(fd, part->header, part->headerlen) == false) return -1;
+
+        if (part->data != NULL) {
+            if (_writeall(fd, part->data, part->datasize) == false) return -1;
+        } else if (part->gzip == true) {
+            if (_inflatefd(fd, part->fd, part->offset, part->filesize)
+                == false) {
+                ERROR("Can't send gzip file part %d. (errno=%d)", i, errno);
+                return -1;
+            }
+        } else if (_copyfd(fd, part->fd, part->offset, part->filesize)
+                   == false) {
+            ERROR("Can't send file part %d. (errno=%d)", i, errno);
+            return -1;
+        }
+
+        if (_writeall(fd, CRLF, CONST_STRLEN(CRLF)) == false) return -1;
+    }
+
+    char closing[64 + 8];
+    int len = snprintf(closing, sizeof(closing), "--%s--" CRLF, mp->boundary);
+    if (_writeall(fd, closing, len) == false) return -1;
+
+    return qcgimultipart_getlength(mp);
+}
+
+/**
+ * De-allocate the encoder and close the files it opened.
+ *
+ * @param mp    qcgimultipart_t pointer.
+ */
+void qcgimultipart_free(qcgimultipart_t *mp)
+{
+    if (mp == NULL) return;
+
+    int i;
+    for (i = 0; i < mp->num; i++) {
+        struct _part *part = &mp->parts[i];
+        free(part->header);
+        if (part->owndata == true) free(part->data);
+        if (part->ownfd == true) close(part->fd);
+    }
+    if (mp->parts != NULL) free(mp->parts);
+    free(mp);
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static bool _addpart(qcgimultipart_t *mp, const char *name,
+                     const char *filename, const char *contenttype,
+                     const void *data, size_t size, bool copy,
+                     int fd, bool ownfd)
+{
+    if (mp == NULL || name == NULL) return false;
+
+    // file size is fixed now, for the Content-Length.
+    off_t offset = 0, filesize = 0;
+    if (data == NULL) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        if (ownfd == false) {
+            offset = lseek(fd, 0, SEEK_CUR);
+            if (offset < 0 || offset > st.st_size) return false;
+        }
+        filesize = st.st_size - offset;
+    }
+
+    struct _part *parts = (struct _part *)realloc(
+            mp->parts, sizeof(struct _part) * (mp->num + 1));
+    if (parts == NULL) return false;
+    mp->parts = parts;
+
+    char *qname = _quote(name);
+    char *qfilename = (filename != NULL) ? _quote(filename) : NULL;
+    char *header = NULL;
+    if (qname != NULL && (filename == NULL || qfilename != NULL)) {
+        int len;
+        if (filename == NULL) {
+            len = asprintf(&header, "--%s" CRLF
+                           "Content-Disposition: form-data; name=\"%s\""
+                           CRLF CRLF, mp->boundary, qname);
+        } else {
+            len = asprintf(&header, "--%s" CRLF
+                           "Content-Disposition: form-data; name=\"%s\"; "
+                           "filename=\"%s\"" CRLF
+                           "Content-Type: %s" CRLF CRLF,
+                           mp->boundary, qname, qfilename,
+                           (contenttype != NULL && *contenttype != '\0')
+                           ? contenttype : "application/octet-stream");
+        }
+        // the contents of header are undefined on failure.
+        if (len < 0) header = NULL;
+    }
+    if (qname != NULL) free(qname);
+    if (qfilename != NULL) free(qfilename);
+    if (header == NULL) return false;
+
+    struct _part *part = &mp->parts[mp->num];
+    memset(part, 0, sizeof(struct _part));
+    part->header = header;
+    part->headerlen = strlen(header);
+    part->fd = fd;
+    part->ownfd = ownfd;
+    part->offset = offset;
+    part->filesize = filesize;
+    if (data != NULL && copy == true) {
+        part->data = malloc((size > 0) ? size : 1);
+        if (part->data == NULL) {
+            free(header);
+            return false;
+        }
+        memcpy(part->data, data, size);
+        part->owndata = true;
+    } else {
+        part->data = (void *)data;
+    }
+    part->datasize = size;
+
+    mp->length += part->headerlen + part->datasize + part->filesize
+                  + CONST_STRLEN(CRLF);
+    mp->num++;
+
+    return true;
+}
+
+// escape '"' and line breaks in names as browsers do.
+static char *_quote(const char *str)
+{
+    char *quoted = (char *)malloc(strlen(str) * 3 + 1);
+    if (quoted == NULL) return NULL;
+
+    char *cp = quoted;
+    for (; *str != '\0'; str++) {
+        switch (*str) {
+            case '"'  : cp += sprintf(cp, "%%22"); break;
+            case '\r' : cp += sprintf(cp, "%%0D"); break;
+            case '\n' : cp += sprintf(cp, "%%0A"); break;
+            default   : *cp++ = *str;
+        }
+    }
+    *cp = '\0';
+
+    return quoted;
+}
+
+static bool _writeall(int fd, const void *buf, size_t size)
+{
+    const char *cp = (const char *)buf;
+    while (size > 0) {
+        ssize_t n = write(fd, cp, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        cp += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool _copyfd(int outfd, int infd, off_t offset, off_t size)
+{
+#ifdef __linux__
+    while (size > 0) {
+        ssize_t n = sendfile(outfd, infd, &offset, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (n <= 0) return false;
+        size -= n;
+    }
+    if (size == 0) return true;
+#endif
+
+    // fallback
+    char buf[MULTIPART_COPY_SIZE];
+    while (size > 0) {
+        size_t want = (size > (off_t)sizeof(buf)) ? sizeof(buf) : size;
+        ssize_t n = pread(infd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        if (_writeall(outfd, buf, n) == false) return false;
+        offset += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// decompress a gzip file, it must inflate to exactly size bytes.
+static bool _inflatefd(int outfd, int infd, off_t offset, off_t size)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) return false;
+
+    unsigned char in[MULTIPART_COPY_SIZE], out[MULTIPART_COPY_SIZE];
+    int status = Z_OK;
+    while (status != Z_STREAM_END) {
+        if (zs.avail_in == 0) {
+            ssize_t n = pread(infd, in, sizeof(in), offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            offset += n;
+            zs.next_in = in;
+            zs.avail_in = n;
+        }
+
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        status = inflate(&zs, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) break;
+
+        size_t n = sizeof(out) - zs.avail_out;
+        if ((off_t)n > size) break;
+        if (_writeall(outfd, out, n) == false) break;
+        size -= n;
+    }
+    inflateEnd(&zs);
+
+    // the Content-Length has been sent already.
+    if (status != Z_STREAM_END || size != 0) {
+        WARN("Broken gzip file part.");
+        return false;
+    }
+    return true;
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,667 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgipack.c Asset Pack API
+ *
+ * An asset pack is one file holding many small files like icons and
+ * thumbnails, with a minimal perfect hash index of the member names. Each
+ * index slot has the offset, length, mtime, mime type and ETag of a member,
+ * so serving it costs a lookup in the mapped index and a sendfile() from
+ * the pack, instead of fopen(), stat() and fclose() per file.
+ *
+ * @code
+ *   [build] (see examples/packmake.c)
+ *   qentry_t *files = qEntry();
+ *   files->putstr(files, "icons/home.png", "/src/icons/home.png", false);
+ *   files->putstr(files, "icons/user.png", "/src/icons/user.png", false);
+ *   qcgipack_build(files, "/var/www/assets.pack");
+ *   files->free(files);
+ *
+ *   [serve]
+ *   qcgipack_t *pack = qcgipack_open("/var/www/assets.pack");  // once
+ *   while(FCGI_Accept() >= 0) {
+ *     qentry_t *req = qcgireq_parse(NULL, 0);
+ *     if (qcgipack_download(req, pack, getenv("PATH_INFO") + 1) < 0) {
+ *       qcgires_error(req, "Not found.");
+ *     }
+ *     req->free(req);
+ *   }
+ *   qcgipack_free(pack);
+ * @endcode
+ *
+ * @note
+ * The index is mapped read-only and shared by the processes through the
+ * page cache, the member data is never mapped. qcgipack_build() replaces
+ * the file atomically, so running workers keep the old pack until they
+ * open it again.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define PACK_MAGIC      "QPAK"
+#define PACK_VERSION    (1)
+#define PACK_ALIGN(n)   (((n) + 7) & ~((uint64_t)7))
+#define PACK_PAGE       (4096)
+#define PACK_MAXDISP    (1 << 24)   /* displacement tries per bucket */
+#define PACK_COPY_SIZE  (1024 * 64)
+
+/*
+ * file layout : header, slots, displacements, strings, data
+ *
+ * A name is placed in bucket h(name) % nbuckets and then in slot
+ * mix(h(name) ^ disp[bucket]) % nslots, where disp is found at the build
+ * time so that no two names share a slot.
+ */
+struct _header {
+    char magic[4];
+    uint32_t version;
+    uint64_t num;           /* number of members */
+    uint64_t nslots;
+    uint64_t nbuckets;
+    uint64_t slotoffset;
+    uint64_t dispoffset;
+    uint64_t stroffset;
+    uint64_t dataoffset;    /* end of the index, page aligned */
+    uint64_t filesize;
+};
+
+struct _slot {
+    uint64_t offset;        /* data offset in the file */
+    uint64_t length;
+    int64_t mtime;
+    uint32_t name;          /* string offset, 0 for an empty slot */
+    uint32_t mime;          /* string offset */
+    char etag[24];          /* quoted */
+};
+
+struct qcgipack_s {
+    int fd;
+    char *map;              /* index */
+    size_t mapsize;
+    const struct _header *header;
+    const struct _slot *slots;
+    const uint32_t *disp;
+    const char *strings;
+};
+
+struct _member {
+    const char *name;
+    const char *path;
+    uint64_t hash;
+    uint64_t bucket;
+    int bucketsize;     /* names in the bucket */
+    struct stat st;
+};
+
+static const struct {
+    const char *ext;
+    const char *mime;
+} _mimes[] = {
+    { "png", "image/png" }, { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" }, { "webp", "image/webp" }, { "svg", "image/svg+xml" },
+    { "ico", "image/x-icon" }, { "avif", "image/avif" },
+    { "css", "text/css" }, { "js", "text/javascript" },
+    { "html", "text/html" }, { "htm", "text/html" }, { "txt", "text/plain" },
+    { "json", "application/json" }, { "xml", "application/xml" },
+    { "pdf", "application/pdf" }, { "wasm", "application/wasm" },
+    { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" },
+    { NULL, NULL }
+};
+
+static uint64_t _hash(const char *name, size_t len);
+static uint64_t _mix(uint64_t h);
+#define SLOT(h, d, n)   (_mix((h) ^ ((uint64_t)(d) * 0x9e3779b97f4a7c15ULL)) % (n))
+static const char *_mimetype(const char *name);
+static const struct _slot *_find(qcgipack_t *pack, const char *name);
+static int _cmpbucket(const void *a, const void *b, void *arg);
+static bool _place(struct _member *members, int *list, int n,
+                   uint64_t nslots, uint32_t *slotof, uint32_t *taken,
+                   uint32_t *disp);
+static bool _copy(int outfd, off_t offset, const char *path, off_t size,
+                  uint64_t *hash);
+
+#endif
+
+/**
+ * Build an asset pack file.
+ *
+ * @param files     qentry_t container of member names and the paths of the
+ *                  files to pack.
+ * @param filepath  pack file path to create or replace.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * The mime type is decided by the extension of the member name and the
+ * ETag is a hash of the contents. A name appearing again is ignored.
+ */
+bool qcgipack_build(qentry_t *files, const char *filepath)
+{
+    if (files == NULL || filepath == NULL) return false;
+
+    // members
+    int num = 0;
+    struct _member *members = (struct _member *)calloc(files->num + 1,
+                                                       sizeof(struct _member));
+    if (members == NULL) return false;
+    qentobj_t *obj;
+    for (obj = files->first; obj != NULL; obj = obj->next) {
+        if (obj->child != NULL) continue;
+        struct _member *m = &members[num];
+        m->name = obj->name;
+        m->path = (const char *)obj->data;
+        if (stat(m->path, &m->st) != 0 || !S_ISREG(m->st.st_mode)) {
+            ERROR("Can't pack %s.", m->path);
+            free(members);
+            return false;
+        }
+        num++;
+    }
+
+    struct _header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.nslots = num + (num / 4) + 1;
+    header.nbuckets = (num / 4) + 1;
+
+    int i;
+    for (i = 0; i < num; i++) {
+        members[i].hash = _hash(members[i].name, strlen(members[i].name));
+        members[i].bucket = members[i].hash % header.nbuckets;
+    }
+
+    // buckets, the largest first.
+    int *order = (int *)malloc(sizeof(int) * (num + 1));
+    int *sizes = (int *)calloc(header.nbuckets, sizeof(int));
+    for (i = 0; sizes != NULL && i < num; i++) sizes[members[i].bucket]++;
+    for (i = 0; sizes != NULL && i < num; i++) {
+        members[i].bucketsize = sizes[members[i].bucket];
+    }
+    uint32_t *slotof = (uint32_t *)malloc(sizeof(uint32_t) * (num + 1));
+    uint32_t *taken = (uint32_t *)calloc(header.nslots, sizeof(uint32_t));
+    uint32_t *disp = (uint32_t *)calloc(header.nbuckets, sizeof(uint32_t));
+    bool *dup = (bool *)calloc(num + 1, sizeof(bool));
+    bool failed = (order == NULL || sizes == NULL || slotof == NULL
+                   || taken == NULL || disp == NULL || dup == NULL);
+    if (failed == false) {
+        for (i = 0; i < num; i++) order[i] = i;
+        qsort_r(order, num, sizeof(int), _cmpbucket, members);
+
+        int start, end;
+        for (start = 0; start < num && failed == false; start = end) {
+            for (end = start + 1; end < num && members[order[end]].bucket
+                 == members[order[start]].bucket; end++);
+
+            // same names can't be separated, keep the first.
+            int j, k, n = 0;
+            for (j = start; j < end; j++) {
+                for (k = start; k < j; k++) {
+                    if (dup[order[k]] == false
+                        && !strcmp(members[order[j]].name,
+                                   members[order[k]].name)) {
+                        break;
+                    }
+                }
+                if (k < j) dup[order[j]] = true;
+                else order[start + n++] = order[j];
+            }
+            for (j = start + n; j < end; j++) order[j] = -1;
+
+            if (_place(members, order + start, n, header.nslots, slotof,
+                       taken, &disp[members[order[start]].bucket]) == false) {
+                ERROR("Can't build the index of %s.", filepath);
+                failed = true;
+            }
+        }
+    }
+
+    // strings, "" first for the empty slots.
+    size_t strsize = 1;
+    for (i = 0; i < num; i++) {
+        if (dup[i] == true) continue;
+        strsize += strlen(members[i].name) + 1
+                   + strlen(_mimetype(members[i].name)) + 1;
+        header.num++;
+    }
+
+    header.slotoffset = sizeof(header);
+    header.dispoffset = header.slotoffset
+                        + sizeof(struct _slot) * header.nslots;
+    header.stroffset = header.dispoffset
+                       + PACK_ALIGN(sizeof(uint32_t) * header.nbuckets);
+    header.dataoffset = (header.stroffset + strsize + PACK_PAGE - 1)
+                        & ~((uint64_t)PACK_PAGE - 1);
+
+    struct _slot *slots = (struct _slot *)calloc(header.nslots,
+                                                 sizeof(struct _slot));
+    char *strings = (char *)calloc(1, strsize);
+    if (slots == NULL || strings == NULL) failed = true;
+
+    char tmppath[PATH_MAX];
+    snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", filepath);
+    int fd = (failed == false) ? mkstemp(tmppath) : -1;
+    if (fd >= 0) fchmod(fd, DEF_FILE_MODE);
+    else failed = true;
+
+    // data and slots
+    uint64_t offset = header.dataoffset;
+    size_t stroff = 1;
+    for (i = 0; i < num && failed == false; i++) {
+        if (dup[i] == true) continue;
+        struct _member *m = &members[i];
+        struct _slot *slot = &slots[slotof[i]];
+
+        uint64_t hash;
+        if (_copy(fd, offset, m->path, m->st.st_size, &hash) == false) {
+            ERROR("Can't pack %s.", m->path);
+            failed = true;
+            break;
+        }
+        slot->offset = offset;
+        slot->length = m->st.st_size;
+        slot->mtime = m->st.st_mtime;
+        snprintf(slot->etag, sizeof(slot->etag), "\"%016llx\"",
+                 (unsigned long long)hash);
+
+        slot->name = stroff;
+        stroff += sprintf(strings + stroff, "%s", m->name) + 1;
+        slot->mime = stroff;
+        stroff += sprintf(strings + stroff, "%s", _mimetype(m->name)) + 1;
+
+        offset += PACK_ALIGN(m->st.st_size);
+    }
+    header.filesize = offset;
+
+    // index
+    if (failed == false) {
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+            || pwrite(fd, slots, sizeof(struct _slot) * header.nslots,
+                      header.slotoffset)
+               != (ssize_t)(sizeof(struct _slot) * header.nslots)
+            || pwrite(fd, disp, sizeof(uint32_t) * header.nbuckets,
+                      header.dispoffset)
+               != (ssize_t)(sizeof(uint32_t) * header.nbuckets)
+            || pwrite(fd, strings, strsize, header.stroffset)
+               != (ssize_t)strsize
+            || ftruncate(fd, header.filesize) != 0
+            || fsync(fd) != 0) {
+            failed = true;
+        }
+    }
+    if (fd >= 0 && close(fd) != 0) failed = true;
+
+    if (members != NULL) free(members);
+    if (order != NULL) free(order);
+    if (sizes != NULL) free(sizes);
+    if (slotof != NULL) free(slotof);
+    if (taken != NULL) free(taken);
+    if (disp != NULL) free(disp);
+    if (dup != NULL) free(dup);
+    if (slots != NULL) free(slots);
+    if (strings != NULL) free(strings);
+
+    if (fd >= 0 && (failed == true || rename(tmppath, filepath) != 0)) {
+        ERROR("Can't build asset pack %s.", filepath);
+        unlink(tmppath);
+        return false;
+    }
+    return (failed == false);
+}
+
+/**
+ * Open an asset pack.
+ *
+ * @param filepath  file built by qcgipack_build().
+ *
+ * @return  qcgipack_t pointer if successful, otherwise returns NULL.
+ *
+ * @note
+ * Open it once in a worker and keep it for the requests.
+ */
+qcgipack_t *qcgipack_open(const char *filepath)
+{
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct _header header;
+    struct stat st;
+    if (fstat(fd, &st) != 0
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, PACK_MAGIC, sizeof(header.magic))
+        || header.version != PACK_VERSION
+        || header.filesize != (uint64_t)st.st_size
+        || header.nslots == 0 || header.nbuckets == 0
+        || header.slotoffset != sizeof(header)
+        || header.dispoffset < header.slotoffset
+        || (header.dispoffset - header.slotoffset) / sizeof(struct _slot)
+           < header.nslots
+        || header.stroffset < header.dispoffset
+        || (header.stroffset - header.dispoffset) / sizeof(uint32_t)
+           < header.nbuckets
+        || header.dataoffset <= header.stroffset
+        || header.dataoffset > header.filesize) {
+        WARN("Invalid asset pack %s.", filepath);
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, header.dataoffset, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    qcgipack_t *pack = (qcgipack_t *)calloc(1, sizeof(qcgipack_t));
+    if (pack == NULL) {
+        munmap(map, header.dataoffset);
+        close(fd);
+        return NULL;
+    }
+    pack->fd = fd;
+    pack->map = map;
+    pack->mapsize = header.dataoffset;
+    pack->header = (const struct _header *)map;
+    pack->slots = (const struct _slot *)(map + header.slotoffset);
+    pack->disp = (const uint32_t *)(map + header.dispoffset);
+    pack->strings = map + header.stroffset;
+
+    return pack;
+}
+
+/**
+ * Get the information of a member.
+ *
+ * @param pack      qcgipack_t pointer.
+ * @param name      member name.
+ * @param length    if not NULL, the member size will be stored.
+ * @param mtime     if not NULL, the modification time will be stored.
+ * @param mimetype  if not NULL, the mime type will be stored.
+ * @param etag      if not NULL, the quoted ETag will be stored.
+ *
+ * @return  true if the member is found, otherwise returns false.
+ *
+ * @note
+ * The strings point into the pack, do not free them.
+ */
+bool qcgipack_stat(qcgipack_t *pack, const char *name, off_t *length,
+                   time_t *mtime, const char **mimetype, const char **etag)
+{
+    const struct _slot *slot = _find(pack, name);
+    if (slot == NULL) return false;
+
+    if (length != NULL) *length = slot->length;
+    if (mtime != NULL) *mtime = slot->mtime;
+    if (mimetype != NULL) *mimetype = pack->strings + slot->mime;
+    if (etag != NULL) *etag = slot->etag;
+    return true;
+}
+
+/**
+ * Send a member of the asset pack.
+ *
+ * @param request   a pointer of request structure
+ * @param pack      qcgipack_t pointer.
+ * @param name      member name.
+ *
+ * @return  the number of bytes sent, 0 for "304 Not Modified". otherwise
+ *          (member not found) returns -1 and nothing is sent.
+ *
+ * @note
+ * Do not call qcgires_getcontenttype() before. ETag, Last-Modified and
+ * Content-Length are sent with the mime type of the member, and a request
+ * with the matching If-None-Match is answered with 304. The data is copied
+ * from the pack with sendfile() unless FastCGI is enabled.
+ */
+int qcgipack_download(qentry_t *request, qcgipack_t *pack, const char *name)
+{
+    if (qcgires_getcontenttype(request) != NULL) {
+        WARN("Should be called before qcgires_setcontenttype().");
+        return -1;
+    }
+
+    const struct _slot *slot = _find(pack, name);
+    if (slot == NULL) return -1;
+
+    char lastmodified[64];
+    time_t mtime = slot->mtime;
+    struct tm tm;
+    strftime(lastmodified, sizeof(lastmodified), "%a, %d %b %Y %H:%M:%S GMT",
+             gmtime_r(&mtime, &tm));
+
+    const char *inm = getenv("HTTP_IF_NONE_MATCH");
+    if (inm != NULL && (strstr(inm, slot->etag) != NULL
+                        || !strcmp(inm, "*"))) {
+        printf("Status: 304 Not Modified" CRLF);
+        printf("ETag: %s" CRLF, slot->etag);
+        printf("Last-Modified: %s" CRLF, lastmodified);
+        qcgires_setcontenttype(request, pack->strings + slot->mime);
+        return 0;
+    }
+
+    printf("ETag: %s" CRLF, slot->etag);
+    printf("Last-Modified: %s" CRLF, lastmodified);
+    printf("Content-Length: %llu" CRLF, (unsigned long long)slot->length);
+    qcgires_setcontenttype(request, pack->strings + slot->mime);
+
+    fflush(stdout);
+
+    PROBE2(download__start, (char *)name, (off_t)slot->length);
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("download");
+
+    off_t offset = slot->offset;
+    off_t left = slot->length;
+#if defined(__linux__) && !defined(ENABLE_FASTCGI)
+    while (left > 0) {
+        ssize_t n = sendfile(STDOUT_FILENO, pack->fd, &offset, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= n;
+    }
+#endif
+    // fallback, or nothing could be sent with sendfile().
+    char buf[PACK_COPY_SIZE];
+    while (left > 0) {
+        size_t want = (left > (off_t)sizeof(buf)) ? sizeof(buf) : left;
+        ssize_t n = pread(pack->fd, buf, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || fwrite(buf, 1, n, stdout) != (size_t)n) break;
+        offset += n;
+        left -= n;
+    }
+    fflush(stdout);
+
+    int sent = slot->length - left;
+    if (sent > 0) _q_metrics_add(_Q_M_DOWNLOAD_BYTES, sent);
+    _q_metrics_observe(_Q_H_DOWNLOAD, _q_clock_usec() - started);
+    _q_trace_stop(span);
+    PROBE2(download__end, (char *)name, sent);
+
+    return sent;
+}
+
+/**
+ * Close the asset pack.
+ *
+ * @param pack      qcgipack_t pointer.
+ */
+void qcgipack_free(qcgipack_t *pack)
+{
+    if (pack == NULL) return;
+    munmap(pack->map, pack->mapsize);
+    close(pack->fd);
+    free(pack);
+}
+
+#ifndef _DOXYGEN_SKIP
+
+// 64-bit FNV-1a of the name, finished by the murmur3 mixer.
+static uint64_t _hash(const char *name, size_t len)
+{
+    return _mix(_q_fnv64(FNV64_INIT, name, len));
+}
+
+static uint64_t _mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static const char *_mimetype(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (ext != NULL && strchr(ext, '/') == NULL) {
+        int i;
+        for (i = 0; _mimes[i].ext != NULL; i++) {
+            if (!strcasecmp(ext + 1, _mimes[i].ext)) return _mimes[i].mime;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static const struct _slot *_find(qcgipack_t *pack, const char *name)
+{
+    if (pack == NULL || name == NULL) return NULL;
+
+    const struct _header *header = pack->header;
+    if (header->num == 0) return NULL;
+
+    size_t len = strlen(name);
+    uint64_t hash = _hash(name, len);
+    const struct _slot *slot = &pack->slots[
+            SLOT(hash, pack->disp[hash % header->nbuckets], header->nslots)];
+
+    size_t strsize = header->dataoffset - header->stroffset;
+    if (slot->name == 0 || slot->name + len >= strsize
+        || slot->mime >= strsize
+        || memcmp(pack->strings + slot->name, name, len + 1) != 0) {
+        return NULL;
+    }
+    return slot;
+}
+
+// larger buckets first, then by the bucket.
+static int _cmpbucket(const void *a, const void *b, void *arg)
+{
+    const struct _member *members = (const struct _member *)arg;
+    const struct _member *ma = &members[*(const int *)a];
+    const struct _member *mb = &members[*(const int *)b];
+    if (ma->bucketsize != mb->bucketsize) {
+        return mb->bucketsize - ma->bucketsize;
+    }
+    return (ma->bucket < mb->bucket) ? -1 : (ma->bucket > mb->bucket) ? 1 : 0;
+}
+
+// find a displacement which puts all the names of a bucket in free slots.
+static bool _place(struct _member *members, int *list, int n,
+                   uint64_t nslots, uint32_t *slotof, uint32_t *taken,
+                   uint32_t *disp)
+{
+    if (n == 0) return true;
+
+    uint32_t d;
+    for (d = 1; d < PACK_MAXDISP; d++) {
+        int i, j;
+        for (i = 0; i < n; i++) {
+            uint64_t slot = SLOT(members[list[i]].hash, d, nslots);
+            if (taken[slot] != 0) break;
+            for (j = 0; j < i; j++) {
+                if (slotof[list[j]] == slot) break;
+            }
+            if (j < i) break;
+            slotof[list[i]] = slot;
+        }
+        if (i == n) {
+            for (i = 0; i < n; i++) taken[slotof[list[i]]] = 1;
+            *disp = d;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool _copy(int outfd, off_t offset, const char *path, off_t size,
+                  uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    uint64_t h = FNV64_INIT;
+    char buf[PACK_COPY_SIZE];
+    off_t left = size;
+    while (left > 0) {
+        ssize_t n = read(fd, buf, (left > (off_t)sizeof(buf)) ?
+                                  sizeof(buf) : left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        h = _q_fnv64(h, buf, n);
+        if (pwrite(outfd, buf, n, offset) != n) break;
+        offset += n;
+        left -= n;
+    }
+    // the file has grown while it's read.
+    bool changed = (left == 0 && read(fd, buf, 1) != 0);
+    close(fd);
+
+    *hash = h;
+    return (left == 0 && changed == false);
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -0,0 +1,316 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgiprogress.c Upload Progress API
+ *
+ * While qcgireq_parse() is reading a multipart/form-data request, it
+ * publishes the number of bytes received so far and the expected number of
+ * bytes(CONTENT_LENGTH) into a slot table in POSIX shared memory. Another
+ * request can read the progress with qcgiprogress_get() by the same upload
+ * token, without touching the disk.
+ *
+ * The upload token is taken from the "X-Progress-ID" request header or from
+ * the "X-Progress-ID" parameter of the query string of the upload request.
+ *
+ * @code
+ *   [HTML sample]
+ *   <form method="post" action="upload.cgi?X-Progress-ID=1f3a9c"
+ *         enctype="multipart/form-data">
+ *
+ *   [upload.cgi]
+ *   qcgiprogress_init(NULL, 0);
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/tmp", 86400);
+ *   req = qcgireq_parse(req, 0);
+ *
+ *   [progress.cgi?id=1f3a9c] (see examples/progress.c)
+ *   qcgiprogress_init(NULL, 0);
+ *   off_t received, expected;
+ *   if (qcgiprogress_get(id, &received, &expected) == true) {
+ *     printf("%jd / %jd\n", (intmax_t)received, (intmax_t)expected);
+ *   }
+ * @endcode
+ *
+ * @note
+ * The progress is updated once every 16KB of the request body. Finished
+ * uploads stay visible for PROGRESS_LINGER_SEC and the slot is reused after
+ * that.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define PROGRESS_DEFAULT_SHMNAME    "/qdecoder-progress"
+#define PROGRESS_DEFAULT_SLOTS      (1024)
+#define PROGRESS_MAGIC              (0x51505247)    /* "QPRG" */
+#define PROGRESS_VERSION            (1)
+#define PROGRESS_PROBES             (8)
+#define PROGRESS_LINGER_SEC         (60)
+#define PROGRESS_STALE_SEC          (3600)
+#define PROGRESS_TOKEN_PARAM        "X-Progress-ID="
+#define PROGRESS_TOKEN_SIZE         (64)
+#define SLOT_BUSY                   (UINT64_MAX)
+
+struct _slot {
+    uint64_t key;       /* hash of the token, 0 for an empty slot */
+                        /* SLOT_BUSY while it's being claimed */
+    int64_t  received;
+    int64_t  expected;
+    uint64_t updated;   /* milliseconds, monotonic */
+    uint32_t done;
+    char     token[PROGRESS_TOKEN_SIZE];
+} __attribute__((aligned(64)));
+
+struct _table {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t pad;
+    struct _slot slots[];
+};
+
+static struct _table *_table = NULL;
+
+static bool _gettoken(char *token, size_t size);
+static uint64_t _hashkey(const char *token);
+static uint64_t _now(void);
+
+#endif
+
+/**
+ * Attach to the shared upload progress table, creating it if it doesn't
+ * exist. Both the uploading program and the polling program should call it.
+ *
+ * @param shmname   POSIX shared memory object name. NULL can be used for
+ *                  "/qdecoder-progress".
+ * @param slots     maximum number of uploads tracked at a time. 0 for
+ *                  default(1024). Every process must use the same number.
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgiprogress_init(const char *shmname, int slots)
+{
+    if (_table != NULL) return true;
+    if (shmname == NULL) shmname = PROGRESS_DEFAULT_SHMNAME;
+    if (slots <= 0) slots = PROGRESS_DEFAULT_SLOTS;
+
+    size_t size = sizeof(struct _table) + (sizeof(struct _slot) * slots);
+
+    bool created;
+    struct _table *table = _q_shm_map(shmname, size, PROGRESS_MAGIC,
+                                      PROGRESS_VERSION, &created);
+    if (table == NULL) return false;
+
+    if (created == true) {
+        table->version = PROGRESS_VERSION;
+        table->nslots = slots;
+        __atomic_store_n(&table->magic, PROGRESS_MAGIC, __ATOMIC_RELEASE);
+    } else if (table->nslots != slots) {
+        WARN("Incompatible upload progress table %s.", shmname);
+        munmap(table, size);
+        return false;
+    }
+
+    _table = table;
+    return true;
+}
+
+/**
+ * Get the progress of an upload.
+ *
+ * @param token     upload token.
+ * @param received  if not NULL, number of bytes received will be stored.
+ * @param expected  if not NULL, number of bytes expected will be stored.
+ *                  0 if the client didn't send CONTENT_LENGTH.
+ *
+ * @return  true if the upload was found, otherwise(not started yet,
+ *          failed or expired) returns false.
+ *
+ * @note
+ * The upload is complete when received is equal to expected.
+ */
+bool qcgiprogress_get(const char *token, off_t *received, off_t *expected)
+{
+    if (_table == NULL || token == NULL) return false;
+
+    uint64_t key = _hashkey(token);
+    uint32_t i;
+    for (i = 0; i < PROGRESS_PROBES; i++) {
+        struct _slot *slot = &_table->slots[(key + i) % _table->nslots];
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) != key) continue;
+        if (strncmp(slot->token, token, sizeof(slot->token)) != 0) continue;
+
+        if (received != NULL) {
+            *received = __atomic_load_n(&slot->received, __ATOMIC_RELAXED);
+        }
+        if (expected != NULL) {
+            *expected = __atomic_load_n(&slot->expected, __ATOMIC_RELAXED);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+/*
+ * Find a slot for the upload token of the current request.
+ *
+ * @return  slot number, or -1 when progress tracking is not used.
+ */
+int _q_progress_begin(off_t expected)
+{
+    char token[PROGRESS_TOKEN_SIZE];
+    if (_table == NULL || _gettoken(token, sizeof(token)) == false) return -1;
+
+    uint64_t key = _hashkey(token);
+    uint64_t now = _now();
+    uint32_t i;
+    for (i = 0; i < PROGRESS_PROBES; i++) {
+        int n = (key + i) % _table->nslots;
+        struct _slot *slot = &_table->slots[n];
+        uint64_t cur = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (cur == SLOT_BUSY) continue;
+        if (cur != 0 && cur != key) {
+            // reuse finished or abandoned one
+            uint64_t updated = __atomic_load_n(&slot->updated,
+                                               __ATOMIC_RELAXED);
+            uint64_t idle = (now > updated) ? now - updated : 0;
+            if (!(__atomic_load_n(&slot->done, __ATOMIC_RELAXED) != 0
+                  && idle > PROGRESS_LINGER_SEC * 1000)
+                && idle <= PROGRESS_STALE_SEC * 1000) {
+                continue;
+            }
+        }
+
+        if (cur != key &&
+            __atomic_compare_exchange_n(&slot->key, &cur, SLOT_BUSY, false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE) == false) {
+            continue;
+        }
+
+        // the key is published last, so readers never see a half-set slot.
+        _q_strcpy(slot->token, sizeof(slot->token), token);
+        __atomic_store_n(&slot->received, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->expected, expected, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->updated, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    WARN("No upload progress slot available for %s.", token);
+    return -1;
+}
+
+void _q_progress_update(int n, off_t received)
+{
+    if (n < 0) return;
+
+    struct _slot *slot = &_table->slots[n];
+    __atomic_store_n(&slot->received, received, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->updated, _now(), __ATOMIC_RELAXED);
+}
+
+void _q_progress_end(int n, bool success)
+{
+    if (n < 0) return;
+
+    struct _slot *slot = &_table->slots[n];
+    if (success == false) {
+        __atomic_store_n(&slot->key, 0, __ATOMIC_RELEASE);
+        return;
+    }
+
+    int64_t expected = __atomic_load_n(&slot->expected, __ATOMIC_RELAXED);
+    if (expected > 0) {
+        __atomic_store_n(&slot->received, expected, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->updated, _now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+}
+
+// X-Progress-ID header first, then X-Progress-ID=... in the query string.
+static bool _gettoken(char *token, size_t size)
+{
+    const char *header = getenv("HTTP_X_PROGRESS_ID");
+    if (header != NULL && *header != '\0') {
+        _q_strcpy(token, size, header);
+        return true;
+    }
+
+    const char *query = getenv("QUERY_STRING");
+    const char *p;
+    for (p = query; p != NULL; p = strchr(p, '&')) {
+        if (*p == '&') p++;
+        if (strncmp(p, PROGRESS_TOKEN_PARAM,
+                    CONST_STRLEN(PROGRESS_TOKEN_PARAM)) == 0) {
+            p += CONST_STRLEN(PROGRESS_TOKEN_PARAM);
+            size_t len = strcspn(p, "&");
+            if (len == 0) return false;
+            if (len >= size) len = size - 1;
+            memcpy(token, p, len);
+            token[len] = '\0';
+            _q_urldecode(token);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint64_t _hashkey(const char *token)
+{
+    uint64_t hash = _q_fnv64(FNV64_INIT, token, strlen(token));
+    return (hash != 0 && hash != SLOT_BUSY) ? hash : 1;
+}
+
+static uint64_t _now(void)
+{
+    return _q_clock_usec() / 1000;
+}
+
+#endif /* _DOXYGEN_SKIP */
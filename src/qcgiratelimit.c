@@ -0,0 +1,268 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgiratelimit.c Per-client Rate Limiting API
+ *
+ * Requests are admitted by token buckets kept in a fixed-size hash table in
+ * POSIX shared memory, keyed by REMOTE_ADDR and an optional route key. Every
+ * CGI process or FastCGI worker on the host shares the same buckets and
+ * updates them with atomic compare-and-swap, no lock is taken.
+ *
+ * The check is meant to be done before qcgireq_parse(), so a rejected
+ * request costs neither body reading, parsing nor session I/O.
+ *
+ * @code
+ *   qcgiratelimit_init(NULL, 0);
+ *
+ *   // 5 requests per second with burst of 20 for each client address.
+ *   if (qcgiratelimit_admit(NULL, "search", 5.0, 20) == false) {
+ *     return 0; // "429 Too Many Requests" has been sent.
+ *   }
+ *   qentry_t *req = qcgireq_parse(NULL, 0);
+ * @endcode
+ *
+ * @note
+ * Buckets which have been idle for RATELIMIT_IDLE_SEC are reused for other
+ * clients. When no bucket can be found in a few probes, the request is
+ * admitted.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define RATELIMIT_DEFAULT_SHMNAME   "/qdecoder-ratelimit"
+#define RATELIMIT_DEFAULT_BUCKETS   (64 * 1024)
+#define RATELIMIT_MAGIC             (0x51524c54)    /* "QRLT" */
+#define RATELIMIT_VERSION           (1)
+#define RATELIMIT_PROBES            (8)
+#define RATELIMIT_IDLE_SEC          (300)
+
+/*
+ * bucket state : upper 40 bits for the last update time in milliseconds,
+ * lower 24 bits for the number of tokens in 1/1000 token.
+ */
+#define STATE_TOKEN_BITS            (24)
+#define STATE_TOKEN_MASK            ((1ULL << STATE_TOKEN_BITS) - 1)
+#define STATE_TIME_MASK             ((1ULL << (64 - STATE_TOKEN_BITS)) - 1)
+#define MAX_BURST                   (STATE_TOKEN_MASK / 1000)
+
+struct _bucket {
+    uint64_t key;
+    uint64_t state;
+};
+
+struct _table {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbuckets;
+    uint32_t pad;
+    struct _bucket buckets[];
+};
+
+static struct _table *_table = NULL;
+
+static struct _bucket *_findbucket(uint64_t key, uint64_t now);
+static uint64_t _hashkey(const char *addr, const char *route);
+
+#endif
+
+/**
+ * Attach to the shared rate limiting table, creating it if it doesn't exist.
+ *
+ * @param shmname   POSIX shared memory object name. NULL can be used for
+ *                  "/qdecoder-ratelimit".
+ * @param buckets   number of buckets. 0 for default(65536). Every process
+ *                  must use the same number.
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgiratelimit_init(const char *shmname, int buckets)
+{
+    if (_table != NULL) return true;
+    if (shmname == NULL) shmname = RATELIMIT_DEFAULT_SHMNAME;
+    if (buckets <= 0) buckets = RATELIMIT_DEFAULT_BUCKETS;
+
+    size_t size = sizeof(struct _table) + (sizeof(struct _bucket) * buckets);
+
+    bool created;
+    struct _table *table = _q_shm_map(shmname, size, RATELIMIT_MAGIC,
+                                      RATELIMIT_VERSION, &created);
+    if (table == NULL) return false;
+
+    if (created == true) {
+        table->version = RATELIMIT_VERSION;
+        table->nbuckets = buckets;
+        __atomic_store_n(&table->magic, RATELIMIT_MAGIC, __ATOMIC_RELEASE);
+    } else if (table->nbuckets != buckets) {
+        WARN("Incompatible rate limiting table %s.", shmname);
+        munmap(table, size);
+        return false;
+    }
+
+    _table = table;
+    return true;
+}
+
+/**
+ * Take a token from the bucket of the client. If there's none, send
+ * "429 Too Many Requests" response.
+ *
+ * @param request   qentry_t container pointer. NULL can be used since this
+ *                  is usually called before qcgireq_parse().
+ * @param route     route key to limit separately like "login".
+ *                  NULL for a single bucket per client address.
+ * @param rate      tokens refilled per second.
+ * @param burst     bucket size. (max 16777)
+ *
+ * @return  true if the request is admitted, false if it's rejected and the
+ *          response has been sent.
+ *
+ * @note
+ * The request is always admitted when qcgiratelimit_init() wasn't called or
+ * REMOTE_ADDR is not set.
+ */
+bool qcgiratelimit_admit(qentry_t *request, const char *route, double rate,
+                         int burst)
+{
+    const char *addr = getenv("REMOTE_ADDR");
+    if (_table == NULL || addr == NULL || rate <= 0 || burst <= 0) return true;
+    if (burst > MAX_BURST) burst = MAX_BURST;
+
+    uint64_t now = (_q_clock_usec() / 1000) & STATE_TIME_MASK;
+    struct _bucket *bucket = _findbucket(_hashkey(addr, route), now);
+    if (bucket == NULL) return true;
+
+    uint64_t full = (uint64_t)burst * 1000;
+    uint64_t old = __atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE);
+    uint64_t tokens;
+    while (true) {
+        if (old == 0) {
+            tokens = full;
+        } else {
+            uint64_t last = old >> STATE_TOKEN_BITS;
+            uint64_t elapsed = (now > last) ? now - last : 0;
+            // rate tokens per second is same as rate milli-tokens per ms.
+            tokens = (old & STATE_TOKEN_MASK) + (uint64_t)(elapsed * rate);
+            if (tokens > full) tokens = full;
+        }
+        if (tokens < 1000) break; // reject
+
+        uint64_t new = (now << STATE_TOKEN_BITS) | (tokens - 1000);
+        if (__atomic_compare_exchange_n(&bucket->state, &old, new, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+
+    // reject
+    int retry = (int)(((1000 - tokens) / rate + 999) / 1000);
+    if (retry < 1) retry = 1;
+
+    INFO("Rate limited. (addr=%s, route=%s)", addr,
+         (route != NULL) ? route : "");
+    PROBE2(ratelimit__reject, addr, route);
+    _q_metrics_add(_Q_M_LIMIT_REJECTIONS, 1);
+
+    printf("Status: 429 Too Many Requests" CRLF);
+    printf("Retry-After: %d" CRLF, retry);
+    qcgires_setcontenttype(request, "text/plain");
+    printf("Too Many Requests\n");
+
+    return false;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static struct _bucket *_findbucket(uint64_t key, uint64_t now)
+{
+    // touched now with the most tokens, admit() caps it to the burst.
+    uint64_t fresh = (now << STATE_TOKEN_BITS) | STATE_TOKEN_MASK;
+
+    uint32_t nbuckets = _table->nbuckets;
+    uint32_t i;
+    for (i = 0; i < RATELIMIT_PROBES; i++) {
+        struct _bucket *bucket = &_table->buckets[(key + i) % nbuckets];
+        uint64_t cur = __atomic_load_n(&bucket->key, __ATOMIC_ACQUIRE);
+        if (cur == key) return bucket;
+
+        // claim an empty one
+        if (cur == 0) {
+            if (__atomic_compare_exchange_n(&bucket->key, &cur, key, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                uint64_t empty = 0;
+                __atomic_compare_exchange_n(&bucket->state, &empty, fresh,
+                                            false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED);
+                return bucket;
+            }
+            if (cur == key) return bucket;
+            continue;
+        }
+
+        // reuse an idle one, it starts again with a full bucket. the state
+        // is taken first so only one process wins it, and 0 is a bucket
+        // which has just been claimed.
+        uint64_t state = __atomic_load_n(&bucket->state, __ATOMIC_ACQUIRE);
+        uint64_t last = state >> STATE_TOKEN_BITS;
+        if (state != 0 && now > last && now - last > RATELIMIT_IDLE_SEC * 1000
+            && __atomic_compare_exchange_n(&bucket->state, &state, fresh,
+                                           false, __ATOMIC_ACQ_REL,
+                                           __ATOMIC_RELAXED)) {
+            __atomic_store_n(&bucket->key, key, __ATOMIC_RELEASE);
+            return bucket;
+        }
+    }
+
+    return NULL;
+}
+
+// 64-bit FNV-1a of "addr\0route". 0 is reserved for empty buckets.
+static uint64_t _hashkey(const char *addr, const char *route)
+{
+    uint64_t hash = _q_fnv64(FNV64_INIT, addr, strlen(addr) + 1);
+    if (route != NULL) hash = _q_fnv64(hash, route, strlen(route));
+    return (hash != 0) ? hash : 1;
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -107,6 +107,10 @@
  * @li (VARIABLE_NAME).contenttype - Mime type like 'text/plain'.
  * @li (VARIABLE_NAME).savepath - Only appended only in <b>file mode</b>.
  * The file path where the uploaded file is saved.
+ * @li (VARIABLE_NAME).encoding - Only appended when the file is stored
+ * compressed by qcgireq_setcompress(), "gzip".
+ * @li (VARIABLE_NAME).storedlength - Only appended with the encoding.
+ * The number of bytes of the saved file.
  *
  * @code
  *   [default mode example]
@@ -138,20 +142,100 @@
 #include <limits.h>
 #ifndef _WIN32
 #include <dirent.h>
+#include <sys/statvfs.h>
 #endif
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <strings.h>
+#include <iconv.h>
+#include <zlib.h>
 #include "qdecoder.h"
 #include "internal.h"
 
 #ifndef _DOXYGEN_SKIP
-static int  _parse_multipart(qentry_t *request);
+struct _parseopt {
+    bool bracket;       /* build nested containers, qcgireq_setbracket() */
+    bool transcode;     /* convert values to UTF-8, qcgireq_setcharset() */
+    iconv_t cd;         /* (iconv_t)-1 if the charset needs no conversion */
+};
+
+static bool _prebody(qentry_t *request);
+static int  _parse_multipart(qentry_t *request, struct _parseopt *opt);
 static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
-                                                bool *finish);
+        bool *finish, int progress, off_t received);
 static char *_parse_multipart_value_into_disk(const char *boundary,
-        const char *savedir, const char *filename, int *filelen, bool *finish);
+        const char *savedir, const char *filename, int *filelen, bool *finish,
+        int progress, off_t received, int level, off_t *storedlen);
 static int _upload_clear_base(const char *upload_basepath, int upload_clearold);
+
+struct _zfile {
+    int fd;
+    bool deflate;       /* gzip stream, otherwise written as it is */
+    z_stream zs;
+    off_t stored;       /* bytes written to the file */
+};
+static int _upload_level(qentry_t *request, const char *contenttype);
+static bool _zfile_open(struct _zfile *zf, int fd, int level);
+static bool _zfile_write(struct _zfile *zf, const void *buf, size_t size);
+static bool _zfile_close(struct _zfile *zf);
+
+#define _Q_UPLOAD_MAXVOLUMES    (64)
+struct _volumes {
+    const char *path[_Q_UPLOAD_MAXVOLUMES];
+    unsigned long long avail[_Q_UPLOAD_MAXVOLUMES];  /* Q_UPLOAD_FREESPACE */
+    int num;
+    int policy;
+};
+static void _upload_volumes(qentry_t *request, struct _volumes *vol);
+static int _upload_place(struct _volumes *vol, const char *name);
+static int _upload_sync(qentry_t *request, qentry_t *files);
+
+#define _Q_SPOOL_MAXTHREADS (16)
+#define _Q_SPOOL_MINSIZE    (1024 * 1024)
+struct _spoolpart {
+    const char *head;   /* part headers */
+    const char *data;
+    size_t len;
+    char *name, *filename, *contenttype;
+    int vol;            /* upload volume, -1 for memory */
+    int level;          /* compression level, 0 for none */
+    size_t stored;      /* saved file size */
+    char *value;        /* malloced data or saved path */
+    bool ok;
+};
+struct _spooljob {
+    const char *map;
+    size_t size;
+    int fd;
+    const char *delim;
+    size_t delimlen;
+    int nranges;
+    size_t **found;     /* boundary offsets per range */
+    int *nfound;
+    struct _spoolpart *parts;
+    int nparts;
+    struct _volumes *volumes;
+    int next;
+};
+static void *_spool_scan(void *arg);
+static void *_spool_store(void *arg);
+static void _spool_run(void *(*func)(void *), struct _spooljob *job,
+                       int threads);
+static bool _spool_header(struct _spoolpart *part, const char *end);
 static qentry_t *_parse_query(qentry_t *request, const char *query,
-                              char equalchar, char sepchar, int *count);
+                              char equalchar, char sepchar,
+                              struct _parseopt *opt, int *count);
+static size_t _parse_query_stream(qentry_t *request, FILE *fp, size_t length,
+                                  char equalchar, char sepchar,
+                                  struct _parseopt *opt, int *count);
+static bool _parse_pair(qentry_t *request, char *pair, char equalchar,
+                        struct _parseopt *opt);
+static void _parseopt_init(qentry_t *request, struct _parseopt *opt);
+static void _set_charset(struct _parseopt *opt, const char *charset);
+static char *_get_charset(const char *content_type);
+static char *_transcode(struct _parseopt *opt, const char *str, size_t *len);
 #endif
 
 /**
@@ -211,6 +295,330 @@ qentry_t *qcgireq_setoption(qentry_t *request, bool filemode,
     return request;
 }
 
+/**
+ * Add an upload volume to spread uploaded files over several disks.
+ *
+ * @param request   qentry_t container pointer which qcgireq_setoption()
+ *                  was called for with filemode true.
+ * @param basepath  another base path where the uploaded files are located.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called after qcgireq_setoption() and before calling
+ * qcgireq_parse(). The volume is cleared by the clearold seconds given to
+ * qcgireq_setoption(). Each uploaded file is placed on one of the volumes
+ * by the policy of qcgireq_setplacement() and 'NAME.savepath' tells which.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/disk1/upload", 86400);
+ *   req = qcgireq_addvolume(req, "/disk2/upload");
+ *   req = qcgireq_addvolume(req, "/disk3/upload");
+ *   req = qcgireq_setplacement(req, Q_UPLOAD_FREESPACE);
+ *   req = qcgireq_parse(req, 0);
+ * @endcode
+ */
+qentry_t *qcgireq_addvolume(qentry_t *request, const char *basepath)
+{
+    if (request == NULL) return NULL;
+
+    if (request->getstr(request, "_Q_UPLOAD_BASEPATH", false) == NULL
+        || basepath == NULL || access(basepath, R_OK|W_OK|X_OK) != 0) {
+        request->free(request);
+        return NULL;
+    }
+
+    // clear old files
+    int clearold = request->getint(request, "_Q_UPLOAD_CLEAROLD");
+    if (clearold > 0 && _upload_clear_base(basepath, clearold) < 0) {
+        request->free(request);
+        return NULL;
+    }
+
+    // save info
+    request->putstr(request, "_Q_UPLOAD_BASEPATH", basepath, false);
+
+    return request;
+}
+
+/**
+ * Set the placement policy of uploaded files over upload volumes.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param policy    one of below.
+ *  @li Q_UPLOAD_ROUNDROBIN : rotate volumes by each file. (default)
+ *  @li Q_UPLOAD_FREESPACE : the volume which has the most free space.
+ *  @li Q_UPLOAD_HASH : the volume chosen by the hash of REMOTE_USER, or the
+ *   field name if there is no REMOTE_USER. Files of a user always go to the
+ *   same volume as long as volumes are not changed.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse().
+ */
+qentry_t *qcgireq_setplacement(qentry_t *request, Q_UPLOAD_T policy)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    request->putint(request, "_Q_UPLOAD_PLACEMENT", policy, true);
+
+    return request;
+}
+
+/**
+ * Set request parsing option for durable file-mode uploads.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param enable    true to flush uploaded files to the disk before
+ *                  qcgireq_parse() returns.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse(). Files are
+ * not synced one by one while they are written. All the uploaded files of a
+ * request are synced together at the end of the body, by fdatasync() on a
+ * few helper threads or by a single syncfs() when a volume has many files,
+ * and then the upload directories are synced for the new names. A file
+ * which failed to sync is removed and its value is set to
+ * "(parsing failure)", so a saved path returned to the handler is on disk.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/data/upload", 0);
+ *   req = qcgireq_setdurable(req, true);
+ *   req = qcgireq_parse(req, 0);
+ * @endcode
+ */
+qentry_t *qcgireq_setdurable(qentry_t *request, bool enable)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (enable == true) {
+        request->putint(request, "_Q_UPLOAD_DURABLE", 1, true);
+    } else {
+        request->remove(request, "_Q_UPLOAD_DURABLE");
+    }
+
+    return request;
+}
+
+/**
+ * Set request parsing option for compressed storage of file-mode uploads.
+ *
+ * @param request       qentry_t container pointer that options will be set.
+ *                      NULL can be used to create a new container.
+ * @param contenttype   mime type of the parts. "type/\*" matches all the
+ *                      subtypes and NULL or "*" matches any type.
+ * @param level         gzip compression level from 1(fast) to 9(small).
+ *                      0 stores the matched parts as they are.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse() and only
+ * works in the file mode. Parts are compressed while they are written to
+ * the disk, so they are not read again. The most specific rule of the
+ * part's Content-Type is used, so already compressed types can be excluded
+ * with level 0. A compressed part has 'NAME.encoding' as "gzip" and
+ * 'NAME.storedlength' as the saved size, while 'NAME.length' is still the
+ * uploaded size. Use qcgires_downloadgzip() to send it back.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/data/upload", 0);
+ *   req = qcgireq_setcompress(req, "text/\*", 6);
+ *   req = qcgireq_setcompress(req, "application/xml", 6);
+ *   req = qcgireq_setcompress(req, "application/octet-stream", 1);
+ *   req = qcgireq_parse(req, 0);
+ * @endcode
+ */
+qentry_t *qcgireq_setcompress(qentry_t *request, const char *contenttype,
+                              int level)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (contenttype == NULL) contenttype = "*";
+    if (level < 0) level = 0;
+    else if (level > 9) level = 9;
+
+    // "LEVEL CONTENTTYPE", the last one of the same type is used.
+    char rule[255+3+1];
+    snprintf(rule, sizeof(rule), "%d %s", level, contenttype);
+    request->putstr(request, "_Q_UPLOAD_COMPRESS", rule, false);
+
+    return request;
+}
+
+/**
+ * Set a hook which decides whether to read the request body or not.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param hook      function called with the request, CONTENT_LENGTH and
+ *                  CONTENT_TYPE before any byte of the body is read. It
+ *                  returns false to reject the request. NULL to remove.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse(). The hook is
+ * called only when there is a body, after COOKIE has been parsed if it is
+ * requested, so the session and any request header(HTTP_*) can be checked.
+ * When the hook rejects the request, the body is not read at all and the
+ * hook should send the response, ending the headers with
+ * qcgires_setcontenttype(). If it doesn't, a "403 Forbidden" response is
+ * sent. The handler can tell a rejected request by qcgires_getcontenttype()
+ * returning non-NULL after parsing. Don't call qcgires_error() from the
+ * hook, it exits the program in the middle of qcgireq_parse().
+ *
+ * With "Expect: 100-continue", web servers such as Apache send the interim
+ * "100 Continue" response only when the CGI program starts reading the
+ * body, so the client never transfers the body of a rejected request.
+ *
+ * @code
+ *   bool check_upload(qentry_t *req, off_t length, const char *type) {
+ *     if (length > 100 * 1024 * 1024) {
+ *       printf("Status: 413 Request Entity Too Large\r\n");
+ *       qcgires_setcontenttype(req, "text/plain");
+ *       printf("Too large.\n");
+ *       return false;
+ *     }
+ *     return true;
+ *   }
+ *
+ *   qentry_t *req = qcgireq_setprebody(NULL, check_upload);
+ *   req = qcgireq_parse(req, 0);
+ *   if (qcgires_getcontenttype(req) != NULL) { // rejected
+ *     req->free(req);
+ *     return 0;
+ *   }
+ * @endcode
+ */
+qentry_t *qcgireq_setprebody(qentry_t *request,
+                             bool (*hook)(qentry_t *request, off_t length,
+                                          const char *contenttype))
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (hook != NULL) {
+        request->put(request, "_Q_PREBODY", &hook, sizeof(hook), true);
+    } else {
+        request->remove(request, "_Q_PREBODY");
+    }
+
+    return request;
+}
+
+/**
+ * Set request parsing option for bracket notation names like PHP.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param enable    true to build nested containers from bracket notation
+ *                  names, false to store them as they are. (default)
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse(). Names of GET
+ * and urlencoded POST queries are parsed as below. Names which are not
+ * well-formed or nested deeper than 32 levels are stored as they are.
+ * @li a[b][c]=1 : nested container "b" in "a", which has "c" = "1".
+ * @li items[]=x&items[]=y : container "items" which has "0" = "x" and
+ *  "1" = "y" in the order.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setbracket(NULL, true);
+ *   req = qcgireq_parse(req, 0);
+ *
+ *   qentry_t *items = req->getchild(req, "items", false);
+ *   if (items != NULL) {
+ *     qentobj_t obj;
+ *     memset((void*)&obj, 0, sizeof(obj));
+ *     while(items->getnext(items, &obj, NULL, false) == true) {
+ *       printf("%s\n", (char *)obj.data);
+ *     }
+ *   }
+ *   req->free(req);
+ * @endcode
+ */
+qentry_t *qcgireq_setbracket(qentry_t *request, bool enable)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (enable == true) request->putint(request, "_Q_BRACKET", 1, true);
+    else request->remove(request, "_Q_BRACKET");
+
+    return request;
+}
+
+/**
+ * Set request parsing option for converting form values to UTF-8.
+ *
+ * @param request   qentry_t container pointer that options will be set.
+ *                  NULL can be used to create a new container.
+ * @param enable    true to store names and values in UTF-8.
+ * @param charset   charset to assume when the request doesn't tell one,
+ *                  like "EUC-KR". NULL to convert only declared charsets.
+ *
+ * @return  qentry_t container pointer, otherwise returns NULL.
+ *
+ * @note
+ * This method should be called before calling qcgireq_parse(). The charset
+ * of a request is taken from "charset=" of CONTENT_TYPE, or the "_charset_"
+ * field which browsers fill in. The "_charset_" field applies to the fields
+ * after it, so put it at the beginning of the form. GET and urlencoded POST
+ * queries and multipart text fields are converted while they are decoded.
+ * Values with only ASCII characters are stored as they are, without calling
+ * iconv. Invalid sequences are replaced with U+FFFD. Charsets should be
+ * ASCII compatible like EUC-KR, Shift_JIS or ISO-8859-x.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setcharset(NULL, true, "Shift_JIS");
+ *   req = qcgireq_parse(req, 0);
+ * @endcode
+ */
+qentry_t *qcgireq_setcharset(qentry_t *request, bool enable,
+                             const char *charset)
+{
+    // initialize entry structure
+    if (request == NULL) {
+        request = qEntry();
+        if (request == NULL) return NULL;
+    }
+
+    if (enable == true) {
+        request->putstr(request, "_Q_CHARSET",
+                        (charset != NULL) ? charset : "", true);
+    } else {
+        request->remove(request, "_Q_CHARSET");
+    }
+
+    return request;
+}
+
 /**
  * Parse one or more request(COOKIE/POST/GET) queries.
  *
@@ -243,41 +651,87 @@ qentry_t *qcgireq_parse(qentry_t *request, Q_CGI_T method)
         if (request == NULL) return NULL;
     }
 
+    PROBE1(parse__start, (int)method);
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("parse");
+    struct _parseopt opt;
+    _parseopt_init(request, &opt);
+
     // parse COOKIE
     if (method == Q_CGI_ALL || (method & Q_CGI_COOKIE) != 0) {
         char *query = qcgireq_getquery(Q_CGI_COOKIE);
         if (query != NULL) {
-            _parse_query(request, query, '=', ';', NULL);
+            _parse_query(request, query, '=', ';', NULL, NULL);
             free(query);
         }
     }
 
     //  parse POST method
-    if (method == Q_CGI_ALL || (method & Q_CGI_POST) != 0) {
+    if ((method == Q_CGI_ALL || (method & Q_CGI_POST) != 0)
+        && _prebody(request) == true) {
         const char *content_type = getenv("CONTENT_TYPE");
         if (content_type == NULL) content_type = "";
+        if (opt.transcode == true) {
+            char *declared = _get_charset(content_type);
+            if (declared != NULL) {
+                _set_charset(&opt, declared);
+                free(declared);
+            }
+        }
         if (!strncmp(content_type, "application/x-www-form-urlencoded",
                      CONST_STRLEN("application/x-www-form-urlencoded"))) {
-            char *query = qcgireq_getquery(Q_CGI_POST);
-            if (query != NULL) {
-                _parse_query(request, query, '=', '&', NULL);
-                free(query);
+            const char *request_method = getenv("REQUEST_METHOD");
+            const char *content_length = getenv("CONTENT_LENGTH");
+            if (request_method != NULL && !strcmp(request_method, "POST")
+                && content_length != NULL) {
+                size_t nread = _parse_query_stream(request, stdin,
+                                                   atoll(content_length),
+                                                   '=', '&', &opt, NULL);
+                _q_metrics_add(_Q_M_BYTES_READ, nread);
             }
         } else if (!strncmp(content_type, "multipart/form-data",
                             CONST_STRLEN("multipart/form-data"))) {
-            _parse_multipart(request);
+            int multipart = _q_trace_start("multipart");
+            _parse_multipart(request, &opt);
+            _q_trace_stop(multipart);
+        } else {
+            // registered body parsers, see qcgibody.c
+            _q_body_parse(request, content_type);
         }
     }
 
     // parse GET method
     if (method == Q_CGI_ALL || (method & Q_CGI_GET) != 0) {
+        // the charset declared by the body doesn't apply to the query.
+        if (opt.cd != (iconv_t)-1) iconv_close(opt.cd);
+        _parseopt_init(request, &opt);
+
         char *query = qcgireq_getquery(Q_CGI_GET);
         if (query != NULL) {
-            _parse_query(request, query, '=', '&', NULL);
+            // _charset_ may be anywhere in the query string.
+            const char *cs = strstr(query, "_charset_=");
+            if (opt.transcode == true && cs != NULL
+                && (cs == query || cs[-1] == '&')) {
+                char *declared = strndup(cs + CONST_STRLEN("_charset_="),
+                                         strcspn(cs, "&")
+                                         - CONST_STRLEN("_charset_="));
+                if (declared != NULL) {
+                    _q_urldecode(declared);
+                    _set_charset(&opt, declared);
+                    free(declared);
+                }
+            }
+            _parse_query(request, query, '=', '&', &opt, NULL);
             free(query);
         }
     }
 
+    if (opt.cd != (iconv_t)-1) iconv_close(opt.cd);
+
+    _q_metrics_add(_Q_M_REQUESTS, 1);
+    _q_metrics_observe(_Q_H_PARSE, _q_clock_usec() - started);
+    _q_trace_stop(span);
+    PROBE2(parse__end, (int)method, request->num);
     return request;
 }
 
@@ -344,9 +798,281 @@ char *qcgireq_getquery(Q_CGI_T method)
     return NULL;
 }
 
+/**
+ * Parse a multipart/form-data request body which is already in a file,
+ * using several threads.
+ *
+ * @param request   qentry_t container pointer that parsed key/value pairs
+ *                  will be stored. It must not be NULL.
+ * @param filepath  path of the spooled request body.
+ * @param threads   number of threads, 0 for the number of online CPUs.
+ *
+ * @return  number of parts parsed, -1 on error.
+ *
+ * @note
+ * Web servers can keep the request body in a file and pass its path
+ * instead of the body itself, like nginx with client_body_in_file_only and
+ * "fastcgi_param REQUEST_BODY_FILE $request_body_file". The body is mmapped
+ * and divided into ranges, and the threads find boundaries in the ranges at
+ * the same time. Then the parts are copied into memory or stored into the
+ * upload volumes on the threads, file parts by copy_file_range() without
+ * passing through user space. Results are the same as qcgireq_parse() with
+ * the options set by qcgireq_setoption(), qcgireq_addvolume(),
+ * qcgireq_setdurable() and qcgireq_setcharset(). CONTENT_TYPE is used for
+ * the boundary. Bodies smaller than 1MB are handled by a single thread.
+ *
+ * @code
+ *   qentry_t *req = qcgireq_setoption(NULL, true, "/data/upload", 86400);
+ *   req = qcgireq_parse(req, Q_CGI_COOKIE | Q_CGI_GET);
+ *   const char *spool = getenv("REQUEST_BODY_FILE");
+ *   if (spool != NULL) qcgireq_parsefile(req, spool, 0);
+ * @endcode
+ */
+int qcgireq_parsefile(qentry_t *request, const char *filepath, int threads)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    if (request == NULL || filepath == NULL) return -1;
+
+    // boundary
+    const char *content_type = getenv("CONTENT_TYPE");
+    const char *bp = (content_type != NULL) ?
+                     strstr(content_type, "boundary=") : NULL;
+    if (bp == NULL) return -1;
+    char boundary[256], delim[256 + 4];
+    _q_strcpy(boundary, sizeof(boundary), bp + CONST_STRLEN("boundary="));
+    _q_strtrim(boundary);
+    _q_strunchar(boundary, '"', '"');
+    snprintf(delim, sizeof(delim), "\r\n--%s", boundary);
+
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)strlen(delim)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    _q_metrics_add(_Q_M_BYTES_READ, size);
+    int span = _q_trace_start("multipart");
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > _Q_SPOOL_MAXTHREADS) threads = _Q_SPOOL_MAXTHREADS;
+    if (threads <= 0 || size < _Q_SPOOL_MINSIZE) threads = 1;
+
+    struct _volumes volumes;
+    _upload_volumes(request, &volumes);
+
+    struct _spooljob job;
+    memset((void *)&job, 0, sizeof(job));
+    job.map = map;
+    job.size = size;
+    job.fd = fd;
+    job.delim = delim;
+    job.delimlen = strlen(delim);
+    job.volumes = &volumes;
+
+    // 1. find boundaries in ranges.
+    job.nranges = threads;
+    job.found = (size_t **)calloc(threads, sizeof(size_t *));
+    job.nfound = (int *)calloc(threads, sizeof(int));
+    int num = -1;
+    if (job.found == NULL || job.nfound == NULL) goto done;
+    _spool_run(_spool_scan, &job, threads);
+
+    // 2. parts between boundaries, in the order.
+    int i, j, total = 0;
+    for (i = 0; i < threads; i++) {
+        if (job.nfound[i] < 0) goto done;
+        total += job.nfound[i];
+    }
+    // the first boundary has no leading CRLF
+    bool first = (!strncmp(map, delim + 2, job.delimlen - 2));
+    job.parts = (struct _spoolpart *)calloc(total + 1,
+                                            sizeof(struct _spoolpart));
+    if (job.parts == NULL) goto done;
+
+    const char *prev = (first == true) ? map + job.delimlen - 2 : NULL;
+    bool closed = false;
+    for (i = 0; i < threads && closed == false; i++) {
+        for (j = 0; j < job.nfound[i] && closed == false; j++) {
+            const char *at = map + job.found[i][j];
+            if (prev != NULL) {
+                // "--" of the closing delimiter, or CRLF to the headers
+                if (prev + 2 > at || strncmp(prev, CRLF, 2)) {
+                    closed = true;
+                    break;
+                }
+                struct _spoolpart *part = &job.parts[job.nparts];
+                part->head = prev + 2;
+                if (_spool_header(part, at) == true) {
+                    part->len = at - part->data;
+                    job.nparts++;
+                } else {
+                    WARN("Invalid part header.");
+                    _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
+                    free(part->name);
+                    free(part->filename);
+                    free(part->contenttype);
+                    memset((void *)part, 0, sizeof(struct _spoolpart));
+                }
+            }
+            prev = at + job.delimlen;
+        }
+    }
+
+    // upload volumes, assigned in the order.
+    for (i = 0; i < job.nparts; i++) {
+        struct _spoolpart *part = &job.parts[i];
+        part->vol = (part->filename != NULL && volumes.num > 0) ?
+                    _upload_place(&volumes, part->name) : -1;
+        part->level = (part->vol >= 0) ?
+                      _upload_level(request, part->contenttype) : 0;
+    }
+
+    // 3. copy or store parts.
+    job.next = 0;
+    _spool_run(_spool_store, &job, (threads < job.nparts) ? threads
+                                                          : job.nparts);
+
+    // 4. put into the request.
+    struct _parseopt opt;
+    _parseopt_init(request, &opt);
+    qentry_t *upload_files = NULL;
+    if (volumes.num > 0 && request->getint(request, "_Q_UPLOAD_DURABLE") == 1) {
+        upload_files = qEntry();
+    }
+    for (i = 0; i < job.nparts; i++) {
+        struct _spoolpart *part = &job.parts[i];
+        if (part->ok == false) {
+            request->putstr(request, part->name, "(parsing failure)", false);
+            _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
+            continue;
+        }
+
+        if (part->vol >= 0) {
+            request->putstr(request, part->name, part->value, false);
+            if (upload_files != NULL) {
+                upload_files->putstr(upload_files, part->value, part->name,
+                                     false);
+            }
+        } else {
+            size_t len = part->len;
+            if (part->filename == NULL && opt.transcode == true) {
+                if (!strcmp(part->name, "_charset_")) {
+                    _set_charset(&opt, part->value);
+                }
+                char *utf8 = _transcode(&opt, part->value, &len);
+                if (utf8 != NULL) {
+                    free(part->value);
+                    part->value = utf8;
+                }
+                utf8 = _transcode(&opt, part->name, NULL);
+                if (utf8 != NULL) {
+                    free(part->name);
+                    part->name = utf8;
+                }
+            }
+            request->put(request, part->name, part->value, len + 1, false);
+        }
+
+        if (part->filename != NULL) {
+            char ename[255+10+1];
+            _q_metrics_add(_Q_M_UPLOAD_BYTES, part->len);
+
+            snprintf(ename, sizeof(ename), "%s.length", part->name);
+            request->putint(request, ename, part->len, false);
+            snprintf(ename, sizeof(ename), "%s.filename", part->name);
+            request->putstr(request, ename, part->filename, false);
+            snprintf(ename, sizeof(ename), "%s.contenttype", part->name);
+            request->putstr(request, ename, (part->contenttype != NULL) ?
+                            part->contenttype : "", false);
+            if (part->vol >= 0) {
+                snprintf(ename, sizeof(ename), "%s.savepath", part->name);
+                request->putstr(request, ename, part->value, false);
+            }
+            if (part->level > 0) {
+                snprintf(ename, sizeof(ename), "%s.encoding", part->name);
+                request->putstr(request, ename, "gzip", false);
+                snprintf(ename, sizeof(ename), "%s.storedlength", part->name);
+                request->putint(request, ename, part->stored, false);
+            }
+        }
+    }
+    if (opt.cd != (iconv_t)-1) iconv_close(opt.cd);
+    if (upload_files != NULL) {
+        if (upload_files->num > 0) _upload_sync(request, upload_files);
+        upload_files->free(upload_files);
+    }
+    num = job.nparts;
+
+done:
+    if (job.parts != NULL) {
+        for (i = 0; i < job.nparts; i++) {
+            struct _spoolpart *part = &job.parts[i];
+            if (part->name != NULL) free(part->name);
+            if (part->filename != NULL) free(part->filename);
+            if (part->contenttype != NULL) free(part->contenttype);
+            if (part->value != NULL) free(part->value);
+        }
+        free(job.parts);
+    }
+    if (job.found != NULL) {
+        for (i = 0; i < threads; i++) {
+            if (job.found[i] != NULL) free(job.found[i]);
+        }
+        free(job.found);
+    }
+    if (job.nfound != NULL) free(job.nfound);
+    munmap((void *)map, size);
+    close(fd);
+    _q_trace_stop(span);
+
+    return num;
+#endif
+}
+
 #ifndef _DOXYGEN_SKIP
 
-static int _parse_multipart(qentry_t *request)
+// call the pre-body hook, returns false if the body should not be read.
+static bool _prebody(qentry_t *request)
+{
+    size_t size;
+    void *data = request->get(request, "_Q_PREBODY", &size, false);
+    if (data == NULL || size != sizeof(bool (*)(qentry_t *, off_t,
+                                                const char *))) {
+        return true;
+    }
+
+    const char *content_length = getenv("CONTENT_LENGTH");
+    off_t length = (content_length != NULL) ? atoll(content_length) : 0;
+    if (length <= 0) return true;
+
+    bool (*hook)(qentry_t *, off_t, const char *);
+    memcpy(&hook, data, sizeof(hook));
+    const char *content_type = getenv("CONTENT_TYPE");
+    if (hook(request, length, (content_type != NULL) ? content_type : "")) {
+        return true;
+    }
+
+    INFO("Request body rejected. (length=%jd)", (intmax_t)length);
+    _q_metrics_add(_Q_M_LIMIT_REJECTIONS, 1);
+    if (qcgires_getcontenttype(request) == NULL) {
+        printf("Status: 403 Forbidden" CRLF);
+        qcgires_setcontenttype(request, "text/plain");
+        printf("Forbidden\n");
+    }
+    return false;
+}
+
+static int _parse_multipart(qentry_t *request, struct _parseopt *opt)
 {
 #ifdef _WIN32
     setmode(fileno(stdin), _O_BINARY);
@@ -369,7 +1095,8 @@ static int _parse_multipart(qentry_t *request)
     maxboundarylen += CONST_STRLEN("--");
     maxboundarylen += CONST_STRLEN("\r\n");
     if (maxboundarylen >= sizeof(boundary)) {
-        DEBUG("The boundary string is too long(Overflow Attack?). stopping process.");
+        WARN("The boundary string is too long(Overflow Attack?). stopping process.");
+        _q_metrics_add(_Q_M_LIMIT_REJECTIONS, 1);
         return amount;
     }
 
@@ -404,7 +1131,8 @@ static int _parse_multipart(qentry_t *request)
     // check boundary
     do {
         if (_q_fgets(buf, sizeof(buf), stdin) == NULL) {
-            DEBUG("Bbrowser sent a non-HTTP compliant message.");
+            WARN("Bbrowser sent a non-HTTP compliant message.");
+            _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
             return amount;
         }
         _q_strtrim(buf);
@@ -415,22 +1143,38 @@ static int _parse_multipart(qentry_t *request)
         // empty contents
         return amount;
     } else if (strcmp(buf, boundary) != 0) {
-        DEBUG("Invalid string format.");
+        WARN("Invalid string format.");
+        _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
         return amount;
     }
 
     // check file save mode
     bool upload_filesave = false; // false: into memory, true: into file
-    const char *upload_basepath = request->getstr(request, "_Q_UPLOAD_BASEPATH", false);
-    if (upload_basepath != NULL) upload_filesave = true;
+    struct _volumes volumes;
+    _upload_volumes(request, &volumes);
+    if (volumes.num > 0) upload_filesave = true;
+    qentry_t *upload_files = NULL;  // saved files to sync, name=path
+    if (upload_filesave == true
+        && request->getint(request, "_Q_UPLOAD_DURABLE") == 1) {
+        upload_files = qEntry();
+    }
+
+    // publish upload progress
+    const char *content_length = getenv("CONTENT_LENGTH");
+    int progress = _q_progress_begin((content_length != NULL) ?
+                                     atoll(content_length) : 0);
+    off_t received = strlen(buf) + CONST_STRLEN(CRLF);
+    bool failed = false;
 
     bool finish;
     for (finish = false; finish == false; amount++) {
         char *name = NULL, *value = NULL, *filename = NULL, *contenttype = NULL;
-        int valuelen = 0;
+        int valuelen = 0, level = 0;
+        off_t storedlen = 0;
 
         // parse header
         while (_q_fgets(buf, sizeof(buf), stdin)) {
+            received += strlen(buf);
             _q_strtrim(buf);
             if (!strcmp(buf, "")) break;
             else if (!strncasecmp(buf, "Content-Disposition: ", CONST_STRLEN("Content-Disposition: "))) {
@@ -473,29 +1217,71 @@ static int _parse_multipart(qentry_t *request)
 
         // check
         if (name == NULL) {
-            DEBUG("bug or invalid format.");
+            WARN("bug or invalid format.");
+            _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
             continue;
         }
 
+        PROBE1(part__begin, name);
+
         // get value
         if (filename != NULL && upload_filesave == true) {
             char *tp, *savename = strdup(filename);
             for (tp = savename; *tp != '\0'; tp++) {
                 if (*tp == ' ') *tp = '_'; // replace ' ' to '_'
             }
+            int vol = _upload_place(&volumes, name);
+            level = _upload_level(request, contenttype);
             value = _parse_multipart_value_into_disk(
-                        boundary, upload_basepath, savename, &valuelen, &finish);
+                        boundary, volumes.path[vol], savename, &valuelen,
+                        &finish, progress, received, level, &storedlen);
+            if (value != NULL && upload_files != NULL) {
+                upload_files->putstr(upload_files, value, name, false);
+            }
+            if (value != NULL && volumes.policy == Q_UPLOAD_FREESPACE) {
+                volumes.avail[vol] -= (volumes.avail[vol] > storedlen) ?
+                                      storedlen : volumes.avail[vol];
+            }
             free(savename);
 
             if (value != NULL) request->putstr(request, name, value, false);
             else request->putstr(request, name, "(parsing failure)", false);
         } else {
-            value = _parse_multipart_value_into_memory(boundary, &valuelen, &finish);
+            value = _parse_multipart_value_into_memory(boundary, &valuelen,
+                    &finish, progress, received);
+
+            // text fields in UTF-8
+            if (value != NULL && filename == NULL && opt->transcode == true) {
+                if (!strcmp(name, "_charset_")) _set_charset(opt, value);
+
+                size_t len = valuelen;
+                char *utf8 = _transcode(opt, value, &len);
+                if (utf8 != NULL) {
+                    free(value);
+                    value = utf8;
+                    valuelen = len;
+                }
+                utf8 = _transcode(opt, name, NULL);
+                if (utf8 != NULL) {
+                    free(name);
+                    name = utf8;
+                }
+            }
 
             if (value != NULL) request->put(request, name, value, valuelen+1, false);
             else request->putstr(request, name, "(parsing failure)", false);
         }
 
+        PROBE2(part__end, name, valuelen);
+        received += valuelen + CONST_STRLEN(CRLF) + strlen(boundary)
+                    + CONST_STRLEN(CRLF);
+        if (finish == true) received += CONST_STRLEN("--");
+        _q_progress_update(progress, received);
+        if (value == NULL) {
+            _q_metrics_add(_Q_M_PARSE_ERRORS, 1);
+            failed = true;
+        } else if (filename != NULL) _q_metrics_add(_Q_M_UPLOAD_BYTES, valuelen);
+
         // store additional information
         if (value != NULL && filename != NULL) {
             char ename[255+10+1];
@@ -516,6 +1302,14 @@ static int _parse_multipart(qentry_t *request)
                 snprintf(ename, sizeof(ename), "%s.savepath", name);
                 request->putstr(request, ename, value, false);
             }
+
+            // compressed, 'NAME.encoding' and 'NAME.storedlength'
+            if (level > 0) {
+                snprintf(ename, sizeof(ename), "%s.encoding", name);
+                request->putstr(request, ename, "gzip", false);
+                snprintf(ename, sizeof(ename), "%s.storedlength", name);
+                request->putint(request, ename, storedlen, false);
+            }
         }
 
         // free resources
@@ -525,12 +1319,23 @@ static int _parse_multipart(qentry_t *request)
         if (contenttype != NULL) free(contenttype);
     }
 
+    // group commit of uploaded files
+    if (upload_files != NULL) {
+        if (upload_files->num > 0 && _upload_sync(request, upload_files) > 0) {
+            failed = true;
+        }
+        upload_files->free(upload_files);
+    }
+
+    _q_progress_end(progress, !failed);
+    _q_metrics_add(_Q_M_BYTES_READ, received);
+
     return amount;
 }
 
 #define _Q_MULTIPART_CHUNK_SIZE     (16 * 1024)
 static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
-        bool *finish)
+        bool *finish, int progress, off_t received)
 {
     char boundaryEOF[256], rnboundaryEOF[256];
     char boundaryrn[256], rnboundaryrn[256];
@@ -554,7 +1359,7 @@ static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
         if (c_count == 0) {
             value = (char *)malloc(sizeof(char) * mallocsize);
             if (value == NULL) {
-                DEBUG("Memory allocation fail.");
+                ERROR("Memory allocation fail.");
                 *finish = true;
                 return NULL;
             }
@@ -566,7 +1371,7 @@ static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
             // Here, we do not use realloc(). Because sometimes it is unstable.
             valuetmp = (char *)malloc(sizeof(char) * mallocsize);
             if (valuetmp == NULL) {
-                DEBUG("Memory allocation fail.");
+                ERROR("Memory allocation fail.");
                 free(value);
                 *finish = true;
                 return NULL;
@@ -576,6 +1381,9 @@ static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
             value = valuetmp;
         }
         value[c_count++] = (char)c;
+        if ((c_count % _Q_MULTIPART_CHUNK_SIZE) == 0) {
+            _q_progress_update(progress, received + c_count);
+        }
 
         // check end
         if ((c == '\n') || (c == '-')) {
@@ -617,7 +1425,7 @@ static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
     }
 
     if (c == EOF) {
-        DEBUG("Broken stream.");
+        WARN("Broken stream.");
         if (value != NULL) free(value);
         *finish = true;
         return NULL;
@@ -628,7 +1436,8 @@ static char *_parse_multipart_value_into_memory(char *boundary, int *valuelen,
 }
 
 static char *_parse_multipart_value_into_disk(const char *boundary,
-        const char *savedir, const char *filename, int *filelen, bool *finish)
+        const char *savedir, const char *filename, int *filelen, bool *finish,
+        int progress, off_t received, int level, off_t *storedlen)
 {
     char boundaryEOF[256], rnboundaryEOF[256];
     char boundaryrn[256], rnboundaryrn[256];
@@ -654,13 +1463,23 @@ static char *_parse_multipart_value_into_disk(const char *boundary,
 
     int upload_fd = mkstemp(upload_path);
     if (upload_fd < 0) {
-        DEBUG("Can't open file %s", upload_path);
+        ERROR("Can't open file %s", upload_path);
         *finish = true;
         return NULL;
     }
 
     // change permission
     fchmod(upload_fd, DEF_FILE_MODE);
+    PROBE1(upload__create, upload_path);
+
+    struct _zfile zf;
+    if (_zfile_open(&zf, upload_fd, level) == false) {
+        ERROR("Can't initialize compression.");
+        close(upload_fd);
+        _q_unlink(upload_path);
+        *finish = true;
+        return NULL;
+    }
 
     // read stream
     bool ioerror = false;
@@ -670,14 +1489,13 @@ static char *_parse_multipart_value_into_disk(const char *boundary,
             // save
             ssize_t leftsize = boundarylen + 8;
             ssize_t savesize = bufc - leftsize;
-            ssize_t saved = write(upload_fd, buffer, savesize);
-            if (saved <= 0) {
-                ioerror = true; 
+            if (_zfile_write(&zf, buffer, savesize) == false) {
+                ioerror = true;
                 break;
             }
-            leftsize = bufc - saved;
-            memcpy(buffer, buffer+saved, leftsize);
+            memcpy(buffer, buffer+savesize, leftsize);
             bufc = leftsize;
+            _q_progress_update(progress, received + upload_length);
         }
         buffer[bufc++] = (char)c;
         upload_length++;
@@ -724,25 +1542,24 @@ static char *_parse_multipart_value_into_disk(const char *boundary,
     }
 
     // save rest
-    while (bufc > 0) {
-        ssize_t saved = write(upload_fd, buffer, bufc);
-        if (saved <= 0) {
-            ioerror = true;
-            break;
-        }
-        bufc -= saved;
+    if (ioerror == false && bufc > 0
+        && _zfile_write(&zf, buffer, bufc) == false) {
+        ioerror = true;
     }
+    if (_zfile_close(&zf) == false) ioerror = true;
     close(upload_fd);
+    PROBE2(upload__close, upload_path, upload_length);
 
     // error occured
     if (c == EOF || ioerror == true) {
-        DEBUG("I/O error. (errno=%d)", (ioerror == true) ? errno : 0);
+        ERROR("I/O error. (errno=%d)", (ioerror == true) ? errno : 0);
         *finish = true;
         return NULL;
     }
 
     // succeed
     *filelen = upload_length;
+    *storedlen = zf.stored;
     return strdup(upload_path);
 }
 
@@ -785,8 +1602,473 @@ static int _upload_clear_base(const char *upload_basepath, int upload_clearold)
 #endif
 }
 
+// collect upload volumes, the pointers are valid while the options exist.
+static void _upload_volumes(qentry_t *request, struct _volumes *vol)
+{
+    memset((void *)vol, 0, sizeof(struct _volumes));
+    vol->policy = request->getint(request, "_Q_UPLOAD_PLACEMENT");
+
+    qentobj_t obj;
+    memset((void *)&obj, 0, sizeof(obj));
+    while (vol->num < _Q_UPLOAD_MAXVOLUMES
+           && request->getnext(request, &obj, "_Q_UPLOAD_BASEPATH", false)) {
+        vol->path[vol->num] = (const char *)obj.data;
+#ifndef _WIN32
+        if (vol->policy == Q_UPLOAD_FREESPACE) {
+            struct statvfs fs;
+            if (statvfs(vol->path[vol->num], &fs) == 0) {
+                vol->avail[vol->num] = (unsigned long long)fs.f_bavail
+                                       * fs.f_frsize;
+            }
+        }
+#endif
+        vol->num++;
+    }
+}
+
+// choose a volume for a file part.
+static int _upload_place(struct _volumes *vol, const char *name)
+{
+    static unsigned int rotate = 0;
+
+    if (vol->num <= 1) return 0;
+
+    switch (vol->policy) {
+        case Q_UPLOAD_FREESPACE : {
+            int i, best = 0;
+            for (i = 1; i < vol->num; i++) {
+                if (vol->avail[i] > vol->avail[best]) best = i;
+            }
+            return best;
+        }
+        case Q_UPLOAD_HASH : {
+            const char *key = getenv("REMOTE_USER");
+            if (key == NULL || *key == '\0') key = name;
+            return qentry_hash(key, strlen(key)) % vol->num;
+        }
+        default : {
+            // start from the pid to spread single-request processes.
+            if (rotate == 0) rotate = (unsigned int)getpid();
+            return rotate++ % vol->num;
+        }
+    }
+}
+
+// compression level of a part by the most specific qcgireq_setcompress() rule.
+static int _upload_level(qentry_t *request, const char *contenttype)
+{
+    if (contenttype == NULL) contenttype = "";
+    size_t typelen = strcspn(contenttype, "/;");
+
+    int level = 0, rank = 0;
+    qentobj_t obj;
+    memset((void *)&obj, 0, sizeof(obj));
+    while (request->getnext(request, &obj, "_Q_UPLOAD_COMPRESS", false)) {
+        const char *rule = (const char *)obj.data;
+        const char *type = strchr(rule, ' ');
+        if (type == NULL) continue;
+        type++;
+
+        int match = 0;
+        size_t len = strlen(type);
+        if (!strcmp(type, "*")) {
+            match = 1;
+        } else if (len >= 2 && !strcmp(type + len - 2, "/*")) {
+            if (len - 2 == typelen && !strncasecmp(type, contenttype, typelen)) {
+                match = 2;
+            }
+        } else if (!strncasecmp(type, contenttype, len)
+                   && (contenttype[len] == '\0' || contenttype[len] == ';'
+                       || contenttype[len] == ' ')) {
+            match = 3;
+        }
+        if (match >= rank && match > 0) {
+            rank = match;
+            level = atoi(rule);
+        }
+    }
+
+    return level;
+}
+
+static bool _zfile_open(struct _zfile *zf, int fd, int level)
+{
+    memset((void *)zf, 0, sizeof(struct _zfile));
+    zf->fd = fd;
+    if (level <= 0) return true;
+
+    // windowBits + 16 for the gzip header and trailer.
+    if (deflateInit2(&zf->zs, level, Z_DEFLATED, MAX_WBITS + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    zf->deflate = true;
+    return true;
+}
+
+static bool _zfile_put(struct _zfile *zf, const void *buf, size_t size)
+{
+    const char *cp = (const char *)buf;
+    while (size > 0) {
+        ssize_t saved = write(zf->fd, cp, size);
+        if (saved <= 0) return false;
+        cp += saved;
+        size -= saved;
+        zf->stored += saved;
+    }
+    return true;
+}
+
+static bool _zfile_deflate(struct _zfile *zf, int flush)
+{
+    unsigned char out[_Q_MULTIPART_CHUNK_SIZE];
+    int ret;
+    do {
+        zf->zs.next_out = out;
+        zf->zs.avail_out = sizeof(out);
+        ret = deflate(&zf->zs, flush);
+        if (ret == Z_STREAM_ERROR) return false;
+        if (_zfile_put(zf, out, sizeof(out) - zf->zs.avail_out) == false) {
+            return false;
+        }
+    } while (zf->zs.avail_out == 0 && ret != Z_STREAM_END);
+    return true;
+}
+
+static bool _zfile_write(struct _zfile *zf, const void *buf, size_t size)
+{
+    if (zf->deflate == false) return _zfile_put(zf, buf, size);
+
+    zf->zs.next_in = (Bytef *)buf;
+    zf->zs.avail_in = size;
+    return _zfile_deflate(zf, Z_NO_FLUSH);
+}
+
+static bool _zfile_close(struct _zfile *zf)
+{
+    if (zf->deflate == false) return true;
+
+    zf->zs.next_in = NULL;
+    zf->zs.avail_in = 0;
+    bool ok = _zfile_deflate(zf, Z_FINISH);
+    deflateEnd(&zf->zs);
+    zf->deflate = false;
+    return ok;
+}
+
+#define _Q_DURABLE_THREADS  (8)     /* fdatasync() threads */
+#define _Q_DURABLE_SYNCFS   (32)    /* use syncfs() from this many files */
+struct _syncjob {
+    qentobj_t **files;
+    bool *done;
+    int num;
+    int next;
+};
+
+static void *_upload_syncer(void *arg)
+{
+    struct _syncjob *job = (struct _syncjob *)arg;
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+           < job->num) {
+        if (job->done[i] == true) continue;
+        int fd = open(job->files[i]->name, O_RDONLY);
+        if (fd < 0) continue;
+        if (fdatasync(fd) == 0) job->done[i] = true;
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Sync the files and their directories.
+ *
+ * @return  number of files failed to sync.
+ */
+static int _upload_sync(qentry_t *request, qentry_t *files)
+{
+    int num = files->num;
+    qentobj_t **list = (qentobj_t **)malloc(sizeof(qentobj_t *) * num);
+    bool *done = (bool *)calloc(num, sizeof(bool));
+    if (list == NULL || done == NULL) {
+        if (list != NULL) free(list);
+        if (done != NULL) free(done);
+        return num;
+    }
+
+    int i, j;
+    qentobj_t *obj;
+    for (i = 0, obj = files->first; obj != NULL; obj = obj->next) {
+        list[i++] = obj;
+    }
+
+    // directories, and syncfs() for the volumes which have many files.
+    qentry_t *dirs = qEntry();
+    for (i = 0; i < num && dirs != NULL; i++) {
+        const char *slash = strrchr(list[i]->name, '/');
+        if (slash == NULL) continue;
+        char *dir = strndup(list[i]->name, slash - list[i]->name);
+        if (dir == NULL) continue;
+        if (dirs->get(dirs, dir, NULL, false) == NULL) {
+            int count = 0;
+            for (j = i; j < num; j++) {
+                if (!strncmp(list[j]->name, dir, slash - list[i]->name)
+                    && list[j]->name[slash - list[i]->name] == '/') count++;
+            }
+            dirs->putint(dirs, dir, count, false);
+        }
+        free(dir);
+    }
+
+#ifdef __linux__
+    for (obj = (dirs != NULL) ? dirs->first : NULL; obj; obj = obj->next) {
+        if (atoi((char *)obj->data) < _Q_DURABLE_SYNCFS) continue;
+        int fd = open(obj->name, O_RDONLY);
+        if (fd < 0) continue;
+        if (syncfs(fd) == 0) {
+            size_t len = strlen(obj->name);
+            for (i = 0; i < num; i++) {
+                if (!strncmp(list[i]->name, obj->name, len)
+                    && list[i]->name[len] == '/') done[i] = true;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    // fdatasync() fan-out, the calling thread works too.
+    struct _syncjob job = { list, done, num, 0 };
+    pthread_t threads[_Q_DURABLE_THREADS - 1];
+    int nthreads = ((num < _Q_DURABLE_THREADS) ? num : _Q_DURABLE_THREADS) - 1;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, _upload_syncer, &job) != 0) break;
+    }
+    nthreads = i;
+    _upload_syncer(&job);
+    for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+    for (obj = (dirs != NULL) ? dirs->first : NULL; obj; obj = obj->next) {
+        int fd = open(obj->name, O_RDONLY);
+        if (fd < 0) continue;
+        if (fsync(fd) != 0) {
+            size_t len = strlen(obj->name);
+            for (i = 0; i < num; i++) {
+                if (!strncmp(list[i]->name, obj->name, len)
+                    && list[i]->name[len] == '/') done[i] = false;
+            }
+        }
+        close(fd);
+    }
+    if (dirs != NULL) dirs->free(dirs);
+
+    // mark failed files, the values which are the saved path.
+    int failed = 0;
+    for (i = 0; i < num; i++) {
+        if (done[i] == true) continue;
+        ERROR("Can't sync file %s", list[i]->name);
+        failed++;
+
+        // NAME and NAME.savepath
+        size_t size = strlen(list[i]->name) + 1;
+        for (obj = request->first; obj != NULL; obj = obj->next) {
+            if (obj->size != size || memcmp(obj->data, list[i]->name, size)) {
+                continue;
+            }
+            char *value = strdup("(parsing failure)");
+            if (value == NULL) break;
+            free(obj->data);
+            obj->data = value;
+            obj->size = strlen(value) + 1;
+        }
+        _q_unlink(list[i]->name);
+    }
+
+    free(list);
+    free(done);
+    return failed;
+}
+
+// run func on threads, the calling thread works too.
+static void _spool_run(void *(*func)(void *), struct _spooljob *job,
+                       int threads)
+{
+    pthread_t tids[_Q_SPOOL_MAXTHREADS];
+    int i;
+    for (i = 0; i < threads - 1; i++) {
+        if (pthread_create(&tids[i], NULL, func, job) != 0) break;
+    }
+    int created = i;
+    func(job);
+    for (i = 0; i < created; i++) pthread_join(tids[i], NULL);
+}
+
+// find delimiters starting in a range, ranges are taken by the index.
+static void *_spool_scan(void *arg)
+{
+    struct _spooljob *job = (struct _spooljob *)arg;
+
+    int r;
+    while ((r = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+           < job->nranges) {
+        size_t lo = job->size / job->nranges * r;
+        size_t hi = (r == job->nranges - 1) ? job->size
+                    : job->size / job->nranges * (r + 1);
+
+        // a delimiter starting in this range may end in the next one.
+        size_t scanend = hi + job->delimlen - 1;
+        if (scanend > job->size) scanend = job->size;
+
+        size_t *found = NULL;
+        int num = 0, max = 0;
+        const char *cp = job->map + lo;
+        const char *end = job->map + scanend;
+        while (cp < end) {
+            cp = memmem(cp, end - cp, job->delim, job->delimlen);
+            if (cp == NULL || cp >= job->map + hi) break;
+            if (num == max) {
+                max = (max == 0) ? 64 : max * 2;
+                size_t *newfound = (size_t *)realloc(found,
+                                                     sizeof(size_t) * max);
+                if (newfound == NULL) {
+                    num = -1;
+                    break;
+                }
+                found = newfound;
+            }
+            found[num++] = cp - job->map;
+            cp += job->delimlen;
+        }
+        job->found[r] = found;
+        job->nfound[r] = num;
+    }
+
+    return NULL;
+}
+
+// copy parts into memory or upload volumes, parts are taken by the index.
+static void *_spool_store(void *arg)
+{
+    struct _spooljob *job = (struct _spooljob *)arg;
+
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+           < job->nparts) {
+        struct _spoolpart *part = &job->parts[i];
+        if (part->vol < 0) {
+            part->value = (char *)malloc(part->len + 1);
+            if (part->value == NULL) continue;
+            memcpy(part->value, part->data, part->len);
+            part->value[part->len] = '\0';
+            part->ok = true;
+            continue;
+        }
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/q_XXXXXX",
+                 job->volumes->path[part->vol]);
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            ERROR("Can't open file %s", path);
+            continue;
+        }
+        fchmod(fd, DEF_FILE_MODE);
+        PROBE1(upload__create, path);
+
+        size_t left = part->len;
+        part->stored = part->len;
+        if (part->level > 0) {
+            // compress from the mapping, no copy offload.
+            struct _zfile zf;
+            if (_zfile_open(&zf, fd, part->level) == true) {
+                if (_zfile_write(&zf, part->data, part->len) == true) left = 0;
+                if (_zfile_close(&zf) == false) left = part->len;
+                part->stored = zf.stored;
+            }
+        }
+
+        loff_t off = part->data - job->map;
+        while (part->level == 0 && left > 0) {
+#ifdef __linux__
+            ssize_t n = copy_file_range(job->fd, &off, fd, NULL, left, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV
+                          || errno == EINVAL)) {
+                n = write(fd, job->map + off, left);
+                if (n > 0) off += n;
+            }
+#else
+            ssize_t n = write(fd, job->map + off, left);
+            if (n > 0) off += n;
+#endif
+            if (n <= 0) break;
+            left -= n;
+        }
+        close(fd);
+        PROBE2(upload__close, path, (int)(part->len - left));
+
+        if (left > 0) {
+            ERROR("I/O error. (errno=%d)", errno);
+            _q_unlink(path);
+            continue;
+        }
+        part->value = strdup(path);
+        part->ok = (part->value != NULL);
+    }
+
+    return NULL;
+}
+
+// parse part headers up to the end, the data follows the blank line.
+static bool _spool_header(struct _spoolpart *part, const char *end)
+{
+    const char *cp = part->head;
+    while (cp < end) {
+        const char *eol = memmem(cp, end - cp, CRLF, 2);
+        if (eol == NULL) return false;
+        if (eol == cp) {
+            part->data = eol + 2;
+            return (part->name != NULL);
+        }
+
+        size_t len = eol - cp;
+        if (!strncasecmp(cp, "Content-Disposition:",
+                         CONST_STRLEN("Content-Disposition:"))) {
+            char *line = strndup(cp, len);
+            if (line == NULL) return false;
+            char *np = strstr(line, " name=\"");
+            if (np == NULL) np = strstr(line, ";name=\"");
+            if (np != NULL && part->name == NULL) {
+                np += CONST_STRLEN(" name=\"");
+                part->name = strndup(np, strcspn(np, "\""));
+            }
+            char *fp = strstr(line, "; filename=\"");
+            if (fp != NULL && part->filename == NULL) {
+                fp += CONST_STRLEN("; filename=\"");
+                fp[strcspn(fp, "\"")] = '\0';
+                // remove directory from path
+                char *bs = strrchr(fp, '\\');
+                if (bs != NULL) fp = bs + 1;
+                _q_strtrim(fp);
+                if (*fp != '\0') part->filename = strdup(fp);
+            }
+            free(line);
+        } else if (!strncasecmp(cp, "Content-Type:",
+                                CONST_STRLEN("Content-Type:"))) {
+            if (part->contenttype == NULL) {
+                part->contenttype = strndup(cp + CONST_STRLEN("Content-Type:"),
+                                            len - CONST_STRLEN("Content-Type:"));
+                if (part->contenttype != NULL) _q_strtrim(part->contenttype);
+            }
+        }
+        cp = eol + 2;
+    }
+    return false;
+}
+
 static qentry_t *_parse_query(qentry_t *request, const char *query,
-                              char equalchar, char sepchar, int *count)
+                              char equalchar, char sepchar,
+                              struct _parseopt *opt, int *count)
 {
     if (request == NULL) {
         request = qEntry();
@@ -797,15 +2079,14 @@ static qentry_t *_parse_query(qentry_t *request, const char *query,
     int cnt = 0;
 
     if (query != NULL) newquery = strdup(query);
-    while (newquery && *newquery) {
-        char *value = _q_makeword(newquery, sepchar);
-        char *name = _q_strtrim(_q_makeword(value, equalchar));
-        _q_urldecode(name);
-        _q_urldecode(value);
-
-        if (request->putstr(request, name, value, false) == true) cnt++;
-        free(name);
-        free(value);
+    char *pair = newquery;
+    while (pair != NULL && *pair != '\0') {
+        char *next = strchr(pair, sepchar);
+        if (next != NULL) *next++ = '\0';
+        else next = pair + strlen(pair);
+
+        if (_parse_pair(request, pair, equalchar, opt) == true) cnt++;
+        pair = next;
     }
     if (newquery != NULL) free(newquery);
     if (count != NULL) *count = cnt;
@@ -813,4 +2094,234 @@ static qentry_t *_parse_query(qentry_t *request, const char *query,
     return request;
 }
 
+/*
+ * Parse name=value pairs reading from the stream in fixed-size chunks.
+ * Each pair is stored as soon as its separator is read, so the memory used
+ * is proportional to the largest pair rather than the whole body.
+ *
+ * @return  number of bytes read.
+ */
+#define _Q_QUERY_CHUNK_SIZE     (16 * 1024)
+static size_t _parse_query_stream(qentry_t *request, FILE *fp, size_t length,
+                                  char equalchar, char sepchar,
+                                  struct _parseopt *opt, int *count)
+{
+    char chunk[_Q_QUERY_CHUNK_SIZE];
+    char *pair = NULL;
+    size_t pairlen = 0, pairsize = 0;
+    size_t total = 0;
+    int cnt = 0;
+
+    while (total < length) {
+        size_t want = length - total;
+        if (want > sizeof(chunk)) want = sizeof(chunk);
+        size_t nread = fread(chunk, 1, want, fp);
+        if (nread == 0) break;
+        total += nread;
+
+        char *cp = chunk, *end = chunk + nread;
+        while (cp < end) {
+            char *sep = memchr(cp, sepchar, end - cp);
+            size_t len = ((sep != NULL) ? sep : end) - cp;
+
+            // carry partial pair over chunks
+            if (pairlen + len + 1 > pairsize) {
+                size_t newsize = (pairsize > 0) ? pairsize : 256;
+                while (newsize < pairlen + len + 1) newsize *= 2;
+                char *newpair = (char *)realloc(pair, newsize);
+                if (newpair == NULL) {
+                    ERROR("Memory allocation fail.");
+                    free(pair);
+                    if (count != NULL) *count = cnt;
+                    return total;
+                }
+                pair = newpair;
+                pairsize = newsize;
+            }
+            memcpy(pair + pairlen, cp, len);
+            pairlen += len;
+            if (sep == NULL) break;
+
+            pair[pairlen] = '\0';
+            if (_parse_pair(request, pair, equalchar, opt) == true) cnt++;
+            pairlen = 0;
+            cp = sep + 1;
+        }
+    }
+
+    if (pairlen > 0) {
+        pair[pairlen] = '\0';
+        if (_parse_pair(request, pair, equalchar, opt) == true) cnt++;
+    }
+    if (pair != NULL) free(pair);
+    if (count != NULL) *count = cnt;
+
+    return total;
+}
+
+// split name and value in place, decode and store them.
+static bool _parse_pair(qentry_t *request, char *pair, char equalchar,
+                        struct _parseopt *opt)
+{
+    char *value = strchr(pair, equalchar);
+    if (value != NULL) *value++ = '\0';
+    else value = pair + strlen(pair);
+
+    char *name = _q_strtrim(pair);
+    _q_urldecode(name);
+    _q_urldecode(value);
+
+    // convert to UTF-8, only when there are non-ASCII bytes.
+    char *utf8name = NULL, *utf8value = NULL;
+    if (opt != NULL && opt->transcode == true) {
+        if (!strcmp(name, "_charset_")) _set_charset(opt, value);
+        utf8name = _transcode(opt, name, NULL);
+        utf8value = _transcode(opt, value, NULL);
+        if (utf8name != NULL) name = utf8name;
+        if (utf8value != NULL) value = utf8value;
+    }
+
+    bool ret;
+    if (opt != NULL && opt->bracket == true && strchr(name, '[') != NULL) {
+        ret = _q_put_bracket(request, name, value, strlen(value) + 1);
+    } else {
+        ret = request->putstr(request, name, value, false);
+    }
+
+    if (utf8name != NULL) free(utf8name);
+    if (utf8value != NULL) free(utf8value);
+    return ret;
+}
+
+static void _parseopt_init(qentry_t *request, struct _parseopt *opt)
+{
+    opt->bracket = (request->getint(request, "_Q_BRACKET") == 1);
+    opt->cd = (iconv_t)-1;
+    const char *charset = request->getstr(request, "_Q_CHARSET", false);
+    opt->transcode = (charset != NULL);
+    if (opt->transcode == true && *charset != '\0') {
+        _set_charset(opt, charset);
+    }
+}
+
+// switch the source charset of following values.
+static void _set_charset(struct _parseopt *opt, const char *charset)
+{
+    if (opt->cd != (iconv_t)-1) {
+        iconv_close(opt->cd);
+        opt->cd = (iconv_t)-1;
+    }
+
+    if (*charset == '\0' || !strcasecmp(charset, "UTF-8")
+        || !strcasecmp(charset, "UTF8") || !strcasecmp(charset, "US-ASCII")) {
+        return;
+    }
+
+    opt->cd = iconv_open("UTF-8", charset);
+    if (opt->cd == (iconv_t)-1) WARN("Unsupported charset %s.", charset);
+}
+
+// "charset=" parameter of Content-Type, malloced.
+static char *_get_charset(const char *content_type)
+{
+    const char *cp;
+    for (cp = content_type; (cp = strchr(cp, ';')) != NULL; ) {
+        cp++;
+        cp += strspn(cp, " \t");
+        if (strncasecmp(cp, "charset=", CONST_STRLEN("charset="))) continue;
+
+        cp += CONST_STRLEN("charset=");
+        char *charset = strndup(cp, strcspn(cp, "; \t"));
+        if (charset != NULL) _q_strunchar(charset, '"', '"');
+        return charset;
+    }
+
+    return NULL;
+}
+
+/*
+ * Convert to UTF-8. The leading ASCII run is copied as it is and the rest
+ * is passed to iconv. If len is NULL, str is a string.
+ *
+ * @return  malloced UTF-8 string, or NULL if no conversion is needed.
+ */
+static char *_transcode(struct _parseopt *opt, const char *str, size_t *len)
+{
+    if (opt->cd == (iconv_t)-1) return NULL;
+
+    size_t size = (len != NULL) ? *len : strlen(str);
+    size_t ascii;
+    for (ascii = 0; ascii < size && (unsigned char)str[ascii] < 0x80; ascii++);
+    if (ascii == size) return NULL;
+
+    // a character grows to 3 bytes in UTF-8 at most, so is U+FFFD.
+    char *utf8 = (char *)malloc(size * 3 + 1);
+    if (utf8 == NULL) return NULL;
+    memcpy(utf8, str, ascii);
+
+    char *in = (char *)str + ascii, *out = utf8 + ascii;
+    size_t inleft = size - ascii, outleft = size * 3 - ascii;
+    iconv(opt->cd, NULL, NULL, NULL, NULL);
+    while (inleft > 0) {
+        if (iconv(opt->cd, &in, &inleft, &out, &outleft) != (size_t)-1) break;
+        if (errno == E2BIG || outleft < 3) break;
+
+        // invalid or incomplete sequence
+        memcpy(out, "\xEF\xBF\xBD", 3);
+        out += 3;
+        outleft -= 3;
+        in++;
+        inleft--;
+    }
+    *out = '\0';
+
+    if (len != NULL) *len = out - utf8;
+    return utf8;
+}
+
+// store a[b][c] into nested containers, "[]" appends to an array.
+#define _Q_BRACKET_MAXDEPTH     (32)
+bool _q_put_bracket(qentry_t *request, char *name, const void *value,
+                    size_t size)
+{
+    // check the format first, name must not be changed if it's invalid.
+    char *open = strchr(name, '[');
+    char *cp = open;
+    int depth;
+    for (depth = 0; *cp == '['; depth++) {
+        size_t len = strcspn(cp + 1, "[]");
+        if (cp[1 + len] != ']') break;
+        cp += 1 + len + 1;
+    }
+    if (open == name || *cp != '\0' || depth > _Q_BRACKET_MAXDEPTH) {
+        return request->put(request, name, value, size, false);
+    }
+
+    qentry_t *entry = request;
+    char *key = name;
+    char index[20+1];
+    *open = '\0';
+    for (cp = open + 1; ; cp++) {
+        char *close = strchr(cp, ']');
+        *close = '\0';
+
+        if (*key == '\0') {
+            snprintf(index, sizeof(index), "%d", entry->num);
+            key = index;
+        }
+        entry = entry->getchild(entry, key, true);
+        if (entry == NULL) return false;
+
+        key = cp;
+        cp = close + 1;
+        if (*cp == '\0') break;
+    }
+
+    if (*key == '\0') {
+        snprintf(index, sizeof(index), "%d", entry->num);
+        key = index;
+    }
+    return entry->put(entry, key, value, size, false);
+}
+
 #endif /* _DOXYGEN_SKIP */
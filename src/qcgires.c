@@ -44,9 +44,15 @@
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
+#include <strings.h>
+#include <zlib.h>
 #include "qdecoder.h"
 #include "internal.h"
 
+#ifndef _DOXYGEN_SKIP
+static bool _accept_gzip(void);
+#endif
+
 /**
  * Set cookie
  *
@@ -77,7 +83,7 @@ bool qcgires_setcookie(qentry_t *request, const char *name, const char *value,
                        int expire, const char *path, const char *domain, bool secure)
 {
     if (qcgires_getcontenttype(request) != NULL) {
-        DEBUG("Should be called before qcgires_setcontenttype().");
+        WARN("Should be called before qcgires_setcontenttype().");
         return false;
     }
 
@@ -99,7 +105,7 @@ bool qcgires_setcookie(qentry_t *request, const char *name, const char *value,
 
     if (path != NULL) {
         if (path[0] != '/') {
-            DEBUG("Path string(%s) must start with '/' character.", path);
+            WARN("Path string(%s) must start with '/' character.", path);
             return false;
         }
         strcat(cookie, "; path=");
@@ -108,7 +114,7 @@ bool qcgires_setcookie(qentry_t *request, const char *name, const char *value,
 
     if (domain != NULL) {
         if (strstr(domain, "/") != NULL || strstr(domain, ".") == NULL) {
-            DEBUG("Invalid domain name(%s).", domain);
+            WARN("Invalid domain name(%s).", domain);
             return false;
         }
         strcat(cookie, "; domain=");
@@ -170,6 +176,7 @@ bool qcgires_setcontenttype(qentry_t *request, const char *mimetype)
     }
 
     printf("Content-Type: %s" CRLF CRLF, mimetype);
+    _q_trace_response();
 
     if (request != NULL) {
         request->putstr(request, "_Q_CONTENTTYPE", mimetype, true);
@@ -210,7 +217,7 @@ const char *qcgires_getcontenttype(qentry_t *request)
 bool qcgires_redirect(qentry_t *request, const char *uri)
 {
     if (qcgires_getcontenttype(request) != NULL) {
-        DEBUG("Should be called before qcgires_setcontenttype().");
+        WARN("Should be called before qcgires_setcontenttype().");
         return false;
     }
 
@@ -239,13 +246,13 @@ int qcgires_download(qentry_t *request, const char *filepath,
                      const char *mimetype)
 {
     if (qcgires_getcontenttype(request) != NULL) {
-        DEBUG("Should be called before qcgires_setcontenttype().");
+        WARN("Should be called before qcgires_setcontenttype().");
         return -1;
     }
 
     FILE *fp;
     if (filepath == NULL || (fp = fopen(filepath, "r")) == NULL) {
-        DEBUG("Can't open file.");
+        WARN("Can't open file.");
         return -1;
     }
 
@@ -271,7 +278,125 @@ int qcgires_download(qentry_t *request, const char *filepath,
 
     fflush(stdout);
 
+    PROBE2(download__start, filepath, filesize);
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("download");
     int sent = _q_iosend(stdout, fp, filesize);
+    if (sent > 0) _q_metrics_add(_Q_M_DOWNLOAD_BYTES, sent);
+    _q_metrics_observe(_Q_H_DOWNLOAD, _q_clock_usec() - started);
+    _q_trace_stop(span);
+    PROBE2(download__end, filepath, sent);
+
+    fclose(fp);
+    return sent;
+}
+
+/**
+ * Send a gzip compressed file, like the uploads stored by
+ * qcgireq_setcompress(), in accordance with the client's Accept-Encoding.
+ *
+ * @param request   a pointer of request structure
+ * @param filepath  gzip file to send
+ * @param mimetype  mimetype of the original data. NULL can be used for
+ *                  "application/octet-stream".
+ *
+ * @return      the number of bytes sent. otherwise(file not found) returns -1.
+ *
+ * @note
+ * Do not call qcgires_getcontenttype() before.
+ * If the client accepts gzip, the stored bytes are sent as they are with
+ * "Content-Encoding: gzip". Otherwise the file is decompressed while it's
+ * being sent, and Content-Length is taken from the gzip trailer. The trailer
+ * has the size modulo 4GB, so Content-Length is sent only for files small
+ * enough not to be inflated beyond that.
+ *
+ * @code
+ *   const char *path = req->getstr(req, "binary.savepath", false);
+ *   const char *encoding = req->getstr(req, "binary.encoding", false);
+ *   if (encoding != NULL && !strcmp(encoding, "gzip")) {
+ *     qcgires_downloadgzip(req, path, "text/csv");
+ *   } else {
+ *     qcgires_download(req, path, "text/csv");
+ *   }
+ * @endcode
+ */
+int qcgires_downloadgzip(qentry_t *request, const char *filepath,
+                         const char *mimetype)
+{
+    if (qcgires_getcontenttype(request) != NULL) {
+        WARN("Should be called before qcgires_setcontenttype().");
+        return -1;
+    }
+
+    FILE *fp;
+    if (filepath == NULL || (fp = fopen(filepath, "r")) == NULL) {
+        WARN("Can't open file.");
+        return -1;
+    }
+
+    const char *mime;
+    if (mimetype == NULL) mime = "application/octet-stream";
+    else mime = mimetype;
+
+    char *disposition;
+    if (!strcmp(mime, "application/octet-stream")) disposition = "attachment";
+    else disposition = "inline";
+
+    char *filename = _q_filename(filepath);
+    off_t filesize = _q_filesize(filepath);
+    bool passthru = _accept_gzip();
+
+    // ISIZE, the original size modulo 2^32 from the gzip trailer. deflate
+    // inflates at most 1032 times, smaller files can't have wrapped it.
+    off_t origsize = -1;
+    unsigned char trailer[4];
+    if (passthru == false && filesize >= 18
+        && filesize <= (((off_t)1 << 32) - 1) / 1032
+        && fseeko(fp, filesize - 4, SEEK_SET) == 0
+        && fread(trailer, 1, sizeof(trailer), fp) == sizeof(trailer)) {
+        origsize = (off_t)trailer[0] | ((off_t)trailer[1] << 8)
+                   | ((off_t)trailer[2] << 16) | ((off_t)trailer[3] << 24);
+    }
+    rewind(fp);
+
+    printf("Content-Disposition: %s;filename=\"%s\"" CRLF, disposition, filename);
+    printf("Content-Transfer-Encoding: binary" CRLF);
+    printf("Vary: Accept-Encoding" CRLF);
+    if (passthru == true) {
+        printf("Content-Encoding: gzip" CRLF);
+        printf("Content-Length: %lu" CRLF, (unsigned long)filesize);
+    } else if (origsize >= 0) {
+        printf("Content-Length: %lu" CRLF, (unsigned long)origsize);
+    }
+    printf("Connection: close" CRLF);
+    qcgires_setcontenttype(request, mime);
+
+    free(filename);
+
+    fflush(stdout);
+
+    PROBE2(download__start, filepath, filesize);
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("download");
+    int sent = -1;
+    if (passthru == true) {
+        sent = _q_iosend(stdout, fp, filesize);
+    } else {
+        gzFile gz = gzdopen(dup(fileno(fp)), "rb");
+        if (gz != NULL) {
+            char buf[1024 * 16];
+            int n;
+            for (sent = 0; (n = gzread(gz, buf, sizeof(buf))) > 0; sent += n) {
+                if (fwrite(buf, 1, n, stdout) != (size_t)n) break;
+            }
+            if (n < 0) WARN("Broken gzip file %s.", filepath);
+            gzclose(gz);
+        }
+    }
+    if (sent > 0) _q_metrics_add(_Q_M_DOWNLOAD_BYTES, sent);
+    _q_metrics_observe(_Q_H_DOWNLOAD, _q_clock_usec() - started);
+    _q_trace_stop(span);
+    PROBE2(download__end, filepath, sent);
 
     fclose(fp);
     return sent;
@@ -317,3 +442,36 @@ void qcgires_error(qentry_t *request, char *format, ...)
     if (request != NULL) request->free(request);
     exit(EXIT_FAILURE);
 }
+
+#ifndef _DOXYGEN_SKIP
+
+// true if Accept-Encoding allows gzip, by the name or '*'.
+static bool _accept_gzip(void)
+{
+    const char *accept = getenv("HTTP_ACCEPT_ENCODING");
+    if (accept == NULL) return false;
+
+    int any = -1;  // '*', used when gzip isn't listed.
+    const char *cp = accept;
+    while (*cp != '\0') {
+        cp += strspn(cp, " \t,");
+        size_t len = strcspn(cp, " \t;,");
+        bool gzip = (len == 4 && !strncasecmp(cp, "gzip", 4));
+        bool star = (len == 1 && *cp == '*');
+        cp += len;
+
+        // parameters
+        double q = 1.0;
+        while (*cp != '\0' && *cp != ',') {
+            cp += strspn(cp, " \t;");
+            if (!strncasecmp(cp, "q=", 2)) q = atof(cp + 2);
+            cp += strcspn(cp, ";,");
+        }
+        if (gzip == true) return (q > 0);
+        if (star == true) any = (q > 0);
+    }
+
+    return (any > 0);
+}
+
+#endif /* _DOXYGEN_SKIP */
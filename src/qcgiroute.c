@@ -0,0 +1,417 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgiroute.c PATH_INFO Routing API
+ *
+ * Route patterns are compiled into a radix trie once per process, then each
+ * request path is matched in a single walk down the trie. Parameters
+ * captured by the pattern are stored into the request container.
+ *
+ *   @li static segments like "/articles" match exactly.
+ *   @li :name matches one path segment, stored as "name".
+ *   @li *name at the end of a pattern matches the rest of the path, stored
+ *       as "name". A bare "*" is stored as "*".
+ *
+ * When more than one route could match, static segments are preferred over
+ * parameters, and parameters over wildcards.
+ *
+ * @code
+ *   enum { R_LIST, R_VIEW, R_FILE };
+ *   const char *files = "/files" "/" "*path";
+ *
+ *   // once per process
+ *   qcgiroute_t *router = qcgiroute();
+ *   qcgiroute_add(router, "/articles", R_LIST);
+ *   qcgiroute_add(router, "/articles/:id", R_VIEW);
+ *   qcgiroute_add(router, files, R_FILE);
+ *
+ *   // for each request, with PATH_INFO "/articles/42"
+ *   qentry_t *req = qcgireq_parse(NULL, 0);
+ *   switch (qcgiroute_match(router, req, NULL)) {
+ *     case R_VIEW : {
+ *       int id = req->getint(req, "id"); // 42
+ *       (...)
+ *     }
+ *     (...)
+ *     default : qcgires_error(req, "Not found.");
+ *   }
+ * @endcode
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define ROUTE_MAX_PARAMS    (16)
+
+struct _node {
+    char *prefix;               /* static label of the edge from the parent */
+    size_t prefixlen;
+    int id;                     /* route id if a route ends here, or -1 */
+
+    struct _node **children;    /* static children, distinct first chars */
+    int nchildren;
+
+    struct _node *param;        /* ":name" child */
+    char *paramname;
+
+    char *wildname;             /* "*name" ends here */
+    int wildid;
+};
+
+struct qcgiroute_s {
+    struct _node *root;
+    int num;
+};
+
+struct _capture {
+    const char *name;
+    const char *value;
+    size_t len;
+};
+
+static struct _node *_newnode(const char *prefix, size_t len);
+static void _freenode(struct _node *node);
+static struct _node *_addstatic(struct _node *node, const char *str,
+                                size_t len);
+static int _match(struct _node *node, const char *path,
+                  struct _capture *caps, int *ncaps);
+static char *_getpath(void);
+
+#endif
+
+/**
+ * Create a new router.
+ *
+ * @return  qcgiroute_t pointer if successful, otherwise returns NULL.
+ */
+qcgiroute_t *qcgiroute(void)
+{
+    qcgiroute_t *router = (qcgiroute_t *)calloc(1, sizeof(qcgiroute_t));
+    if (router == NULL) return NULL;
+
+    router->root = _newnode("", 0);
+    if (router->root == NULL) {
+        free(router);
+        return NULL;
+    }
+
+    return router;
+}
+
+/**
+ * Compile a route pattern into the router.
+ *
+ * @param router    qcgiroute_t pointer.
+ * @param pattern   route pattern like "/articles/:id".
+ * @param id        route id, 0 or greater, returned by qcgiroute_match().
+ *
+ * @return  true if successful, false if the pattern is malformed, it
+ *          conflicts with an existing one or there's no memory.
+ *
+ * @note
+ * Parameters at the same position of different patterns must have the same
+ * name, as in "/user/:id" and "/user/:id/posts".
+ */
+bool qcgiroute_add(qcgiroute_t *router, const char *pattern, int id)
+{
+    if (router == NULL || pattern == NULL || id < 0) return false;
+
+    struct _node *node = router->root;
+    const char *p = pattern;
+    int nparams = 0;
+    while (*p != '\0') {
+        if (*p == ':') {
+            size_t len = strcspn(++p, "/");
+            if (len == 0 || ++nparams > ROUTE_MAX_PARAMS) return false;
+
+            if (node->param == NULL) {
+                node->param = _newnode("", 0);
+                node->paramname = strndup(p, len);
+                if (node->param == NULL || node->paramname == NULL) {
+                    return false;
+                }
+            } else if (strlen(node->paramname) != len ||
+                       strncmp(node->paramname, p, len) != 0) {
+                WARN("Conflicting parameter name in route %s", pattern);
+                return false;
+            }
+            node = node->param;
+            p += len;
+        } else if (*p == '*') {
+            p++;
+            if (strchr(p, '/') != NULL || ++nparams > ROUTE_MAX_PARAMS ||
+                node->wildname != NULL) {
+                return false;
+            }
+            node->wildname = strdup((*p != '\0') ? p : "*");
+            if (node->wildname == NULL) return false;
+            node->wildid = id;
+            router->num++;
+            return true;
+        } else {
+            size_t len = strcspn(p, ":*");
+            node = _addstatic(node, p, len);
+            if (node == NULL) return false;
+            p += len;
+        }
+    }
+
+    if (node->id >= 0) return false;
+    node->id = id;
+    router->num++;
+
+    return true;
+}
+
+/**
+ * Find the route of a request path.
+ *
+ * @param router    qcgiroute_t pointer.
+ * @param request   qentry_t container pointer that captured parameters will
+ *                  be stored. NULL can be used not to store them.
+ * @param path      request path. NULL can be used for PATH_INFO, or the
+ *                  decoded path of REQUEST_URI without SCRIPT_NAME when
+ *                  PATH_INFO is not set.
+ *
+ * @return  route id if matched, otherwise returns -1.
+ *
+ * @note
+ * Captured parameters replace the values of the same name in the request.
+ */
+int qcgiroute_match(qcgiroute_t *router, qentry_t *request, const char *path)
+{
+    if (router == NULL) return -1;
+
+    char *pathbuf = NULL;
+    if (path == NULL) {
+        path = getenv("PATH_INFO");
+        if (path == NULL) path = pathbuf = _getpath();
+        if (path == NULL) return -1;
+    }
+
+    struct _capture caps[ROUTE_MAX_PARAMS];
+    int ncaps = 0;
+    int id = _match(router->root, path, caps, &ncaps);
+
+    if (id >= 0 && request != NULL) {
+        int i;
+        for (i = 0; i < ncaps; i++) {
+            char *value = strndup(caps[i].value, caps[i].len);
+            if (value == NULL) continue;
+            request->putstr(request, caps[i].name, value, true);
+            free(value);
+        }
+    }
+
+    if (pathbuf != NULL) free(pathbuf);
+    return id;
+}
+
+/**
+ * De-allocate the router.
+ *
+ * @param router    qcgiroute_t pointer.
+ */
+void qcgiroute_free(qcgiroute_t *router)
+{
+    if (router == NULL) return;
+    _freenode(router->root);
+    free(router);
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static struct _node *_newnode(const char *prefix, size_t len)
+{
+    struct _node *node = (struct _node *)calloc(1, sizeof(struct _node));
+    if (node == NULL) return NULL;
+
+    node->prefix = strndup(prefix, len);
+    if (node->prefix == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->prefixlen = len;
+    node->id = -1;
+    node->wildid = -1;
+
+    return node;
+}
+
+static void _freenode(struct _node *node)
+{
+    if (node == NULL) return;
+
+    int i;
+    for (i = 0; i < node->nchildren; i++) _freenode(node->children[i]);
+    if (node->children != NULL) free(node->children);
+    _freenode(node->param);
+    if (node->paramname != NULL) free(node->paramname);
+    if (node->wildname != NULL) free(node->wildname);
+    free(node->prefix);
+    free(node);
+}
+
+// insert static string under the node, splitting edges as needed.
+static struct _node *_addstatic(struct _node *node, const char *str,
+                                size_t len)
+{
+    while (len > 0) {
+        int i;
+        for (i = 0; i < node->nchildren; i++) {
+            if (node->children[i]->prefix[0] == str[0]) break;
+        }
+
+        // no edge starts with it, add a new leaf.
+        if (i == node->nchildren) {
+            struct _node **children = (struct _node **)realloc(
+                    node->children, sizeof(struct _node *) * (i + 1));
+            if (children == NULL) return NULL;
+            node->children = children;
+
+            struct _node *leaf = _newnode(str, len);
+            if (leaf == NULL) return NULL;
+            node->children[node->nchildren++] = leaf;
+            return leaf;
+        }
+
+        struct _node *child = node->children[i];
+        size_t common;
+        for (common = 0; common < len && common < child->prefixlen
+             && str[common] == child->prefix[common]; common++);
+
+        // split the edge at the common prefix.
+        if (common < child->prefixlen) {
+            struct _node *mid = _newnode(str, common);
+            if (mid == NULL) return NULL;
+            mid->children = (struct _node **)malloc(sizeof(struct _node *));
+            if (mid->children == NULL) {
+                _freenode(mid);
+                return NULL;
+            }
+            memmove(child->prefix, child->prefix + common,
+                    child->prefixlen - common + 1);
+            child->prefixlen -= common;
+            mid->children[0] = child;
+            mid->nchildren = 1;
+            node->children[i] = mid;
+            child = mid;
+        }
+
+        node = child;
+        str += common;
+        len -= common;
+    }
+
+    return node;
+}
+
+static int _match(struct _node *node, const char *path,
+                  struct _capture *caps, int *ncaps)
+{
+    if (*path == '\0' && node->id >= 0) return node->id;
+
+    // static
+    int i;
+    for (i = 0; *path != '\0' && i < node->nchildren; i++) {
+        struct _node *child = node->children[i];
+        if (child->prefix[0] != *path) continue;
+        if (strncmp(path, child->prefix, child->prefixlen) == 0) {
+            int id = _match(child, path + child->prefixlen, caps, ncaps);
+            if (id >= 0) return id;
+        }
+        break;
+    }
+
+    // :param
+    if (node->param != NULL && *path != '\0' && *path != '/') {
+        size_t len = strcspn(path, "/");
+        int saved = *ncaps;
+        caps[*ncaps].name = node->paramname;
+        caps[*ncaps].value = path;
+        caps[*ncaps].len = len;
+        (*ncaps)++;
+        int id = _match(node->param, path + len, caps, ncaps);
+        if (id >= 0) return id;
+        *ncaps = saved;
+    }
+
+    // *wildcard
+    if (node->wildname != NULL) {
+        caps[*ncaps].name = node->wildname;
+        caps[*ncaps].value = path;
+        caps[*ncaps].len = strlen(path);
+        (*ncaps)++;
+        return node->wildid;
+    }
+
+    return -1;
+}
+
+// REQUEST_URI without SCRIPT_NAME and query string, percent-decoded.
+static char *_getpath(void)
+{
+    const char *uri = getenv("REQUEST_URI");
+    if (uri == NULL) return NULL;
+
+    const char *script = getenv("SCRIPT_NAME");
+    if (script != NULL && !strncmp(uri, script, strlen(script))) {
+        uri += strlen(script);
+    }
+
+    char *path = strndup(uri, strcspn(uri, "?"));
+    if (path == NULL) return NULL;
+
+    char *s, *d;
+    for (s = d = path; *s != '\0'; s++, d++) {
+        if (*s == '%' && s[1] != '\0' && s[2] != '\0') {
+            *d = _q_x2c(s[1], s[2]);
+            s += 2;
+        } else {
+            *d = *s;
+        }
+    }
+    *d = '\0';
+
+    return path;
+}
+
+#endif /* _DOXYGEN_SKIP */
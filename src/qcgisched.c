@@ -0,0 +1,530 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgisched.c Request Scheduling API for Worker Pools
+ *
+ * In a persistent-worker deployment like FastCGI, a long upload and a
+ * millisecond GET take a worker alike. The scheduler limits the number of
+ * requests served at the same time on the host, and makes the other workers
+ * wait in queues per admission class in POSIX shared memory.
+ *
+ *   @li Q_SCHED_INTERACTIVE : GET or HEAD without a body.
+ *   @li Q_SCHED_DEFAULT : other requests.
+ *   @li Q_SCHED_BULK : multipart/form-data or a body larger than 1MB.
+ *
+ * When a request finishes, the next one is taken from the queues by
+ * weighted fair queuing, so each class gets a share of service in
+ * proportion to its weight. The queueing delay of each class is watched
+ * like CoDel. When the delay has stayed above the target for an interval,
+ * waiting requests are shed with a fast "503 Service Unavailable" at a rate
+ * which grows while the delay stays high, instead of letting the queue grow
+ * and every request time out.
+ *
+ * @code
+ *   qcgisched_init(NULL, 8);  // serve 8 requests at a time
+ *   while(FCGI_Accept() >= 0) {
+ *     if (qcgisched_begin(NULL, Q_SCHED_AUTO) == false) {
+ *       continue;  // "503 Service Unavailable" has been sent.
+ *     }
+ *     qentry_t *req = qcgireq_parse(NULL, 0);
+ *     (...)
+ *     req->free(req);
+ *     qcgisched_end();
+ *   }
+ * @endcode
+ *
+ * @note
+ * Run more workers than the limit so there are requests to choose from.
+ * Slots of workers which died while being served or queued are reclaimed.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define SCHED_DEFAULT_SHMNAME   "/qdecoder-sched"
+#define SCHED_MAGIC             (0x51534348)    /* "QSCH" */
+#define SCHED_VERSION           (1)
+#define SCHED_MAX_ACTIVE        (256)
+#define SCHED_QUEUE_LEN         (1024)
+#define SCHED_BULK_LENGTH       (1024 * 1024)
+#define SCHED_POLL_USEC         (100 * 1000)
+#define SCHED_VTIME_UNIT        (1 << 20)
+
+enum { _W_FREE = 0, _W_WAITING, _W_GRANTED, _W_DROPPED };
+
+struct _waiter {
+    pid_t pid;
+    uint32_t state;
+    uint64_t enqueued;          /* usec */
+};
+
+struct _class {
+    uint32_t weight;
+    uint32_t maxactive;         /* 0 for no limit */
+    uint64_t target;            /* usec */
+    uint64_t interval;          /* usec */
+
+    uint32_t active;
+    uint32_t head, tail;
+    uint64_t vfinish;           /* virtual finish time */
+
+    /* CoDel state */
+    uint64_t first_above;
+    uint64_t drop_next;
+    uint32_t count;
+    bool dropping;
+
+    struct _waiter queue[SCHED_QUEUE_LEN];
+};
+
+struct _sched {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t limit;
+    uint32_t active;
+    uint64_t vtime;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pid_t slots[SCHED_MAX_ACTIVE];
+    uint8_t slotclass[SCHED_MAX_ACTIVE];
+    struct _class classes[Q_SCHED_MAX];
+};
+
+static struct _sched *_sched = NULL;
+static int _myclass = -1;       /* class of the request being served */
+
+static bool _lock(void);
+static void _unlock(void);
+static bool _dispatch(uint64_t now);
+static bool _codel(struct _class *c, uint64_t sojourn, uint64_t now);
+static bool _alive(pid_t pid);
+static uint64_t _isqrt(uint64_t n);
+static int _classify(void);
+static void _shed(qentry_t *request);
+
+#endif
+
+/**
+ * Attach to the shared scheduler, creating it if it doesn't exist.
+ *
+ * @param shmname   POSIX shared memory object name. NULL can be used for
+ *                  "/qdecoder-sched".
+ * @param limit     number of requests served at the same time on the host,
+ *                  0 for the number of online CPUs. (max 256)
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * The limit is decided by the process which creates the shared memory.
+ */
+bool qcgisched_init(const char *shmname, int limit)
+{
+    if (_sched != NULL) return true;
+    if (shmname == NULL) shmname = SCHED_DEFAULT_SHMNAME;
+    if (limit <= 0) limit = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit <= 0) limit = 1;
+    if (limit > SCHED_MAX_ACTIVE) limit = SCHED_MAX_ACTIVE;
+
+    bool created;
+    struct _sched *sched = _q_shm_map(shmname, sizeof(struct _sched),
+                                      SCHED_MAGIC, SCHED_VERSION, &created);
+    if (sched == NULL) return false;
+
+    if (created == true) {
+        pthread_mutexattr_t mattr;
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&sched->lock, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        pthread_condattr_t cattr;
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sched->cond, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        static const struct {
+            uint32_t weight;
+            uint64_t target, interval;
+        } defaults[Q_SCHED_MAX] = {
+            [Q_SCHED_INTERACTIVE] = { 8, 5 * 1000, 100 * 1000 },
+            [Q_SCHED_DEFAULT]     = { 4, 5 * 1000, 100 * 1000 },
+            [Q_SCHED_BULK]        = { 1, 50 * 1000, 1000 * 1000 },
+        };
+        int i;
+        for (i = Q_SCHED_INTERACTIVE; i < Q_SCHED_MAX; i++) {
+            sched->classes[i].weight = defaults[i].weight;
+            sched->classes[i].target = defaults[i].target;
+            sched->classes[i].interval = defaults[i].interval;
+        }
+        // keep a half for short requests.
+        sched->classes[Q_SCHED_BULK].maxactive = (limit > 1) ? limit / 2 : 1;
+
+        sched->version = SCHED_VERSION;
+        sched->limit = limit;
+        __atomic_store_n(&sched->magic, SCHED_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    _sched = sched;
+    return true;
+}
+
+/**
+ * Change the scheduling parameters of a class.
+ *
+ * @param cls       one of Q_SCHED_INTERACTIVE, Q_SCHED_DEFAULT and
+ *                  Q_SCHED_BULK.
+ * @param weight    share of service relative to other classes.
+ * @param target    acceptable queueing delay in milliseconds.
+ * @param interval  milliseconds the delay may stay above the target before
+ *                  shedding starts. usually 20 times of the target.
+ * @param maxactive maximum requests of the class served at the same time,
+ *                  0 for no limit.
+ *
+ * @return  true if successful, otherwise returns false.
+ *
+ * @note
+ * The parameters are shared by every process attached.
+ * Defaults are (8, 5, 100, 0) for Q_SCHED_INTERACTIVE, (4, 5, 100, 0) for
+ * Q_SCHED_DEFAULT and (1, 50, 1000, limit/2) for Q_SCHED_BULK.
+ */
+bool qcgisched_setclass(Q_SCHED_T cls, int weight, int target, int interval,
+                        int maxactive)
+{
+    if (_sched == NULL || cls <= Q_SCHED_AUTO || cls >= Q_SCHED_MAX
+        || weight <= 0 || target <= 0 || interval < target || maxactive < 0) {
+        return false;
+    }
+    if (_lock() == false) return false;
+
+    struct _class *c = &_sched->classes[cls];
+    c->weight = weight;
+    c->target = (uint64_t)target * 1000;
+    c->interval = (uint64_t)interval * 1000;
+    c->maxactive = maxactive;
+
+    _unlock();
+    return true;
+}
+
+/**
+ * Wait for the turn of this request. If the request is shed, send
+ * "503 Service Unavailable" response.
+ *
+ * @param request   qentry_t container pointer. NULL can be used since this
+ *                  is usually called before qcgireq_parse().
+ * @param cls       Q_SCHED_AUTO to classify by REQUEST_METHOD, CONTENT_TYPE
+ *                  and CONTENT_LENGTH, or one of the classes.
+ *
+ * @return  true if the request can be served, false if it's shed and the
+ *          response has been sent.
+ *
+ * @note
+ * qcgisched_end() must be called when the request is served. The request
+ * is always served when qcgisched_init() wasn't called.
+ */
+bool qcgisched_begin(qentry_t *request, Q_SCHED_T cls)
+{
+    if (_sched == NULL) return true;
+    if (_myclass >= 0) qcgisched_end();  // previous request
+    if (cls <= Q_SCHED_AUTO || cls >= Q_SCHED_MAX) cls = _classify();
+
+    if (_lock() == false) return true;
+
+    struct _class *c = &_sched->classes[cls];
+    struct _waiter *w = &c->queue[c->tail % SCHED_QUEUE_LEN];
+    bool full = (c->tail - c->head >= SCHED_QUEUE_LEN);
+
+    // the entry has been granted or dropped already, it's taken until the
+    // waiter sees the result. reclaim it if the waiter died before that.
+    if (full == false && w->state != _W_FREE && _alive(w->pid) == false) {
+        w->state = _W_FREE;
+    }
+    if (full == true || w->state != _W_FREE) {
+        // queue is full
+        _unlock();
+        PROBE2(sched__shed, (int)cls, 0);
+        _shed(request);
+        return false;
+    }
+
+    uint64_t now = _q_clock_usec();
+    if (c->head == c->tail && c->vfinish < _sched->vtime) {
+        c->vfinish = _sched->vtime;  // was idle
+    }
+    w->pid = getpid();
+    w->state = _W_WAITING;
+    w->enqueued = now;
+    c->tail++;
+
+    _dispatch(now);
+    while (w->state == _W_WAITING) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += SCHED_POLL_USEC * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        int ret = pthread_cond_timedwait(&_sched->cond, &_sched->lock, &ts);
+        if (ret == EOWNERDEAD) pthread_mutex_consistent(&_sched->lock);
+        if (w->state == _W_WAITING) _dispatch(_q_clock_usec());
+    }
+
+    bool granted = (w->state == _W_GRANTED);
+    w->state = _W_FREE;
+    _unlock();
+
+    uint64_t waited = _q_clock_usec() - now;
+    _q_metrics_observe(_Q_H_SCHED_WAIT, waited);
+    if (granted == false) {
+        PROBE2(sched__shed, (int)cls, (int)waited);
+        _shed(request);
+        return false;
+    }
+
+    _myclass = cls;
+    return true;
+}
+
+/**
+ * Tell the scheduler that the request has been served, so the next one can
+ * be served.
+ */
+void qcgisched_end(void)
+{
+    if (_sched == NULL || _myclass < 0) return;
+    fflush(stdout);
+
+    if (_lock() == false) return;
+
+    pid_t pid = getpid();
+    int i;
+    for (i = 0; i < _sched->limit; i++) {
+        if (_sched->slots[i] != pid) continue;
+        _sched->slots[i] = 0;
+        _sched->active--;
+        _sched->classes[_sched->slotclass[i]].active--;
+        break;
+    }
+    _myclass = -1;
+
+    _dispatch(_q_clock_usec());
+    _unlock();
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static bool _lock(void)
+{
+    int ret = pthread_mutex_lock(&_sched->lock);
+    if (ret == EOWNERDEAD) {
+        // the owner died, slots of dead processes are reclaimed later.
+        pthread_mutex_consistent(&_sched->lock);
+        ret = 0;
+    }
+    return (ret == 0);
+}
+
+static void _unlock(void)
+{
+    pthread_mutex_unlock(&_sched->lock);
+}
+
+// hand free slots to waiters, called with the lock held.
+static bool _dispatch(uint64_t now)
+{
+    bool changed = false;
+    int i;
+
+    // reclaim slots of dead processes.
+    if (_sched->active >= _sched->limit) {
+        for (i = 0; i < _sched->limit; i++) {
+            if (_sched->slots[i] == 0 || _alive(_sched->slots[i])) continue;
+            _sched->slots[i] = 0;
+            _sched->active--;
+            _sched->classes[_sched->slotclass[i]].active--;
+            changed = true;
+        }
+    }
+
+    while (true) {
+        // weighted fair queuing, the least virtual finish time first.
+        struct _class *c = NULL;
+        for (i = Q_SCHED_INTERACTIVE; i < Q_SCHED_MAX; i++) {
+            struct _class *cand = &_sched->classes[i];
+            if (cand->head == cand->tail) continue;
+            if (cand->maxactive > 0 && cand->active >= cand->maxactive) {
+                continue;
+            }
+            if (c == NULL || cand->vfinish < c->vfinish) c = cand;
+        }
+        if (c == NULL) break;
+
+        struct _waiter *w = &c->queue[c->head % SCHED_QUEUE_LEN];
+        uint64_t sojourn = now - w->enqueued;
+
+        if (_alive(w->pid) == false) {
+            w->state = _W_FREE;
+            c->head++;
+            continue;
+        }
+
+        if (_sched->active >= _sched->limit) {
+            // no slot. shed the head if it has waited a whole interval.
+            if (sojourn < c->interval || _codel(c, sojourn, now) == false) {
+                break;
+            }
+            w->state = _W_DROPPED;
+            c->head++;
+            changed = true;
+            continue;
+        }
+
+        c->head++;
+        changed = true;
+        if (_codel(c, sojourn, now) == true) {
+            w->state = _W_DROPPED;
+            continue;
+        }
+
+        for (i = 0; i < _sched->limit && _sched->slots[i] != 0; i++);
+        _sched->slots[i] = w->pid;
+        _sched->slotclass[i] = c - _sched->classes;
+        _sched->active++;
+        c->active++;
+        _sched->vtime = c->vfinish;
+        c->vfinish += SCHED_VTIME_UNIT / c->weight;
+        w->state = _W_GRANTED;
+    }
+
+    if (changed == true) pthread_cond_broadcast(&_sched->cond);
+    return changed;
+}
+
+// CoDel drop decision on dequeue.
+static bool _codel(struct _class *c, uint64_t sojourn, uint64_t now)
+{
+    if (sojourn < c->target) {
+        c->first_above = 0;
+        c->dropping = false;
+        return false;
+    }
+
+    if (c->first_above == 0) {
+        c->first_above = now + c->interval;
+        return false;
+    }
+    if (now < c->first_above) return false;
+
+    if (c->dropping == false) {
+        c->dropping = true;
+        // resume near the last rate if the previous episode was recent.
+        if (c->count > 2 && now - c->drop_next < 16 * c->interval) {
+            c->count -= 2;
+        } else {
+            c->count = 1;
+        }
+        c->drop_next = now + c->interval / _isqrt(c->count);
+        return true;
+    }
+
+    if (now >= c->drop_next) {
+        c->count++;
+        c->drop_next += c->interval / _isqrt(c->count);
+        return true;
+    }
+    return false;
+}
+
+static bool _alive(pid_t pid)
+{
+    return (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static uint64_t _isqrt(uint64_t n)
+{
+    uint64_t x = 1;
+    while ((x + 1) * (x + 1) <= n) x++;
+    return x;
+}
+
+static int _classify(void)
+{
+    const char *method = getenv("REQUEST_METHOD");
+    const char *content_type = getenv("CONTENT_TYPE");
+    const char *content_length = getenv("CONTENT_LENGTH");
+    long long length = (content_length != NULL) ? atoll(content_length) : 0;
+
+    if (length > SCHED_BULK_LENGTH || (content_type != NULL
+        && !strncasecmp(content_type, "multipart/form-data",
+                        CONST_STRLEN("multipart/form-data")))) {
+        return Q_SCHED_BULK;
+    }
+    if (length <= 0 && method != NULL
+        && (!strcmp(method, "GET") || !strcmp(method, "HEAD"))) {
+        return Q_SCHED_INTERACTIVE;
+    }
+    return Q_SCHED_DEFAULT;
+}
+
+static void _shed(qentry_t *request)
+{
+    _q_metrics_add(_Q_M_LIMIT_REJECTIONS, 1);
+
+    printf("Status: 503 Service Unavailable" CRLF);
+    printf("Retry-After: 1" CRLF);
+    qcgires_setcontenttype(request, "text/plain");
+    printf("Service Unavailable\n");
+}
+
+#endif /* _DOXYGEN_SKIP */
@@ -45,6 +45,9 @@
 #include <time.h>
 #include <sys/time.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 #ifndef _WIN32
 #include <dirent.h>
 #endif
@@ -61,6 +64,8 @@
 #define SESSION_PREFIX                      "qsession-"
 #define SESSION_STORAGE_EXTENSION           ".properties"
 #define SESSION_TIMEOUT_EXTENSION           ".expire"
+#define SESSION_INDEX_EXTENSION             ".index"
+#define SESSION_INDEX_PREFIX                "qsession-idx-"
 #define SESSION_TIMETOCLEAR_FILENAME        "qsession-timetoclear"
 #define SESSION_DEFAULT_TIMEOUT_INTERVAL    (30 * 60)
 
@@ -72,8 +77,18 @@
 #define INTER_CREATED_SEC       INTER_PREFIX "CREATED"
 #define INTER_INTERVAL_SEC      INTER_PREFIX "INTERVAL"
 #define INTER_CONNECTIONS       INTER_PREFIX "CONNECTIONS"
+#define INTER_INDEXNAME         INTER_PREFIX "INDEXNAME"
+
+#define INDEX_MAX_VALUE         (100)
 
 static bool _clear_repo(const char *session_repository_path);
+static bool _index_dir(char *buf, size_t size, const char *repository,
+                       const char *name, const char *value);
+static bool _index_update(qentry_t *session, const char *repository,
+                          const char *sessionkey);
+static void _index_remove(const char *repository, const char *sessionkey);
+static int _index_find(const char *repository, const char *name,
+                       const char *value, qentry_t *list, bool destroy);
 static int _is_valid_session(const char *filepath);
 static bool _update_timeout(const char *filepath, time_t timeout_interval);
 static char *_genuniqid(void);
@@ -97,12 +112,14 @@ qentry_t *qcgisess_init(qentry_t *request, const char *dirpath)
 {
     // check content flag
     if (qcgires_getcontenttype(request) != NULL) {
-        DEBUG("Should be called before qRequestSetContentType().");
+        WARN("Should be called before qRequestSetContentType().");
         return NULL;
     }
 
     qentry_t *session = qEntry();
     if (session == NULL) return NULL;
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("session");
 
     // check session status & get session id
     bool new_session;
@@ -188,6 +205,11 @@ qentry_t *qcgisess_init(qentry_t *request, const char *dirpath)
         // set timeout interval
         qcgisess_settimeout(session, session->getint(session, INTER_INTERVAL_SEC));
     }
+    PROBE2(session__load, sessionkey, (int)new_session);
+    _q_metrics_add((new_session == true) ? _Q_M_SESSION_MISSES
+                   : _Q_M_SESSION_HITS, 1);
+    _q_metrics_observe(_Q_H_SESSION, _q_clock_usec() - started);
+    _q_trace_stop(span);
 
     free(sessionkey);
 
@@ -252,6 +274,8 @@ bool qcgisess_save(qentry_t *session)
     const char *session_repository_path = session->getstr(session, INTER_SESSION_REPO, false);
     int session_timeout_interval = session->getint(session, INTER_INTERVAL_SEC);
     if (sessionkey == NULL || session_repository_path == NULL) return false;
+    uint64_t started = _q_clock_usec();
+    int span = _q_trace_start("session.save");
 
     char session_storage_path[PATH_MAX];
     char session_timeout_path[PATH_MAX];
@@ -265,15 +289,23 @@ bool qcgisess_save(qentry_t *session)
              SESSION_PREFIX, sessionkey, SESSION_TIMEOUT_EXTENSION);
 
     if (session->save(session, session_storage_path) == false) {
-        DEBUG("Can't save session file %s", session_storage_path);
+        ERROR("Can't save session file %s", session_storage_path);
+        _q_trace_stop(span);
         return false;
     }
     if (_update_timeout(session_timeout_path, session_timeout_interval) == false) {
-        DEBUG("Can't update file %s", session_timeout_path);
+        ERROR("Can't update file %s", session_timeout_path);
+        _q_trace_stop(span);
         return false;
     }
+    if (_index_update(session, session_repository_path, sessionkey) == false) {
+        ERROR("Can't update session index of %s", sessionkey);
+    }
+    PROBE1(session__save, sessionkey);
 
     _clear_repo(session_repository_path);
+    _q_metrics_observe(_Q_H_SESSION_SAVE, _q_clock_usec() - started);
+    _q_trace_stop(span);
     return true;
 }
 
@@ -308,6 +340,7 @@ bool qcgisess_destroy(qentry_t *session)
              session_repository_path,
              SESSION_PREFIX, sessionkey, SESSION_TIMEOUT_EXTENSION);
 
+    _index_remove(session_repository_path, sessionkey);
     _q_unlink(session_storage_path);
     _q_unlink(session_timeout_path);
 
@@ -315,6 +348,87 @@ bool qcgisess_destroy(qentry_t *session)
     return true;
 }
 
+/**
+ * Index sessions by a session attribute like a user id.
+ *
+ * @param session   a pointer of session structure
+ * @param name      name of the session attribute to index. NULL to stop
+ *                  indexing this session.
+ *
+ * @return  true if successful, otherwise returns false
+ *
+ * @note
+ * The index is updated by qcgisess_save() and qcgisess_destroy(), and
+ * entries of expired sessions are removed together with the sessions. The
+ * name is kept in the session, so it needs to be set only once. Values
+ * longer than 100 bytes are not indexed.
+ *
+ * @code
+ *   // on login
+ *   qentry_t *sess = qcgisess_init(req, NULL);
+ *   sess->putstr(sess, "user_id", "alice", true);
+ *   qcgisess_setindex(sess, "user_id");
+ *   qcgisess_save(sess);
+ *
+ *   // log out everywhere
+ *   qcgisess_destroyall(NULL, "user_id", "alice");
+ * @endcode
+ */
+bool qcgisess_setindex(qentry_t *session, const char *name)
+{
+    if (name == NULL) {
+        session->remove(session, INTER_INDEXNAME);
+        return true;
+    }
+    if (*name == '\0' || strlen(name) > INDEX_MAX_VALUE) return false;
+    return session->putstr(session, INTER_INDEXNAME, name, true);
+}
+
+/**
+ * Find sessions by an indexed session attribute.
+ *
+ * @param dirpath   session repository, NULL for the default.
+ * @param name      name of the indexed session attribute
+ * @param value     value of the attribute
+ *
+ * @return  a pointer of malloced list (qentry_t type) which has the session
+ *          ids as names and the expiration times as values, NULL on error.
+ *
+ * @note
+ * Only the sessions of the value are visited, not the whole repository.
+ * The returned qentry_t list must be de-allocated by calling
+ * qentry_t->free().
+ */
+qentry_t *qcgisess_find(const char *dirpath, const char *name,
+                        const char *value)
+{
+    qentry_t *list = qEntry();
+    if (list == NULL) return NULL;
+
+    if (_index_find((dirpath != NULL) ? dirpath : SESSION_DEFAULT_REPOSITORY,
+                    name, value, list, false) < 0) {
+        list->free(list);
+        return NULL;
+    }
+    return list;
+}
+
+/**
+ * Destroy all sessions of an indexed session attribute value.
+ *
+ * @param dirpath   session repository, NULL for the default.
+ * @param name      name of the indexed session attribute
+ * @param value     value of the attribute
+ *
+ * @return  number of destroyed sessions, -1 on error.
+ */
+int qcgisess_destroyall(const char *dirpath, const char *name,
+                        const char *value)
+{
+    return _index_find((dirpath != NULL) ? dirpath : SESSION_DEFAULT_REPOSITORY,
+                       name, value, NULL, true);
+}
+
 #ifndef _DOXYGEN_SKIP
 
 static bool _clear_repo(const char *session_repository_path)
@@ -325,10 +439,11 @@ static bool _clear_repo(const char *session_repository_path)
     // clear old session data
     DIR *dp;
     if ((dp = opendir(session_repository_path)) == NULL) {
-        DEBUG("Can't open session repository %s", session_repository_path);
+        ERROR("Can't open session repository %s", session_repository_path);
         return false;
     }
 
+    int removed = 0;
     struct dirent *dirp;
     while ((dirp = readdir(dp)) != NULL) {
         if (strstr(dirp->d_name, SESSION_PREFIX) &&
@@ -337,6 +452,14 @@ static bool _clear_repo(const char *session_repository_path)
             snprintf(timeoutpath, sizeof(timeoutpath),
                      "%s/%s", session_repository_path, dirp->d_name);
             if (_is_valid_session(timeoutpath) <= 0) { // expired
+                // remove index
+                char sessionkey[NAME_MAX+1];
+                _q_strcpy(sessionkey, sizeof(sessionkey),
+                          dirp->d_name + CONST_STRLEN(SESSION_PREFIX));
+                sessionkey[strlen(sessionkey)
+                           - CONST_STRLEN(SESSION_TIMEOUT_EXTENSION)] = '\0';
+                _index_remove(session_repository_path, sessionkey);
+
                 // remove timeout
                 _q_unlink(timeoutpath);
 
@@ -344,15 +467,177 @@ static bool _clear_repo(const char *session_repository_path)
                 timeoutpath[strlen(timeoutpath) - strlen(SESSION_TIMEOUT_EXTENSION)] = '\0';
                 strcat(timeoutpath, SESSION_STORAGE_EXTENSION);
                 _q_unlink(timeoutpath);
+                removed++;
             }
         }
     }
     closedir(dp);
+    PROBE2(session__gc, session_repository_path, removed);
+    _q_metrics_add(_Q_M_SESSION_GC, removed);
 
     return true;
 #endif
 }
 
+/*
+ * Session index
+ *
+ * An index entry is an empty file named by the session id, in a directory
+ * per attribute value, "qsession-idx-HEX(name)-HEX(value)/SESSIONID". The
+ * session keeps the path of its entry in "qsession-SESSIONID.index".
+ */
+static bool _index_dir(char *buf, size_t size, const char *repository,
+                       const char *name, const char *value)
+{
+    if (name == NULL || value == NULL || *value == '\0'
+        || strlen(name) > INDEX_MAX_VALUE || strlen(value) > INDEX_MAX_VALUE) {
+        return false;
+    }
+
+    int n = snprintf(buf, size, "%s/%s", repository, SESSION_INDEX_PREFIX);
+    const char *str[2] = { name, value };
+    int i;
+    for (i = 0; i < 2 && n < size; i++) {
+        const unsigned char *cp;
+        for (cp = (const unsigned char *)str[i]; *cp != '\0' && n < size; cp++) {
+            n += snprintf(buf + n, size - n, "%02x", *cp);
+        }
+        if (i == 0 && n < size) n += snprintf(buf + n, size - n, "-");
+    }
+    return (n < size);
+}
+
+static bool _index_update(qentry_t *session, const char *repository,
+                          const char *sessionkey)
+{
+    char indexpath[PATH_MAX], entrypath[PATH_MAX] = "", oldpath[PATH_MAX] = "";
+    snprintf(indexpath, sizeof(indexpath), "%s/%s%s%s", repository,
+             SESSION_PREFIX, sessionkey, SESSION_INDEX_EXTENSION);
+
+    // current entry
+    const char *name = session->getstr(session, INTER_INDEXNAME, false);
+    const char *value = (name != NULL) ? session->getstr(session, name, false)
+                                       : NULL;
+    char dirpath[PATH_MAX];
+    bool indexed = _index_dir(dirpath, sizeof(dirpath), repository,
+                              name, value);
+    if (indexed == true &&
+        snprintf(entrypath, sizeof(entrypath), "%s/%s", dirpath, sessionkey)
+        >= (int)sizeof(entrypath)) {
+        WARN("Index path is too long.");
+        return false;
+    }
+
+    // previous entry
+    int fd = open(indexpath, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, oldpath, sizeof(oldpath) - 1);
+        oldpath[(n > 0) ? n : 0] = '\0';
+        close(fd);
+    }
+    if (!strcmp(oldpath, entrypath)) return true;
+
+    if (oldpath[0] != '\0') _index_remove(repository, sessionkey);
+    if (indexed == false) return true;
+
+    // the directory can be removed by another process at the moment.
+    int retry;
+    for (retry = 0, fd = -1; retry < 2 && fd < 0; retry++) {
+        if (mkdir(dirpath, DEF_DIR_MODE) != 0 && errno != EEXIST) break;
+        fd = open(entrypath, O_CREAT|O_WRONLY, DEF_FILE_MODE);
+    }
+    if (fd < 0) return false;
+    close(fd);
+
+    fd = open(indexpath, O_CREAT|O_WRONLY|O_TRUNC, DEF_FILE_MODE);
+    if (fd < 0) return false;
+    ssize_t written = write(fd, entrypath, strlen(entrypath));
+    close(fd);
+
+    return (written == (ssize_t)strlen(entrypath));
+}
+
+static void _index_remove(const char *repository, const char *sessionkey)
+{
+    char indexpath[PATH_MAX], entrypath[PATH_MAX];
+    snprintf(indexpath, sizeof(indexpath), "%s/%s%s%s", repository,
+             SESSION_PREFIX, sessionkey, SESSION_INDEX_EXTENSION);
+
+    int fd = open(indexpath, O_RDONLY);
+    if (fd < 0) return;
+    ssize_t n = read(fd, entrypath, sizeof(entrypath) - 1);
+    close(fd);
+
+    if (n > 0) {
+        entrypath[n] = '\0';
+        _q_unlink(entrypath);
+
+        // remove the directory if it's the last one.
+        char *slash = strrchr(entrypath, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+            rmdir(entrypath);
+        }
+    }
+    _q_unlink(indexpath);
+}
+
+// returns the number of found sessions, -1 on error.
+static int _index_find(const char *repository, const char *name,
+                       const char *value, qentry_t *list, bool destroy)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    char dirpath[PATH_MAX];
+    if (_index_dir(dirpath, sizeof(dirpath), repository, name, value) == false) {
+        return -1;
+    }
+
+    DIR *dp = opendir(dirpath);
+    if (dp == NULL) return (errno == ENOENT) ? 0 : -1;
+
+    int found = 0;
+    struct dirent *dirp;
+    while ((dirp = readdir(dp)) != NULL) {
+        if (dirp->d_name[0] == '.') continue;
+
+        // names which don't fit in a path can't be our sessions.
+        char timeoutpath[PATH_MAX], entrypath[PATH_MAX];
+        if (snprintf(timeoutpath, sizeof(timeoutpath), "%s/%s%s%s",
+                     repository, SESSION_PREFIX, dirp->d_name,
+                     SESSION_TIMEOUT_EXTENSION) >= (int)sizeof(timeoutpath) ||
+            snprintf(entrypath, sizeof(entrypath), "%s/%s", dirpath,
+                     dirp->d_name) >= (int)sizeof(entrypath)) {
+            continue;
+        }
+        int valid = _is_valid_session(timeoutpath);
+        if (valid == 0) {
+            // stale entry of a session which is gone.
+            _q_unlink(entrypath);
+            continue;
+        }
+        if (valid < 0) continue;  // expired, left to the garbage collector
+
+        found++;
+        if (list != NULL) {
+            list->putint(list, dirp->d_name, _q_countread(timeoutpath), false);
+        }
+        if (destroy == true) {
+            char storagepath[PATH_MAX];
+            snprintf(storagepath, sizeof(storagepath), "%s/%s%s%s", repository,
+                     SESSION_PREFIX, dirp->d_name, SESSION_STORAGE_EXTENSION);
+            _index_remove(repository, dirp->d_name);
+            _q_unlink(storagepath);
+            _q_unlink(timeoutpath);
+        }
+    }
+    closedir(dp);
+
+    return found;
+#endif
+}
+
 // session not found 0, session expired -1, session valid 1
 static int _is_valid_session(const char *filepath)
 {
@@ -0,0 +1,460 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgitrace.c W3C Trace Context API
+ *
+ * The trace context of a request is taken from the "traceparent" and
+ * "tracestate" request headers, and spans of the library phases are
+ * recorded under a span for the request.
+ *
+ *   @li request : from qcgitrace_begin() to qcgitrace_end()
+ *   @li parse, multipart : qcgireq_parse(), qcgireq_parsefile()
+ *   @li session, session.save : qcgisess_init(), qcgisess_save()
+ *   @li download : qcgires_download()
+ *   @li response : from qcgires_setcontenttype() to qcgitrace_end()
+ *
+ * Spans are kept in a per-process buffer, which threads take entries from
+ * by an atomic increment. The buffer is written to the trace file by a
+ * single append at qcgitrace_end(), one line of OTLP-JSON per request, so
+ * the file can be fed to an OpenTelemetry collector (filelog or otlpjsonfile
+ * receiver). Requests which are not sampled cost a flag test per phase.
+ *
+ * @code
+ *   qcgitrace_init("/var/log/qdecoder/trace.jsonl", 0.01);  // 1% sampled
+ *   while(FCGI_Accept() >= 0) {
+ *     qcgitrace_begin();
+ *     qentry_t *req = qcgireq_parse(NULL, 0);
+ *     (...)
+ *     // propagate to a backend call
+ *     const char *traceparent = qcgitrace_traceparent();
+ *     (...)
+ *     req->free(req);
+ *     qcgitrace_end();
+ *   }
+ * @endcode
+ *
+ * @note
+ * A request is sampled if the sampled flag of the incoming traceparent is
+ * set, otherwise by the sampling rate when there's no incoming traceparent.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define TRACE_MAX_SPANS     (64)
+#define TRACE_MAX_STATE     (512)
+#define TRACE_FLAG_SAMPLED  (0x01)
+
+struct _span {
+    const char *name;
+    uint64_t id;
+    uint64_t start;     /* unix time in nanoseconds */
+    uint64_t end;       /* 0 while it's open */
+};
+
+static int _fd = -1;
+static double _rate = 0;
+static uint64_t _rand = 0;
+
+static bool _sampled = false;
+static uint8_t _traceid[16];
+static uint64_t _parentid;          /* span id of the caller, 0 for none */
+static uint8_t _flags;
+static char _tracestate[TRACE_MAX_STATE+1];
+static struct _span _spans[TRACE_MAX_SPANS];  /* 0 is the request span */
+static int _nspans = 0;
+static int _response = -1;
+static char _traceparent[55+1];
+
+static uint64_t _random64(void);
+static uint64_t _now(void);
+static bool _parse_traceparent(const char *str);
+static bool _unhex(const char *str, uint8_t *buf, size_t size);
+static void _tohex(char *str, const uint8_t *buf, size_t size);
+static size_t _json(char *buf, size_t size);
+
+#endif
+
+/**
+ * Open the trace file and set the sampling rate.
+ *
+ * @param filepath  file which spans are appended to.
+ * @param rate      ratio of requests sampled without an incoming trace
+ *                  context, 0.0 to 1.0.
+ *
+ * @return  true if successful, otherwise returns false.
+ */
+bool qcgitrace_init(const char *filepath, double rate)
+{
+    if (filepath == NULL) return false;
+
+    int fd = open(filepath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, DEF_FILE_MODE);
+    if (fd < 0) {
+        WARN("Can't open trace file %s.", filepath);
+        return false;
+    }
+    if (_fd >= 0) close(_fd);
+
+    _fd = fd;
+    _rate = (rate < 0) ? 0 : (rate > 1) ? 1 : rate;
+    return true;
+}
+
+/**
+ * Start the trace of a request. Call this before qcgireq_parse().
+ *
+ * @return  true if the request is sampled, otherwise returns false.
+ *
+ * @note
+ * The trace id and the sampled flag are taken from HTTP_TRACEPARENT.
+ * HTTP_TRACESTATE is kept as it is.
+ */
+bool qcgitrace_begin(void)
+{
+    if (_nspans > 0) qcgitrace_end();  // previous request
+
+    _sampled = false;
+    _response = -1;
+    _tracestate[0] = '\0';
+
+    const char *traceparent = getenv("HTTP_TRACEPARENT");
+    if (traceparent != NULL && _parse_traceparent(traceparent) == true) {
+        const char *tracestate = getenv("HTTP_TRACESTATE");
+        if (tracestate != NULL) {
+            _q_strcpy(_tracestate, sizeof(_tracestate), tracestate);
+        }
+    } else {
+        uint64_t hi = _random64(), lo = _random64();
+        int i;
+        for (i = 0; i < 8; i++) {
+            _traceid[i] = hi >> (56 - i * 8);
+            _traceid[8 + i] = lo >> (56 - i * 8);
+        }
+        _parentid = 0;
+        _flags = ((double)(_random64() >> 11) / (1ULL << 53) < _rate) ?
+                 TRACE_FLAG_SAMPLED : 0;
+    }
+
+    // the request span
+    _spans[0].name = "request";
+    _spans[0].id = _random64();
+    _spans[0].start = _now();
+    _spans[0].end = 0;
+    _nspans = 1;
+
+    // traceparent for the calls made by this request.
+    char hex[32+1];
+    _tohex(hex, _traceid, sizeof(_traceid));
+    snprintf(_traceparent, sizeof(_traceparent), "00-%s-%016llx-%02x", hex,
+             (unsigned long long)_spans[0].id, _flags);
+
+    _sampled = (_fd >= 0 && (_flags & TRACE_FLAG_SAMPLED) != 0);
+    return _sampled;
+}
+
+/**
+ * Get the traceparent header value to propagate the trace context to other
+ * services, with the span of this request as the parent.
+ *
+ * @return  a pointer of traceparent string, NULL if qcgitrace_begin()
+ *          wasn't called.
+ *
+ * @note Do not free manually
+ */
+const char *qcgitrace_traceparent(void)
+{
+    if (_nspans == 0) return NULL;
+    return _traceparent;
+}
+
+/**
+ * Finish the trace of the request and write the spans if it's sampled.
+ */
+void qcgitrace_end(void)
+{
+    if (_nspans == 0) return;
+
+    if (_sampled == true) {
+        uint64_t now = _now();
+        int i, num = __atomic_load_n(&_nspans, __ATOMIC_ACQUIRE);
+        if (num > TRACE_MAX_SPANS) num = TRACE_MAX_SPANS;
+        for (i = 0; i < num; i++) {
+            if (_spans[i].end == 0) _spans[i].end = now;
+        }
+
+        size_t size = 1024 + (TRACE_MAX_STATE * 2)
+                      + (num * (256 + TRACE_MAX_STATE));
+
+        // the strings from the environment, 6 bytes each when escaped.
+        static const char *envs[] = {
+            "SCRIPT_NAME", "REQUEST_METHOD", "REQUEST_URI", NULL
+        };
+        for (i = 0; envs[i] != NULL; i++) {
+            const char *value = getenv(envs[i]);
+            if (value != NULL) size += strlen(value) * 6;
+        }
+        char *buf = (char *)malloc(size);
+        if (buf != NULL) {
+            size_t len = _json(buf, size);
+            if (len > 0 && write(_fd, buf, len) != (ssize_t)len) {
+                WARN("Can't write trace file.");
+            }
+            free(buf);
+        }
+    }
+
+    _sampled = false;
+    _nspans = 0;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+/*
+ * Start a span under the request span.
+ *
+ * @return  span handle for _q_trace_stop(), -1 if not sampled.
+ */
+int _q_trace_start(const char *name)
+{
+    if (_sampled == false) return -1;
+
+    int i = __atomic_fetch_add(&_nspans, 1, __ATOMIC_ACQ_REL);
+    if (i >= TRACE_MAX_SPANS) return -1;
+
+    _spans[i].name = name;
+    _spans[i].id = _random64();
+    _spans[i].end = 0;
+    _spans[i].start = _now();
+    return i;
+}
+
+void _q_trace_stop(int span)
+{
+    if (span < 0 || _sampled == false) return;
+    _spans[span].end = _now();
+}
+
+// the response span, from the headers to the end of the request.
+void _q_trace_response(void)
+{
+    if (_sampled == false || _response >= 0) return;
+    _response = _q_trace_start("response");
+}
+
+static uint64_t _random64(void)
+{
+    // xorshift64*, seeded per process.
+    if (_rand == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        _rand = ((uint64_t)ts.tv_nsec << 32) ^ ts.tv_sec
+                ^ ((uint64_t)getpid() << 16) ^ (uintptr_t)&ts;
+        int fd = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+        if (fd >= 0) {
+            uint64_t seed;
+            if (read(fd, &seed, sizeof(seed)) == sizeof(seed)) _rand ^= seed;
+            close(fd);
+        }
+        if (_rand == 0) _rand = 0x9e3779b97f4a7c15ULL;
+    }
+
+    uint64_t x = __atomic_load_n(&_rand, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = x;
+        next ^= next >> 12;
+        next ^= next << 25;
+        next ^= next >> 27;
+    } while (!__atomic_compare_exchange_n(&_rand, &x, next, false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return next * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// version-traceid-parentid-flags, version 00 or a future one.
+static bool _parse_traceparent(const char *str)
+{
+    uint8_t version, parent[8];
+    size_t len = strlen(str);
+    if (len < 55 || str[2] != '-' || str[35] != '-' || str[52] != '-') {
+        return false;
+    }
+    if (_unhex(str, &version, 1) == false || version == 0xff) return false;
+    if (version == 0 && len != 55) return false;
+    if (version != 0 && len > 55 && str[55] != '-') return false;
+
+    uint8_t traceid[16];
+    if (_unhex(str + 3, traceid, 16) == false
+        || _unhex(str + 36, parent, 8) == false
+        || _unhex(str + 53, &_flags, 1) == false) {
+        return false;
+    }
+
+    // all zero ids are invalid.
+    int i;
+    uint8_t any = 0;
+    for (i = 0; i < 16; i++) any |= traceid[i];
+    if (any == 0) return false;
+    for (i = 0, _parentid = 0; i < 8; i++) _parentid = (_parentid << 8) | parent[i];
+    if (_parentid == 0) return false;
+
+    memcpy(_traceid, traceid, sizeof(traceid));
+    return true;
+}
+
+static bool _unhex(const char *str, uint8_t *buf, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size * 2; i++) {
+        char c = str[i];
+        int v;
+        if (c >= '0' && c <= '9') v = c - '0';
+        else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+        else return false;  // lowercase only
+        if (i % 2 == 0) buf[i / 2] = v << 4;
+        else buf[i / 2] |= v;
+    }
+    return true;
+}
+
+static void _tohex(char *str, const uint8_t *buf, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) sprintf(str + (i * 2), "%02x", buf[i]);
+}
+
+// append a JSON string, escaping quotes and control characters.
+static size_t _jsonstr(char *buf, size_t size, const char *str)
+{
+    size_t n = 0;
+    if (n < size) buf[n++] = '"';
+    for (; *str != '\0' && n + 7 < size; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(buf + n, size - n, "\\u%04x", c);
+        } else {
+            buf[n++] = c;
+        }
+    }
+    if (n < size) buf[n++] = '"';
+    return n;
+}
+
+#define APPEND(fmt, args...)                                            \
+    do {                                                                \
+        if (n < size) n += snprintf(buf + n, size - n, fmt, ##args);    \
+    } while(0)
+
+// one line of OTLP-JSON(ExportTraceServiceRequest).
+static size_t _json(char *buf, size_t size)
+{
+    size_t n = 0;
+    char traceid[32+1];
+    _tohex(traceid, _traceid, sizeof(_traceid));
+
+    const char *service = getenv("SCRIPT_NAME");
+    APPEND("{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+           "{\"key\":\"service.name\",\"value\":{\"stringValue\":");
+    if (n < size) n += _jsonstr(buf + n, size - n,
+                                (service != NULL) ? service : _Q_PRGNAME);
+    APPEND("}}]},\"scopeSpans\":[{\"scope\":{\"name\":\"%s\","
+           "\"version\":\"%s\"},\"spans\":[", _Q_PRGNAME, _Q_VERSION);
+
+    int i, num = (_nspans < TRACE_MAX_SPANS) ? _nspans : TRACE_MAX_SPANS;
+    for (i = 0; i < num; i++) {
+        struct _span *span = &_spans[i];
+        uint64_t parent = (i == 0) ? _parentid : _spans[0].id;
+
+        APPEND("%s{\"traceId\":\"%s\",\"spanId\":\"%016llx\"",
+               (i > 0) ? "," : "", traceid, (unsigned long long)span->id);
+        if (parent != 0) {
+            APPEND(",\"parentSpanId\":\"%016llx\"", (unsigned long long)parent);
+        }
+        if (_tracestate[0] != '\0') {
+            APPEND(",\"traceState\":");
+            if (n < size) n += _jsonstr(buf + n, size - n, _tracestate);
+        }
+        APPEND(",\"name\":\"%s\",\"kind\":%d,\"startTimeUnixNano\":\"%llu\","
+               "\"endTimeUnixNano\":\"%llu\"", span->name, (i == 0) ? 2 : 1,
+               (unsigned long long)span->start,
+               (unsigned long long)span->end);
+
+        if (i == 0) {
+            const char *method = getenv("REQUEST_METHOD");
+            const char *uri = getenv("REQUEST_URI");
+            APPEND(",\"attributes\":[{\"key\":\"http.request.method\","
+                   "\"value\":{\"stringValue\":");
+            if (n < size) n += _jsonstr(buf + n, size - n,
+                                        (method != NULL) ? method : "");
+            char path[PATH_MAX];
+            _q_strcpy(path, sizeof(path), (uri != NULL) ? uri : "");
+            char *query = strchr(path, '?');
+            if (query != NULL) *query = '\0';
+            APPEND("}},{\"key\":\"url.path\",\"value\":{\"stringValue\":");
+            if (n < size) n += _jsonstr(buf + n, size - n, path);
+            APPEND("}}]");
+        }
+        APPEND("}");
+    }
+    APPEND("]}]}]}\n");
+
+    if (n >= size) {
+        WARN("Trace record is too large.");
+        return 0;
+    }
+    return n;
+}
+
+#endif /* _DOXYGEN_SKIP */
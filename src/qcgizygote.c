@@ -0,0 +1,405 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * @file qcgizygote.c Fork-server(zygote) API for plain CGI
+ *
+ * Where FastCGI can't be used, every request pays for exec, dynamic linking
+ * and the program's own initialization. In zygote mode, a resident program
+ * initializes once and forks a ready child per request. The web server runs
+ * a tiny shim instead, which hands its environment and stdin/stdout/stderr
+ * over a Unix domain socket(SCM_RIGHTS) to the zygote, then waits until the
+ * child is finished.
+ *
+ * @code
+ *   [resident program, see examples/zygote.c]
+ *   int main(void)
+ *   {
+ *     load_config();  // expensive initialization, done once.
+ *
+ *     // returns only in the forked child, with the request's environment
+ *     // and stdin/stdout/stderr in place.
+ *     if (qcgizygote_accept("/var/run/app.sock") == false) return 1;
+ *
+ *     qentry_t *req = qcgireq_parse(NULL, 0);
+ *     (...)
+ *     return 0;
+ *   }
+ *
+ *   [CGI shim, see examples/zygote-shim.c]
+ *   int main(void)
+ *   {
+ *     return qcgizygote_shim("/var/run/app.sock");
+ *   }
+ * @endcode
+ *
+ * @note
+ * The socket is created with mode 0600 and only processes running as the
+ * zygote's user are served (SO_PEERCRED), so the shim must run as the same
+ * user, like with suEXEC. The exit status of the child is passed back to
+ * the shim.
+ */
+
+#ifdef ENABLE_FASTCGI
+#include "fcgi_stdio.h"
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "qdecoder.h"
+#include "internal.h"
+
+#ifndef _DOXYGEN_SKIP
+
+#define ZYGOTE_MAGIC        (0x515a5947)    /* "QZYG" */
+#define ZYGOTE_MAX_ENV      (1024 * 1024)
+#define ZYGOTE_NFDS         (3)
+
+extern char **environ;
+
+struct _hello {
+    uint32_t magic;
+    uint32_t envsize;   /* bytes of "NAME=VALUE\0" strings that follow */
+};
+
+static int _sockaddr(struct sockaddr_un *addr, const char *sockpath);
+static bool _readall(int fd, void *buf, size_t size);
+static bool _writeall(int fd, const void *buf, size_t size);
+static bool _serve(int conn);
+static bool _peercheck(int conn);
+static void _waitchild(int conn, pid_t pid);
+
+#endif
+
+/**
+ * Listen on the socket and fork a child for each request handed by the shim.
+ *
+ * @param sockpath  Unix domain socket path.
+ *
+ * @return  true in the forked child, ready to handle the request.
+ *          false in the parent if the socket can't be set up. The parent
+ *          never returns otherwise.
+ *
+ * @note
+ * The child's environment is replaced by the one of the shim and its
+ * stdin, stdout and stderr are those of the shim. The child should just
+ * exit when it's done with the request.
+ */
+bool qcgizygote_accept(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    if (_sockaddr(&addr, sockpath) < 0) return false;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+
+    // owner only, no window with the default umask.
+    unlink(sockpath);
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (bound != 0 || chmod(sockpath, S_IRUSR | S_IWUSR) != 0
+        || listen(sock, SOMAXCONN) != 0) {
+        ERROR("Can't listen on %s. (errno=%d)", sockpath, errno);
+        close(sock);
+        return false;
+    }
+
+    // waiters are not waited for.
+    signal(SIGCHLD, SIG_IGN);
+
+    while (true) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            ERROR("Can't accept on %s. (errno=%d)", sockpath, errno);
+            sleep(1);
+            continue;
+        }
+        if (_peercheck(conn) == false) {
+            close(conn);
+            continue;
+        }
+
+        // a waiter forks the child and reports its exit status to the shim.
+        fflush(NULL);
+        pid_t waiter = fork();
+        if (waiter == 0) {
+            close(sock);
+            signal(SIGCHLD, SIG_DFL);
+            pid_t pid = fork();
+            if (pid == 0) {
+                if (_serve(conn) == false) _exit(EXIT_FAILURE);
+                return true;
+            }
+            if (pid < 0) {
+                ERROR("Can't fork. (errno=%d)", errno);
+                _exit(EXIT_FAILURE);
+            }
+            _waitchild(conn, pid);
+            _exit(EXIT_SUCCESS);
+        }
+
+        if (waiter < 0) ERROR("Can't fork. (errno=%d)", errno);
+        close(conn);
+    }
+
+    return false;
+}
+
+/**
+ * Hand the environment and stdin/stdout/stderr of this CGI process to the
+ * zygote, and wait until the request is finished.
+ *
+ * @param sockpath  Unix domain socket path of the zygote.
+ *
+ * @return  exit code for the shim. The exit code of the child, 128 plus
+ *          the signal number if it was killed, EXIT_FAILURE when the zygote
+ *          can't be reached or the status is lost.
+ */
+int qcgizygote_shim(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    if (_sockaddr(&addr, sockpath) < 0) return EXIT_FAILURE;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return EXIT_FAILURE;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    // environment block
+    size_t envsize = 0;
+    char **env;
+    for (env = environ; *env != NULL; env++) envsize += strlen(*env) + 1;
+    if (envsize > ZYGOTE_MAX_ENV) {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    // header with our stdin, stdout and stderr
+    struct _hello hello = { ZYGOTE_MAGIC, envsize };
+    struct iovec iov = { &hello, sizeof(hello) };
+    int fds[ZYGOTE_NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+    memset(&cmsg, 0, sizeof(cmsg));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, 0);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != sizeof(hello)) {
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    for (env = environ; *env != NULL; env++) {
+        if (_writeall(sock, *env, strlen(*env) + 1) == false) {
+            close(sock);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the waiter sends the wait status when the child exits.
+    int32_t status;
+    bool received = _readall(sock, &status, sizeof(status));
+    close(sock);
+
+    if (received == false) return EXIT_FAILURE;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return EXIT_FAILURE;
+}
+
+#ifndef _DOXYGEN_SKIP
+
+static int _sockaddr(struct sockaddr_un *addr, const char *sockpath)
+{
+    if (sockpath == NULL || strlen(sockpath) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, sockpath);
+
+    return 0;
+}
+
+static bool _readall(int fd, void *buf, size_t size)
+{
+    char *cp = (char *)buf;
+    while (size > 0) {
+        ssize_t n = read(fd, cp, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        cp += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool _writeall(int fd, const void *buf, size_t size)
+{
+    const char *cp = (const char *)buf;
+    while (size > 0) {
+        ssize_t n = write(fd, cp, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        cp += n;
+        size -= n;
+    }
+    return true;
+}
+
+// in the child: take over the shim's environment and fds.
+static bool _serve(int conn)
+{
+    struct _hello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    int fds[ZYGOTE_NFDS];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(hello) || hello.magic != ZYGOTE_MAGIC
+        || hello.envsize > ZYGOTE_MAX_ENV || c == NULL
+        || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS
+        || c->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        WARN("Invalid zygote request.");
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(fds));
+
+    // the environment strings must live until exit.
+    char *envblock = (char *)malloc(hello.envsize + 1);
+    if (envblock == NULL || _readall(conn, envblock, hello.envsize) == false) {
+        return false;
+    }
+    envblock[hello.envsize] = '\0';
+
+    clearenv();
+    char *cp;
+    for (cp = envblock; cp < envblock + hello.envsize; cp += strlen(cp) + 1) {
+        if (strchr(cp, '=') != NULL) putenv(cp);
+    }
+
+    // move them out of the way first, in case the zygote had 0-2 closed.
+    int i;
+    for (i = 0; i < ZYGOTE_NFDS; i++) {
+        if (fds[i] >= ZYGOTE_NFDS) continue;
+        fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, ZYGOTE_NFDS);
+        if (fds[i] < 0) return false;
+    }
+    for (i = 0; i < ZYGOTE_NFDS; i++) {
+        if (dup2(fds[i], i) < 0) return false;
+        close(fds[i]);
+    }
+
+    // the waiter keeps conn for the exit status.
+    close(conn);
+
+    return true;
+}
+
+// only the zygote's own user may hand requests over.
+static bool _peercheck(int conn)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0
+        || len != sizeof(cred)) {
+        WARN("Can't get the peer credentials. (errno=%d)", errno);
+        return false;
+    }
+    if (cred.uid != geteuid()) {
+        WARN("Zygote request from uid %d is refused.", (int)cred.uid);
+        return false;
+    }
+    return true;
+}
+
+static void _waitchild(int conn, pid_t pid)
+{
+    int status;
+    pid_t ret;
+    do {
+        ret = waitpid(pid, &status, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    int32_t out = (ret == pid) ? status : (EXIT_FAILURE << 8);
+    _writeall(conn, &out, sizeof(out));
+    close(conn);
+}
+
+#endif /* _DOXYGEN_SKIP */
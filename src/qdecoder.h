@@ -46,6 +46,7 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 /*
@@ -54,6 +55,9 @@ extern "C" {
 
 typedef struct qentry_s qentry_t;
 typedef struct qentobj_s qentobj_t;
+typedef struct qcgiroute_s qcgiroute_t;
+typedef struct qcgimultipart_s qcgimultipart_t;
+typedef struct qcgipack_s qcgipack_t;
 
 typedef enum {
     Q_CGI_ALL    = 0,
@@ -62,12 +66,48 @@ typedef enum {
     Q_CGI_GET    = 0x04
 } Q_CGI_T;
 
+typedef enum {
+    Q_UPLOAD_ROUNDROBIN = 0,
+    Q_UPLOAD_FREESPACE,
+    Q_UPLOAD_HASH
+} Q_UPLOAD_T;
+
+typedef enum {
+    Q_SCHED_AUTO = 0,
+    Q_SCHED_INTERACTIVE,
+    Q_SCHED_DEFAULT,
+    Q_SCHED_BULK,
+    Q_SCHED_MAX
+} Q_SCHED_T;
+
+typedef enum {
+    Q_LOG_NONE   = 0,
+    Q_LOG_ERROR,
+    Q_LOG_WARN,
+    Q_LOG_INFO,
+    Q_LOG_DEBUG
+} Q_LOG_T;
+
 /*
  * qcgireq.c
  */
 extern qentry_t *qcgireq_setoption(qentry_t *request, bool filemode,
                                    const char *basepath, int clearold);
+extern qentry_t *qcgireq_addvolume(qentry_t *request, const char *basepath);
+extern qentry_t *qcgireq_setplacement(qentry_t *request, Q_UPLOAD_T policy);
+extern qentry_t *qcgireq_setdurable(qentry_t *request, bool enable);
+extern qentry_t *qcgireq_setcompress(qentry_t *request,
+                                     const char *contenttype, int level);
+extern qentry_t *qcgireq_setprebody(qentry_t *request,
+                                    bool (*hook)(qentry_t *request,
+                                                 off_t length,
+                                                 const char *contenttype));
+extern qentry_t *qcgireq_setbracket(qentry_t *request, bool enable);
+extern qentry_t *qcgireq_setcharset(qentry_t *request, bool enable,
+                                    const char *charset);
 extern qentry_t *qcgireq_parse(qentry_t *request, Q_CGI_T method);
+extern int qcgireq_parsefile(qentry_t *request, const char *filepath,
+                             int threads);
 extern char *qcgireq_getquery(Q_CGI_T method);
 
 /*
@@ -85,6 +125,8 @@ extern const char *qcgires_getcontenttype(qentry_t *request);
 extern bool qcgires_redirect(qentry_t *request, const char *uri);
 extern int qcgires_download(qentry_t *request, const char *filepath,
                             const char *mimetype);
+extern int qcgires_downloadgzip(qentry_t *request, const char *filepath,
+                                const char *mimetype);
 extern void qcgires_error(qentry_t *request, char *format, ...);
 
 /*
@@ -96,6 +138,126 @@ extern const char *qcgisess_getid(qentry_t *session);
 extern time_t qcgisess_getcreated(qentry_t *session);
 extern bool qcgisess_save(qentry_t *session);
 extern bool qcgisess_destroy(qentry_t *session);
+extern bool qcgisess_setindex(qentry_t *session, const char *name);
+extern qentry_t *qcgisess_find(const char *dirpath, const char *name,
+                               const char *value);
+extern int qcgisess_destroyall(const char *dirpath, const char *name,
+                               const char *value);
+
+/*
+ * qcgilog.c
+ */
+extern void qcgilog_setlevel(Q_LOG_T level);
+extern Q_LOG_T qcgilog_getlevel(void);
+extern int qcgilog_dump(int fd);
+extern bool qcgilog_flusher(int fd, int interval_ms);
+extern bool qcgilog_crashdump(int fd);
+
+/*
+ * qcgimetrics.c
+ */
+extern bool qcgimetrics_init(const char *shmname);
+extern bool qcgimetrics_export(const char *shmname, FILE *out);
+
+/*
+ * qcgipack.c
+ */
+extern bool qcgipack_build(qentry_t *files, const char *filepath);
+extern qcgipack_t *qcgipack_open(const char *filepath);
+extern bool qcgipack_stat(qcgipack_t *pack, const char *name, off_t *length,
+                          time_t *mtime, const char **mimetype,
+                          const char **etag);
+extern int qcgipack_download(qentry_t *request, qcgipack_t *pack,
+                             const char *name);
+extern void qcgipack_free(qcgipack_t *pack);
+
+/*
+ * qcgicache.c
+ */
+extern bool qcgicache_init(int maxentries, size_t maxsize);
+extern qentry_t *qcgicache_query(qentry_t *request);
+
+/*
+ * qcgitrace.c
+ */
+extern bool qcgitrace_init(const char *filepath, double rate);
+extern bool qcgitrace_begin(void);
+extern const char *qcgitrace_traceparent(void);
+extern void qcgitrace_end(void);
+
+/*
+ * qcgisched.c
+ */
+extern bool qcgisched_init(const char *shmname, int limit);
+extern bool qcgisched_setclass(Q_SCHED_T cls, int weight, int target,
+                               int interval, int maxactive);
+extern bool qcgisched_begin(qentry_t *request, Q_SCHED_T cls);
+extern void qcgisched_end(void);
+
+/*
+ * qcgibody.c
+ */
+extern bool qcgibody_register(const char *contenttype,
+                              bool (*parser)(qentry_t *request,
+                                             const char *body, size_t size));
+extern qentry_t *qcgibody_setlimit(qentry_t *request, size_t maxsize,
+                                   int maxdepth);
+extern bool qcgibody_put(qentry_t *request, const char *name,
+                         const void *value, size_t size);
+extern bool qcgibody_msgpack(qentry_t *request, const char *body, size_t size);
+extern bool qcgibody_cbor(qentry_t *request, const char *body, size_t size);
+
+/*
+ * qcgimultipart.c
+ */
+extern qcgimultipart_t *qcgimultipart(const char *boundary);
+extern bool qcgimultipart_addfield(qcgimultipart_t *mp, const char *name,
+                                   const void *data, size_t size);
+extern bool qcgimultipart_addfile(qcgimultipart_t *mp, const char *name,
+                                  const char *filepath, const char *filename,
+                                  const char *contenttype);
+extern bool qcgimultipart_addfd(qcgimultipart_t *mp, const char *name, int fd,
+                                const char *filename, const char *contenttype);
+extern int qcgimultipart_addentry(qcgimultipart_t *mp, qentry_t *entry);
+extern const char *qcgimultipart_getcontenttype(qcgimultipart_t *mp);
+extern off_t qcgimultipart_getlength(qcgimultipart_t *mp);
+extern off_t qcgimultipart_write(qcgimultipart_t *mp, int fd);
+extern void qcgimultipart_free(qcgimultipart_t *mp);
+
+/*
+ * qcgizygote.c
+ */
+extern bool qcgizygote_accept(const char *sockpath);
+extern int qcgizygote_shim(const char *sockpath);
+
+/*
+ * qcgiroute.c
+ */
+extern qcgiroute_t *qcgiroute(void);
+extern bool qcgiroute_add(qcgiroute_t *router, const char *pattern, int id);
+extern int qcgiroute_match(qcgiroute_t *router, qentry_t *request,
+                           const char *path);
+extern void qcgiroute_free(qcgiroute_t *router);
+
+/*
+ * qcgiprogress.c
+ */
+extern bool qcgiprogress_init(const char *shmname, int slots);
+extern bool qcgiprogress_get(const char *token, off_t *received,
+                             off_t *expected);
+
+/*
+ * qcgiratelimit.c
+ */
+extern bool qcgiratelimit_init(const char *shmname, int buckets);
+extern bool qcgiratelimit_admit(qentry_t *request, const char *route,
+                                double rate, int burst);
+
+/*
+ * qcdb.c - Constant Database
+ */
+extern qentry_t *qcdb_open(const char *filepath);
+extern bool qcdb_build(qentry_t *entry, const char *filepath);
 
 /*
  * qentry.c - Linked-List Table
@@ -103,6 +265,7 @@ extern bool qcgisess_destroy(qentry_t *session);
 
 /* public functions */
 extern qentry_t *qEntry(void);
+extern uint32_t qentry_hash(const void *name, size_t size);
 
 /* qentry container */
 struct qentry_s {
@@ -148,6 +311,11 @@ struct qentry_s {
     int num;            /*!< number of objects */
     qentobj_t *first;   /*!< first object pointer */
     qentobj_t *last;    /*!< last object pointer */
+
+    /* public functions, added in 13 */
+    void *(*gethash) (qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem);
+    qentry_t *(*getchild) (qentry_t *entry, const char *name, bool create);
 };
 
 /* qentry object */
@@ -156,6 +324,8 @@ struct qentobj_s {
     void *data;          /*!< data object */
     size_t size;         /*!< object size */
     qentobj_t *next;     /*!< link pointer */
+    uint32_t hash;       /*!< qentry_hash() of the name */
+    qentry_t *child;     /*!< nested container, or NULL */
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,578 @@
+/******************************************************************************
+ * qDecoder - http://www.qdecoder.org
+ *
+ * Copyright (c) 2000-2012 Seungyoung Kim.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ ******************************************************************************
+ * $Id$
+ ******************************************************************************/
+
+/**
+ * qDecoder C++ Header file
+ *
+ * @file qdecoder.hpp
+ *
+ * Header-only C++17 wrapper. Accessors return std::string_view and byte
+ * views which borrow the storage of the underlying qentry_t container, so
+ * reading parameters doesn't allocate. Views are valid until the entry is
+ * removed or the container is freed.
+ *
+ * @code
+ *   qdecoder::request req;
+ *   qdecoder::response res(req);
+ *
+ *   res.setcontenttype("text/plain");
+ *   std::string_view color = req.str("color", "none");
+ *   int count = req.get<int>("count").value_or(1);
+ *
+ *   for (std::string_view item : req.values("item")) {
+ *     ...
+ *   }
+ *   for (const qdecoder::entry &e : req) {
+ *     ...
+ *   }
+ * @endcode
+ *
+ * String-literal keys can be hashed at compile time with the _qk literal.
+ * The hash is passed to qentry_t->gethash(), so a lookup costs integer
+ * compares plus one final strcmp().
+ *
+ * @code
+ *   using namespace qdecoder::literals;
+ *   std::string_view color = req.str("color"_qk, "none");
+ * @endcode
+ */
+
+#ifndef _QDECODER_HPP
+#define _QDECODER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <charconv>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if __cplusplus > 201703L && __has_include(<span>)
+#include <span>
+#endif
+#include "qdecoder.h"
+
+namespace qdecoder {
+
+#if defined(__cpp_lib_span)
+using bytes = std::span<const std::byte>;
+#else
+/* minimal std::span<const std::byte> for C++17 */
+class bytes {
+  public:
+    constexpr bytes() noexcept : _data(nullptr), _size(0) {}
+    constexpr bytes(const std::byte *data, std::size_t size) noexcept
+        : _data(data), _size(size) {}
+    constexpr const std::byte *data() const noexcept { return _data; }
+    constexpr std::size_t size() const noexcept { return _size; }
+    constexpr bool empty() const noexcept { return _size == 0; }
+    constexpr const std::byte *begin() const noexcept { return _data; }
+    constexpr const std::byte *end() const noexcept { return _data + _size; }
+    constexpr const std::byte &operator[](std::size_t i) const noexcept {
+        return _data[i];
+    }
+  private:
+    const std::byte *_data;
+    std::size_t _size;
+};
+#endif
+
+#if defined(__cpp_consteval)
+#define QDECODER_CONSTEVAL consteval
+#else
+#define QDECODER_CONSTEVAL constexpr
+#endif
+
+/* same as qentry_hash() */
+constexpr std::uint32_t hash(std::string_view name) noexcept {
+    std::uint32_t h = 2166136261U;
+    for (char c : name) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* key name with precomputed hash. made by _qk, name is '\0' terminated. */
+struct key {
+    const char *name;
+    std::size_t len;
+    std::uint32_t hash;
+
+    std::string_view view() const noexcept {
+        return std::string_view(name, len);
+    }
+};
+
+#if !defined(__cpp_consteval) && defined(__GNUC__)
+namespace detail {
+
+/* a literal's name and hash as constants, C++17 can't force a constexpr call */
+template <typename C, C... cs>
+struct literal {
+    static constexpr char name[] = {cs..., '\0'};
+    static constexpr std::uint32_t hash =
+        qdecoder::hash(std::string_view(name, sizeof...(cs)));
+};
+
+}  // namespace detail
+#endif
+
+namespace literals {
+
+#if !defined(__cpp_consteval) && defined(__GNUC__)
+/* "name"_qk, hashed at compile time. string literal operator templates are a
+   GNU extension supported by gcc and clang. */
+#pragma GCC diagnostic push
+#if defined(__clang__)
+#pragma GCC diagnostic ignored "-Wgnu-string-literal-operator-template"
+#else
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+template <typename C, C... cs>
+constexpr key operator""_qk() noexcept {
+    static_assert(sizeof(C) == 1, "_qk needs a narrow string literal");
+    return key{detail::literal<C, cs...>::name, sizeof...(cs),
+               detail::literal<C, cs...>::hash};
+}
+#pragma GCC diagnostic pop
+#else
+/* "name"_qk, hashed at compile time */
+QDECODER_CONSTEVAL key operator""_qk(const char *name, std::size_t len) {
+    return key{name, len, qdecoder::hash(std::string_view(name, len))};
+}
+#endif
+
+}  // namespace literals
+
+/* thrown when a request or session can't be made */
+class error : public std::runtime_error {
+  public:
+    explicit error(const char *what) : std::runtime_error(what) {}
+};
+
+namespace detail {
+
+inline bool namematch(const char *name, std::string_view key) noexcept {
+    return std::strncmp(name, key.data(), key.size()) == 0
+           && name[key.size()] == '\0';
+}
+
+// the library appends '\0' to strings and parsed values.
+inline std::size_t datasize(const qentobj_t *obj) noexcept {
+    const char *data = static_cast<const char *>(obj->data);
+    if (obj->size > 0 && data[obj->size - 1] == '\0') return obj->size - 1;
+    return obj->size;
+}
+
+}  // namespace detail
+
+/* one stored object */
+struct entry {
+    const qentobj_t *obj;
+
+    std::string_view name() const noexcept { return obj->name; }
+    std::string_view str() const noexcept {
+        return std::string_view(static_cast<const char *>(obj->data),
+                                detail::datasize(obj));
+    }
+    qdecoder::bytes bytes() const noexcept {
+        return qdecoder::bytes(static_cast<const std::byte *>(obj->data),
+                               detail::datasize(obj));
+    }
+};
+
+/* forward iterator over objects, optionally only the ones named key */
+class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = entry;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const entry *;
+    using reference = const entry &;
+
+    iterator() noexcept : _cur{nullptr}, _key(), _hash(0), _filter(false) {}
+    iterator(const qentobj_t *obj, std::string_view key, bool filter) noexcept
+        : _cur{obj}, _key(key), _hash(qdecoder::hash(key)), _filter(filter) {
+        skip();
+    }
+    iterator(const qentobj_t *obj, const key &k) noexcept
+        : _cur{obj}, _key(k.view()), _hash(k.hash), _filter(true) { skip(); }
+
+    reference operator*() const noexcept { return _cur; }
+    pointer operator->() const noexcept { return &_cur; }
+    iterator &operator++() noexcept {
+        _cur.obj = _cur.obj->next;
+        skip();
+        return *this;
+    }
+    iterator operator++(int) noexcept {
+        iterator tmp = *this;
+        ++*this;
+        return tmp;
+    }
+    bool operator==(const iterator &o) const noexcept {
+        return _cur.obj == o._cur.obj;
+    }
+    bool operator!=(const iterator &o) const noexcept {
+        return _cur.obj != o._cur.obj;
+    }
+
+  private:
+    void skip() noexcept {
+        if (_filter == false) return;
+        while (_cur.obj != nullptr
+               && (_cur.obj->hash != _hash
+                   || detail::namematch(_cur.obj->name, _key) == false)) {
+            _cur.obj = _cur.obj->next;
+        }
+    }
+
+    entry _cur;
+    std::string_view _key;
+    std::uint32_t _hash;
+    bool _filter;
+};
+
+/* range of string values of one key */
+class values {
+  public:
+    class iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = std::string_view;
+
+        explicit iterator(qdecoder::iterator it) noexcept : _it(it) {}
+        std::string_view operator*() const noexcept { return _it->str(); }
+        iterator &operator++() noexcept { ++_it; return *this; }
+        bool operator==(const iterator &o) const noexcept {
+            return _it == o._it;
+        }
+        bool operator!=(const iterator &o) const noexcept {
+            return _it != o._it;
+        }
+      private:
+        qdecoder::iterator _it;
+    };
+
+    values(const qentobj_t *first, std::string_view name) noexcept
+        : _first(first), _key{name.data(), name.size(), qdecoder::hash(name)} {}
+    values(const qentobj_t *first, const key &k) noexcept
+        : _first(first), _key(k) {}
+    iterator begin() const noexcept {
+        return iterator(qdecoder::iterator(_first, _key));
+    }
+    iterator end() const noexcept { return iterator(qdecoder::iterator()); }
+
+  private:
+    const qentobj_t *_first;
+    key _key;
+};
+
+/*
+ * non-owning view of a qentry_t container
+ *
+ * Iteration, values() and find() walk the objects through first/next.
+ * Containers from qcdb_open() don't link their objects, so these see them
+ * empty; use str(), bytes(), get() and has() which go through the lookup
+ * functions of the container.
+ */
+class container {
+  public:
+    explicit container(qentry_t *entry) noexcept : _entry(entry) {}
+
+    qentry_t *raw() const noexcept { return _entry; }
+    int size() const noexcept { return _entry->num; }
+
+    iterator begin() const noexcept {
+        return iterator(_entry->first, std::string_view(), false);
+    }
+    iterator end() const noexcept { return iterator(); }
+    qdecoder::values values(std::string_view key) const noexcept {
+        return qdecoder::values(_entry->first, key);
+    }
+    qdecoder::values values(const key &k) const noexcept {
+        return qdecoder::values(_entry->first, k);
+    }
+
+    /* first object named key, nullptr if not found */
+    const qentobj_t *find(std::string_view key) const noexcept {
+        std::uint32_t h = qdecoder::hash(key);
+        for (const qentobj_t *obj = _entry->first; obj; obj = obj->next) {
+            if (obj->hash == h && detail::namematch(obj->name, key)) return obj;
+        }
+        return nullptr;
+    }
+    bool has(std::string_view key) const noexcept {
+        if (linked() == false) return bytes(key).has_value();
+        return find(key) != nullptr;
+    }
+    bool has(const key &k) const noexcept {
+        return _entry->gethash(_entry, k.name, k.hash, nullptr, false)
+               != nullptr;
+    }
+
+    /* nested container of bracket notation names. (qcgireq_setbracket) */
+    std::optional<container> child(std::string_view key) const {
+        qentry_t *c = _entry->getchild(_entry, std::string(key).c_str(),
+                                       false);
+        if (c == nullptr) return std::nullopt;
+        return container(c);
+    }
+
+    std::optional<std::string_view> str(std::string_view key) const noexcept {
+        auto b = bytes(key);
+        if (!b) return std::nullopt;
+        return std::string_view(reinterpret_cast<const char *>(b->data()),
+                                b->size());
+    }
+    std::string_view str(std::string_view key,
+                         std::string_view def) const noexcept {
+        return str(key).value_or(def);
+    }
+    std::optional<qdecoder::bytes> bytes(std::string_view key) const noexcept {
+        if (linked() == false) {
+            // lookup by the container, the name must be terminated.
+            std::string name;
+            try {
+                name.assign(key);
+            } catch (...) {
+                return std::nullopt;
+            }
+            return bytes(qdecoder::key{name.c_str(), name.size(),
+                                       qdecoder::hash(key)});
+        }
+        const qentobj_t *obj = find(key);
+        if (obj == nullptr) return std::nullopt;
+        return entry{obj}.bytes();
+    }
+
+    /* lookups by precomputed hash */
+    std::optional<std::string_view> str(const key &k) const noexcept {
+        auto b = bytes(k);
+        if (!b) return std::nullopt;
+        return std::string_view(reinterpret_cast<const char *>(b->data()),
+                                b->size());
+    }
+    std::string_view str(const key &k, std::string_view def) const noexcept {
+        return str(k).value_or(def);
+    }
+    std::optional<qdecoder::bytes> bytes(const key &k) const noexcept {
+        std::size_t size;
+        const char *data = static_cast<const char *>(
+            _entry->gethash(_entry, k.name, k.hash, &size, false));
+        if (data == nullptr) return std::nullopt;
+        if (size > 0 && data[size - 1] == '\0') size--;
+        return qdecoder::bytes(reinterpret_cast<const std::byte *>(data), size);
+    }
+    template <class T>
+    std::optional<T> get(const key &k) const noexcept {
+        static_assert(std::is_arithmetic<T>::value, "arithmetic type only");
+        auto sv = str(k);
+        if (!sv) return std::nullopt;
+        return convert<T>(*sv);
+    }
+
+    /* typed getter. nullopt if not found or not entirely a number. */
+    template <class T>
+    std::optional<T> get(std::string_view key) const noexcept {
+        static_assert(std::is_arithmetic<T>::value, "arithmetic type only");
+        auto sv = str(key);
+        if (!sv) return std::nullopt;
+        return convert<T>(*sv);
+    }
+
+    template <class T>
+    static std::optional<T> convert(std::string_view str) noexcept {
+        T value{};
+        const char *first = str.data(), *last = str.data() + str.size();
+        if constexpr (std::is_same<T, bool>::value) {
+            if (str == "1" || str == "true" || str == "on") return true;
+            if (str == "0" || str == "false" || str == "off") return false;
+            return std::nullopt;
+        } else if constexpr (std::is_integral<T>::value) {
+            auto res = std::from_chars(first, last, value);
+            if (res.ec != std::errc() || res.ptr != last) return std::nullopt;
+            return value;
+        } else {
+#if defined(__cpp_lib_to_chars)
+            auto res = std::from_chars(first, last, value);
+            if (res.ec != std::errc() || res.ptr != last) return std::nullopt;
+            return value;
+#else
+            // stored strings are always terminated.
+            char *end;
+            value = static_cast<T>(std::strtod(first, &end));
+            if (end != last || str.empty()) return std::nullopt;
+            return value;
+#endif
+        }
+    }
+
+    bool put(std::string_view key, const void *data, std::size_t size,
+             bool replace = true) {
+        return _entry->put(_entry, std::string(key).c_str(), data, size,
+                           replace);
+    }
+    bool putstr(std::string_view key, std::string_view value,
+                bool replace = true) {
+        return _entry->putstr(_entry, std::string(key).c_str(),
+                              std::string(value).c_str(), replace);
+    }
+    int remove(std::string_view key) {
+        return _entry->remove(_entry, std::string(key).c_str());
+    }
+
+  protected:
+    // false for containers which don't link their objects, like qcdb.
+    bool linked() const noexcept {
+        return _entry->first != nullptr || _entry->num == 0;
+    }
+
+    qentry_t *_entry;
+};
+
+/* owning qentry_t */
+class entries : public container {
+  public:
+    entries() : container(qEntry()) {
+        if (_entry == nullptr) throw std::bad_alloc();
+    }
+    explicit entries(qentry_t *entry, const char *what = "qEntry()")
+        : container(entry) {
+        if (_entry == nullptr) throw error(what);
+    }
+    entries(const entries &) = delete;
+    entries &operator=(const entries &) = delete;
+    entries(entries &&o) noexcept : container(std::exchange(o._entry, nullptr)) {}
+    entries &operator=(entries &&o) noexcept {
+        if (this != &o) {
+            reset();
+            _entry = std::exchange(o._entry, nullptr);
+        }
+        return *this;
+    }
+    ~entries() { reset(); }
+
+    /* give up the ownership */
+    qentry_t *release() noexcept { return std::exchange(_entry, nullptr); }
+
+  private:
+    void reset() noexcept {
+        if (_entry != nullptr) _entry->free(_entry);
+        _entry = nullptr;
+    }
+};
+
+/* parsed CGI request, qcgireq_parse() */
+class request : public entries {
+  public:
+    explicit request(Q_CGI_T method = Q_CGI_ALL)
+        : entries(qcgireq_parse(nullptr, method), "qcgireq_parse()") {}
+
+    /* qcgireq_setoption() then qcgireq_parse() */
+    request(const char *basepath, int clearold, Q_CGI_T method = Q_CGI_ALL)
+        : entries(parse(qcgireq_setoption(nullptr, true, basepath, clearold),
+                        method), "qcgireq_setoption()") {}
+
+  private:
+    static qentry_t *parse(qentry_t *req, Q_CGI_T method) {
+        if (req == nullptr) return nullptr;
+        return qcgireq_parse(req, method);
+    }
+};
+
+/* user session, qcgisess_init() */
+class session : public entries {
+  public:
+    explicit session(request &req, const char *dirpath = nullptr)
+        : entries(qcgisess_init(req.raw(), dirpath), "qcgisess_init()") {}
+
+    std::string_view id() const noexcept {
+        const char *id = qcgisess_getid(_entry);
+        return (id != nullptr) ? std::string_view(id) : std::string_view();
+    }
+    time_t created() const noexcept { return qcgisess_getcreated(_entry); }
+    bool settimeout(time_t seconds) noexcept {
+        return qcgisess_settimeout(_entry, seconds);
+    }
+    bool save() noexcept { return qcgisess_save(_entry); }
+
+    /* remove session data permanently. the object becomes empty. */
+    bool destroy() noexcept { return qcgisess_destroy(release()); }
+};
+
+/* CGI response, qcgires_*() */
+class response {
+  public:
+    explicit response(request &req) noexcept : _req(req.raw()) {}
+
+    bool setcookie(const char *name, const char *value, int expire = 0,
+                   const char *path = nullptr, const char *domain = nullptr,
+                   bool secure = false) noexcept {
+        return qcgires_setcookie(_req, name, value, expire, path, domain,
+                                 secure);
+    }
+    bool removecookie(const char *name, const char *path = nullptr,
+                      const char *domain = nullptr,
+                      bool secure = false) noexcept {
+        return qcgires_removecookie(_req, name, path, domain, secure);
+    }
+    bool setcontenttype(const char *mimetype) noexcept {
+        return qcgires_setcontenttype(_req, mimetype);
+    }
+    std::optional<std::string_view> getcontenttype() const noexcept {
+        const char *mimetype = qcgires_getcontenttype(_req);
+        if (mimetype == nullptr) return std::nullopt;
+        return std::string_view(mimetype);
+    }
+    bool redirect(const char *uri) noexcept {
+        return qcgires_redirect(_req, uri);
+    }
+    int download(const char *filepath, const char *mimetype = nullptr) noexcept {
+        return qcgires_download(_req, filepath, mimetype);
+    }
+
+  private:
+    qentry_t *_req;
+};
+
+}  // namespace qdecoder
+
+#endif  /* _QDECODER_HPP */
@@ -119,6 +119,13 @@ static int _load(qentry_t *entry, const char *filepath);
 static bool _print(qentry_t *entry, FILE *out, bool print_data);
 static bool _free(qentry_t *entry);
 
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem);
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create);
+
+static bool _print_tree(qentry_t *entry, FILE *out, bool print_data,
+                        const char *prefix);
+
 #endif
 
 /**
@@ -170,9 +177,39 @@ qentry_t *qEntry(void)
     entry->print        = _print;
     entry->free         = _free;
 
+    entry->gethash      = _gethash;
+    entry->getchild     = _getchild;
+
     return entry;
 }
 
+/**
+ * Get the hash value of a key name. (32-bit FNV-1a)
+ *
+ * Every object keeps this hash of its name, so lookups compare the hash
+ * first and call strcmp() only on a hash match.
+ *
+ * @param name  key name
+ * @param size  length of the name. (without '\0')
+ *
+ * @return  hash value
+ *
+ * @code
+ *   uint32_t hash = qentry_hash("color", 5);
+ *   char *color = entry->gethash(entry, "color", hash, NULL, false);
+ * @endcode
+ */
+uint32_t qentry_hash(const void *name, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)name;
+    uint32_t hash = 2166136261U;
+    for (; size > 0; size--, p++) {
+        hash ^= *p;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 /**
  * qentry_t->put(): Store object into linked-list structure.
  *
@@ -216,6 +253,8 @@ static bool _put(qentry_t *entry, const char *name,
     obj->data = dup_data;
     obj->size = size;
     obj->next = NULL;
+    obj->hash = qentry_hash(dup_name, strlen(dup_name));
+    obj->child = NULL;
 
     // if replace flag is set, remove same key
     if (replace == true) _remove(entry, dup_name);
@@ -325,25 +364,7 @@ static bool _putint(qentry_t *entry, const char *name, int num, bool replace)
 static void *_get(qentry_t *entry, const char *name, size_t *size, bool newmem)
 {
     if (entry == NULL || name == NULL) return NULL;
-
-    void *data = NULL;
-    qentobj_t *obj;
-    for (obj = entry->first; obj; obj = obj->next) {
-        if (!strcmp(obj->name, name)) {
-            if (size != NULL) *size = obj->size;
-
-            if (newmem == true) {
-                data = malloc(obj->size);
-                memcpy(data, obj->data, obj->size);
-            } else {
-                data = obj->data;
-            }
-
-            break;
-        }
-    }
-
-    return data;
+    return _gethash(entry, name, qentry_hash(name, strlen(name)), size, newmem);
 }
 
 /**
@@ -365,10 +386,11 @@ static void *_getlast(qentry_t *entry, const char *name, size_t *size,
 {
     if (entry == NULL || name == NULL) return NULL;
 
+    uint32_t hash = qentry_hash(name, strlen(name));
     qentobj_t *lastobj = NULL;
     qentobj_t *obj;
     for (obj = entry->first; obj; obj = obj->next) {
-        if (!strcmp(name, obj->name)) lastobj = obj;
+        if (obj->hash == hash && !strcmp(name, obj->name)) lastobj = obj;
     }
 
     void *data = NULL;
@@ -587,10 +609,13 @@ static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
     // if obj->name is NULL, it means this is first call.
     if (obj->name == NULL) obj->next = entry->first;
 
+    uint32_t hash = (name != NULL) ? qentry_hash(name, strlen(name)) : 0;
     qentobj_t *cont;
     bool ret = false;
     for (cont = obj->next; cont; cont = cont->next) {
-        if (name != NULL && strcmp(cont->name, name)) continue;
+        if (name != NULL && (cont->hash != hash || strcmp(cont->name, name))) {
+            continue;
+        }
 
         if (newmem == true) {
             obj->name = strdup(cont->name);
@@ -602,6 +627,8 @@ static bool _getnext(qentry_t *entry, qentobj_t *obj, const char *name,
         }
         obj->size = cont->size;
         obj->next = cont->next;
+        obj->hash = cont->hash;
+        obj->child = cont->child;
 
         ret = true;
         break;
@@ -636,10 +663,11 @@ static int _remove(qentry_t *entry, const char *name)
 {
     if (entry == NULL || name == NULL) return 0;
 
+    uint32_t hash = qentry_hash(name, strlen(name));
     int removed = 0;
     qentobj_t *prev, *obj;
     for (prev = NULL, obj = entry->first; obj;) {
-        if (!strcmp(obj->name, name)) { // found
+        if (obj->hash == hash && !strcmp(obj->name, name)) { // found
             // copy next chain
             qentobj_t *next = obj->next;
 
@@ -648,6 +676,7 @@ static int _remove(qentry_t *entry, const char *name)
             removed++;
 
             // remove entry itself
+            if (obj->child != NULL) _free(obj->child);
             free(obj->name);
             free(obj->data);
             free(obj);
@@ -685,6 +714,7 @@ static bool _truncate(qentry_t *entry)
     qentobj_t *obj;
     for (obj = entry->first; obj;) {
         qentobj_t *next = obj->next;
+        if (obj->child != NULL) _free(obj->child);
         free(obj->name);
         free(obj->data);
         free(obj);
@@ -741,7 +771,7 @@ static bool _save(qentry_t *entry, const char *filepath)
 
     FILE *fd;
     if ((fd = fopen(filepath, "w")) == NULL) {
-        DEBUG("qentry_t->save(): Can't open file %s", filepath);
+        ERROR("qentry_t->save(): Can't open file %s", filepath);
         return false;
     }
 
@@ -808,14 +838,7 @@ static bool _print(qentry_t *entry, FILE *out, bool print_data)
 {
     if (entry == NULL || out == NULL) return false;
 
-    qentobj_t *obj;
-    for (obj = entry->first; obj; obj = obj->next) {
-        fprintf(out, "%s=%s (%lu)\n", obj->name,
-                (print_data?(char *)obj->data:"(data)"),
-                (unsigned long)obj->size);
-    }
-
-    return true;
+    return _print_tree(entry, out, print_data, NULL);
 }
 
 /**
@@ -834,3 +857,118 @@ static bool _free(qentry_t *entry)
     free(entry);
     return true;
 }
+
+/**
+ * qentry_t->gethash(): Find object with given name and its precomputed hash.
+ *
+ * @param   entry   qentry_t pointer
+ * @param   name    key name
+ * @param   hash    qentry_hash() of the name
+ * @param   size    if size is not NULL, object size will be stored.
+ * @param   newmem  whether or not to allocate memory for the data.
+ *
+ * @return  a pointer of data if key is found, otherwise returns NULL.
+ *
+ * @note
+ * Same as get() but the name is not hashed again. Only objects with the same
+ * hash are compared by name.
+ */
+static void *_gethash(qentry_t *entry, const char *name, uint32_t hash,
+                      size_t *size, bool newmem)
+{
+    if (entry == NULL || name == NULL) return NULL;
+
+    void *data = NULL;
+    qentobj_t *obj;
+    for (obj = entry->first; obj; obj = obj->next) {
+        if (obj->hash == hash && !strcmp(obj->name, name)) {
+            if (size != NULL) *size = obj->size;
+
+            if (newmem == true) {
+                data = malloc(obj->size);
+                memcpy(data, obj->data, obj->size);
+            } else {
+                data = obj->data;
+            }
+
+            break;
+        }
+    }
+
+    return data;
+}
+
+/**
+ * qentry_t->getchild(): Find nested container with given name.
+ *
+ * @param   entry   qentry_t pointer
+ * @param   name    key name
+ * @param   create  if true, a new empty container will be added when there's
+ *                  no nested container with the name.
+ *
+ * @return  a pointer of the nested container if found or created, otherwise
+ *          returns NULL.
+ *
+ * @code
+ *   // a[b][c]=1 parsed with qcgireq_setbracket()
+ *   qentry_t *a = req->getchild(req, "a", false);
+ *   qentry_t *b = (a != NULL) ? a->getchild(a, "b", false) : NULL;
+ *   char *c = (b != NULL) ? b->getstr(b, "c", false) : NULL;
+ * @endcode
+ *
+ * @note
+ * The nested container belongs to its parent and is freed with it. Its
+ * object stores an empty string as data. save() doesn't store nested
+ * containers.
+ */
+static qentry_t *_getchild(qentry_t *entry, const char *name, bool create)
+{
+    if (entry == NULL || name == NULL) return NULL;
+
+    uint32_t hash = qentry_hash(name, strlen(name));
+    qentobj_t *obj;
+    for (obj = entry->first; obj; obj = obj->next) {
+        if (obj->child != NULL && obj->hash == hash
+            && !strcmp(obj->name, name)) {
+            return obj->child;
+        }
+    }
+    if (create == false) return NULL;
+
+    qentry_t *child = qEntry();
+    if (child == NULL) return NULL;
+    if (_put(entry, name, "", 1, false) == false) {
+        _free(child);
+        return NULL;
+    }
+    entry->last->child = child;
+
+    return child;
+}
+
+// print nested containers with bracket names like a[b][c].
+static bool _print_tree(qentry_t *entry, FILE *out, bool print_data,
+                        const char *prefix)
+{
+    qentobj_t *obj;
+    for (obj = entry->first; obj; obj = obj->next) {
+        char *name = obj->name;
+        if (prefix != NULL) {
+            name = (char *)malloc(strlen(prefix) + strlen(obj->name) + 2 + 1);
+            if (name == NULL) return false;
+            sprintf(name, "%s[%s]", prefix, obj->name);
+        }
+
+        if (obj->child != NULL) {
+            _print_tree(obj->child, out, print_data, name);
+        } else {
+            fprintf(out, "%s=%s (%lu)\n", name,
+                    (print_data?(char *)obj->data:"(data)"),
+                    (unsigned long)obj->size);
+        }
+
+        if (name != obj->name) free(name);
+    }
+
+    return true;
+}